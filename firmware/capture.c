@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/pio.h"
+#include "hardware/timer.h"
+
+#include "hm2-fw.h"
+#include "hm2-dma.h"
+#include "capture.pio.h"
+
+
+// Timestamped, debounced input edges.
+//
+// This is not a hostmot2 Module (the hostmot2 drivers have nothing
+// like it), it's a block of registers for a host that knows about it,
+// next to the ioport: it watches GPIOs whatever they're used for, and
+// doesn't change them.
+//
+// All times are in microseconds, on the same clock as the DPLL's
+// Timestamp counter (0x7700).
+//
+// 0xe000  State (read only)
+//
+//     The debounced state of the watched GPIOs, bit N = GPIO N.
+//
+// 0xe004  Timestamp (read only)
+//
+//     When these registers were last updated.
+//
+// 0xe008  Edge count (read only)
+//
+//     Debounced edges seen so far, on all the watched GPIOs.
+//
+// 0xe00c  Overruns (read only)
+//
+//     How many times samples were lost, because core 1 didn't get to
+//     them before the ring buffer wrapped.  Edges can be missed when
+//     this goes up.
+//
+// 0xe010  Rise times (read only), one per GPIO (stride 4)
+//
+//     When each GPIO's last debounced rising edge happened.
+//
+// 0xe088  Fall times (read only), one per GPIO
+//
+//     When each GPIO's last debounced falling edge happened.
+//
+// 0xe100  Pins
+//
+//     Which GPIOs to watch, bit N = GPIO N.  A GPIO's debounced state
+//     starts out as its current state, without an edge.
+//
+// 0xe200  Filter times, one per GPIO (stride 4)
+//
+//     How long, in microseconds, each GPIO has to stay in a new state
+//     before that counts as an edge.  0 (the default) is no filtering.
+//
+// Everything the host reads every servo period is in 0xe000-0xe0ff, so
+// it's one 64-word read.
+//
+//
+// A PIO state machine samples all the GPIOs at CAPTURE_SAMPLE_HZ, and an
+// endless DMA stream (see hm2-dma.h) moves the samples into a ring
+// buffer (see capture.pio).
+// Every update, core 1 looks through the samples since the last update
+// for changes on the watched GPIOs.  The time of each sample is known
+// from its position in the sample stream, so an edge's time is as good
+// as the sample period however late core 1 gets to it.
+//
+// The time recorded for a debounced edge is when the GPIO went into the
+// state that then lasted the filter time, so the filter adds nothing to
+// the edge time, only to how soon the host sees it.
+
+
+#define CAPTURE_UPDATE_PERIOD_US 100
+
+#define CAPTURE_SAMPLE_HZ (1000 * 1000)
+
+// 2 KB, 512 us of samples at 1 MHz, 5 updates.
+#define CAPTURE_RING_WORDS 512
+#define CAPTURE_RING_BITS  11    // log2 of the ring size in bytes
+
+_Static_assert((CAPTURE_RING_WORDS * 4) == (1 << CAPTURE_RING_BITS), "capture ring size must be a power of 2");
+
+// When samples have been lost, skip to this many samples before the
+// newest, so the ones looked at aren't being overwritten.
+#define CAPTURE_RING_SAFE_WORDS (CAPTURE_RING_WORDS - 64)
+
+#define CAPTURE_GPIO_MASK ((1u << HM2_NUM_GPIOS) - 1)
+
+#define CAPTURE_REG(addr) (hm2_register_file32[(HM2_CAPTURE_ADDR + (addr)) / 4])
+
+#define CAPTURE_STATE      0x000
+#define CAPTURE_TIMESTAMP  0x004
+#define CAPTURE_EDGES      0x008
+#define CAPTURE_OVERRUNS   0x00c
+#define CAPTURE_RISE       0x010
+#define CAPTURE_FALL       0x088
+#define CAPTURE_PINS       0x100
+#define CAPTURE_FILTER     0x200
+
+_Static_assert(CAPTURE_FALL == CAPTURE_RISE + (HM2_NUM_GPIOS * 4), "capture rise and fall times overlap");
+_Static_assert(CAPTURE_FALL + (HM2_NUM_GPIOS * 4) == 0x100, "capture times don't fill the first page");
+
+
+static uint sm;
+static uint dma_chan;
+static uint32_t clkdiv;
+
+static uint32_t capture_ring[CAPTURE_RING_WORDS] __attribute__((aligned(CAPTURE_RING_WORDS * 4)));
+
+// When the state machine (re)started, in us.
+static uint64_t start_us;
+
+// Samples looked at since the state machine started.
+static uint64_t samples;
+
+// Samples taken since the state machine started, and the DMA stream's
+// count of transfers when that was last brought up to date.
+static uint64_t total;
+static uint32_t stream_transfers;
+
+// State of the watched GPIOs, owned by core 1.
+static uint32_t watched;
+static uint32_t raw;
+static uint32_t debounced;
+
+// The sample at which each GPIO's raw state last changed.
+static uint64_t raw_change[HM2_NUM_GPIOS];
+
+// Filter times in samples, written by core 0.
+static uint32_t volatile filter_samples[HM2_NUM_GPIOS];
+
+
+// Start sampling from scratch, at sample 0.  Also used if the state
+// machine ever stalls, which would throw off the sample times.
+static void capture_start(void) {
+    pio_sm_set_enabled(pio1, sm, false);
+    hm2_dma_stream_stop(dma_chan);
+    pio_sm_clear_fifos(pio1, sm);
+    pio_sm_restart(pio1, sm);
+    pio1->fdebug = 1u << (PIO_FDEBUG_RXSTALL_LSB + sm);
+
+    hm2_dma_stream_start(dma_chan, capture_ring, &pio1->rxf[sm]);
+
+    samples = 0;
+    total = 0;
+    stream_transfers = 0;
+    for (int i = 0; i < HM2_NUM_GPIOS; ++i) {
+        raw_change[i] = 0;
+    }
+
+    start_us = time_us_64();
+    pio_sm_set_enabled(pio1, sm, true);
+}
+
+
+// The sample's time in cycles, split into whole seconds and the rest,
+// so it doesn't overflow 64 bits however long the firmware runs.
+static inline uint32_t capture_sample_us(uint64_t sample) {
+    uint64_t cycles = sample * clkdiv;
+    uint32_t hz = clock_get_hz(clk_sys);
+    return start_us + ((cycles / hz) * 1000 * 1000) + (((cycles % hz) * 1000 * 1000) / hz);
+}
+
+
+// If GPIO `pin`'s raw state has lasted its filter time as of sample
+// `now`, make it the debounced state.
+static void capture_settle(int pin, uint64_t now) {
+    uint32_t bit = 1u << pin;
+
+    if (((raw ^ debounced) & bit) == 0) {
+        return;
+    }
+    if ((now - raw_change[pin]) < filter_samples[pin]) {
+        return;
+    }
+
+    debounced ^= bit;
+    uint32_t reg = (debounced & bit) ? CAPTURE_RISE : CAPTURE_FALL;
+    CAPTURE_REG(reg + (pin * 4)) = capture_sample_us(raw_change[pin]);
+    CAPTURE_REG(CAPTURE_EDGES) += 1;
+}
+
+
+static void capture_update(void) {
+    if (pio1->fdebug & (1u << (PIO_FDEBUG_RXSTALL_LSB + sm))) {
+        CAPTURE_REG(CAPTURE_OVERRUNS) += 1;
+        capture_start();
+    }
+
+    uint32_t transfers = hm2_dma_stream_transfers(dma_chan);
+    total += (transfers - stream_transfers) & HM2_DMA_STREAM_MASK;
+    stream_transfers = transfers;
+    if (total == 0) {
+        return;
+    }
+
+    hm2_fw_publish_begin(HM2_CAPTURE_ADDR);
+
+    if ((total - samples) > CAPTURE_RING_SAFE_WORDS) {
+        CAPTURE_REG(CAPTURE_OVERRUNS) += 1;
+        samples = total - CAPTURE_RING_SAFE_WORDS;
+    }
+
+    for (; samples != total; ++samples) {
+        uint32_t changed = (capture_ring[samples % CAPTURE_RING_WORDS] ^ raw) & watched;
+        while (changed != 0) {
+            int pin = __builtin_ctz(changed);
+            changed &= changed - 1;
+
+            // A change that had already lasted its filter time is an
+            // edge, even though it's ending now.
+            capture_settle(pin, samples);
+            raw ^= 1u << pin;
+            raw_change[pin] = samples;
+            capture_settle(pin, samples);
+        }
+    }
+
+    uint32_t pending = raw ^ debounced;
+    while (pending != 0) {
+        int pin = __builtin_ctz(pending);
+        pending &= pending - 1;
+        capture_settle(pin, total);
+    }
+
+    uint32_t pins = CAPTURE_REG(CAPTURE_PINS) & CAPTURE_GPIO_MASK;
+    if (pins != watched) {
+        // Newly watched GPIOs start out settled in their current state.
+        uint32_t added = pins & ~watched;
+        uint32_t level = capture_ring[(total - 1) % CAPTURE_RING_WORDS] & added;
+        raw = ((raw & ~added) | level) & pins;
+        debounced = ((debounced & ~added) | level) & pins;
+        watched = pins;
+    }
+
+    CAPTURE_REG(CAPTURE_STATE) = debounced;
+    CAPTURE_REG(CAPTURE_TIMESTAMP) = time_us_32();
+
+    hm2_fw_publish_end(HM2_CAPTURE_ADDR);
+}
+
+
+static int capture_write(uint16_t addr, uint32_t const * buf, size_t num_uint32) {
+    for (size_t i = 0; i < num_uint32; ++i) {
+        if (addr == CAPTURE_PINS) {
+            CAPTURE_REG(addr) = buf[i];
+        } else if ((addr >= CAPTURE_FILTER) && (addr < CAPTURE_FILTER + (HM2_NUM_GPIOS * 4))) {
+            int pin = (addr - CAPTURE_FILTER) / 4;
+            CAPTURE_REG(addr) = buf[i];
+            filter_samples[pin] = ((uint64_t)buf[i] * clock_get_hz(clk_sys)) / ((uint64_t)clkdiv * 1000 * 1000);
+        }
+        addr += 4;
+    }
+    return 0;
+}
+
+
+static int capture_init(void) {
+    if (!pio_can_add_program(pio1, &capture_program)) {
+        printf("capture: no room for the PIO program\n");
+        return -1;
+    }
+    uint offset = pio_add_program(pio1, &capture_program);
+
+    int s = pio_claim_unused_sm(pio1, false);
+    if (s < 0) {
+        printf("capture: no free PIO state machine\n");
+        return -1;
+    }
+    sm = s;
+
+    clkdiv = clock_get_hz(clk_sys) / CAPTURE_SAMPLE_HZ;
+    if (clkdiv < 1) {
+        clkdiv = 1;
+    }
+    capture_program_init(pio1, sm, offset, clkdiv);
+
+    dma_chan = dma_claim_unused_channel(true);
+    dma_channel_config c = dma_channel_get_default_config(dma_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_ring(&c, true, CAPTURE_RING_BITS);
+    channel_config_set_dreq(&c, pio_get_dreq(pio1, sm, false));
+    if (hm2_dma_stream_init(dma_chan, &c) < 0) {
+        return -1;
+    }
+
+    watched = 0;
+    raw = 0;
+    debounced = 0;
+    for (int i = 0; i < HM2_NUM_GPIOS; ++i) {
+        filter_samples[i] = 0;
+    }
+
+    capture_start();
+
+    return 0;
+}
+
+
+hm2_region_t const hm2_capture_region = {
+    .name = "capture",
+    .addr = HM2_CAPTURE_ADDR,
+    .size = HM2_CAPTURE_SIZE,
+    .init = capture_init,
+    .update = capture_update,
+    .period_us = CAPTURE_UPDATE_PERIOD_US,
+    .write = capture_write,
+};
@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+
+#include "hm2-fw.h"
+
+
+// 0x7000  Base rate
+//
+//     The nominal reference frequency, as a DDS rate: the reference
+//     frequency is (ClockLow / prescale) * rate / 2^32.  0 turns the
+//     DPLL off.
+//
+// 0x7100  Phase error (read only)
+//
+//     The most recent reference's arrival time minus its predicted
+//     time, signed, 2^32 = one reference period.
+//
+// 0x7200  Control 0
+//
+//     Bits 31:24:  Prescale (0 is the same as 1)
+//     Bits 15:0:   Loop filter time constant, in reference periods
+//                  (256-65535, 0 = 2000)
+//
+// 0x7300  Control 1
+//
+//     Bits 23:0:   Frequency limit: the DPLL can move the reference
+//                  period up to nominal * limit / 2^32 from nominal
+//     Bit 31:      Locked (read only)
+//
+// 0x7400  Timers 1 and 2
+// 0x7500  Timers 3 and 4
+//
+//     Bits 15:0 are timer 1 (or 3), bits 31:16 timer 2 (or 4).  Each is
+//     when the timer fires relative to the predicted reference, signed,
+//     65536 = one reference period.  Negative is before the reference.
+//
+// 0x7600  Sync
+//
+//     Writing anything here is the reference event.  The host writes it
+//     once per servo period.
+//
+// 0x7700  Timestamp counter (read only)
+//
+//     Free-running, in microseconds.  This register isn't counted in
+//     the Module Descriptor, hostmot2 drivers don't know about it.
+//
+//
+// The reference is when the write to the Sync register is processed,
+// so it carries the network's jitter.  The DPLL filters that out and
+// predicts when the next references will be, and Modules that set
+// `.sample` in their region run it at one of the timers, in lockstep
+// with the host's servo thread instead of whenever a packet happens to
+// arrive (see hm2_dpll_timer_us()).
+//
+// The loop filter is a second-order (proportional plus integral) loop
+// with a proportional gain of 64 / time constant and an integral gain
+// of 1 / time constant, which is about critically damped for the
+// default time constant.
+//
+// The reference is processed on core 0 and the predictions are used on
+// core 1, so they're handed over with a sequence counter.
+
+
+#define DPLL_REG(reg) (hm2_register_file32[(HM2_DPLL_ADDR + ((reg) * 0x100)) / 4])
+
+#define DPLL_BASE_RATE    0
+#define DPLL_PHASE_ERROR  1
+#define DPLL_CONTROL_0    2
+#define DPLL_CONTROL_1    3
+#define DPLL_TIMER_12     4
+#define DPLL_TIMER_34     5
+#define DPLL_SYNC         6
+#define DPLL_TSC          7
+
+#define DPLL_CONTROL_1_LOCKED (1u << 31)
+#define DPLL_PLIMIT_MASK      0x00ffffff
+
+#define DPLL_DEFAULT_TIME_CONSTANT 2000
+#define DPLL_MIN_TIME_CONSTANT     256
+
+// References in a row within the lock window before the DPLL says it's
+// locked.
+#define DPLL_LOCK_COUNT 16
+
+// With no reference for this many periods, the host has stopped and
+// the predictions are worthless.
+#define DPLL_TIMEOUT_PERIODS 4
+
+// Times are in microseconds, in 48.16 fixed point.
+#define DPLL_FP_SHIFT 16
+
+
+// Everything core 1 needs, published by core 0.
+typedef struct {
+    bool running;
+    bool locked;
+    int64_t next_ref;
+    int64_t period;
+    int16_t timer[HM2_DPLL_NUM_TIMERS];
+
+    // When the last reference arrived, in us.
+    uint64_t last_ref_us;
+} dpll_prediction_t;
+
+
+static dpll_prediction_t prediction;
+static uint32_t volatile prediction_seq;
+
+// Loop state, only used on core 0.
+static bool acquired;
+static int64_t nominal_period;
+static int64_t max_adjust;
+static int64_t adjust;
+static int32_t time_constant = DPLL_DEFAULT_TIME_CONSTANT;
+static int lock_count;
+static int32_t phase_error;
+
+
+static void dpll_publish(dpll_prediction_t const * p) {
+    prediction_seq = prediction_seq + 1;
+    __dmb();
+    prediction = *p;
+    __dmb();
+    prediction_seq = prediction_seq + 1;
+}
+
+
+static void dpll_snapshot(dpll_prediction_t * p) {
+    uint32_t seq;
+    do {
+        seq = prediction_seq;
+        __dmb();
+        *p = prediction;
+        __dmb();
+    } while ((seq & 1) || (seq != prediction_seq));
+}
+
+
+static int64_t dpll_abs(int64_t x) {
+    return (x < 0) ? -x : x;
+}
+
+
+// Recompute the loop parameters after the host changes the base rate
+// or the control registers, and start acquiring again.
+static void dpll_configure(void) {
+    uint32_t rate = DPLL_REG(DPLL_BASE_RATE);
+    uint32_t control_0 = DPLL_REG(DPLL_CONTROL_0);
+    uint32_t plimit = DPLL_REG(DPLL_CONTROL_1) & DPLL_PLIMIT_MASK;
+    uint32_t prescale = control_0 >> 24;
+    if (prescale == 0) {
+        prescale = 1;
+    }
+
+    time_constant = control_0 & 0xffff;
+    if (time_constant == 0) {
+        time_constant = DPLL_DEFAULT_TIME_CONSTANT;
+    } else if (time_constant < DPLL_MIN_TIME_CONSTANT) {
+        time_constant = DPLL_MIN_TIME_CONSTANT;
+    }
+
+    if (rate == 0) {
+        nominal_period = 0;
+    } else {
+        // Only on register writes, so the floating point is fine.
+        nominal_period = (int64_t)((1000.0 * 1000.0 * (1 << DPLL_FP_SHIFT) * 4294967296.0 * prescale) / ((double)clock_get_hz(clk_sys) * rate));
+    }
+    max_adjust = (nominal_period * plimit) >> 32;
+
+    dpll_prediction_t p = prediction;
+    p.running = false;
+    p.locked = false;
+    p.period = nominal_period;
+    for (int i = 0; i < HM2_DPLL_NUM_TIMERS; ++i) {
+        uint32_t reg = DPLL_REG(DPLL_TIMER_12 + (i / 2));
+        p.timer[i] = (int16_t)(reg >> (16 * (i % 2)));
+    }
+    dpll_publish(&p);
+
+    acquired = false;
+    adjust = 0;
+    lock_count = 0;
+    phase_error = 0;
+}
+
+
+// The host's reference event, at `now_us`.
+static void dpll_reference(uint64_t now_us) {
+    if (nominal_period == 0) {
+        return;
+    }
+
+    dpll_prediction_t p = prediction;
+    p.last_ref_us = now_us;
+    int64_t now = (int64_t)now_us << DPLL_FP_SHIFT;
+    int64_t error = now - p.next_ref;
+
+    if (!acquired || (dpll_abs(error) > (p.period / 2))) {
+        // First reference, or the host skipped or doubled one: start
+        // over from this one.
+        acquired = true;
+        adjust = 0;
+        lock_count = 0;
+        phase_error = 0;
+        p.running = true;
+        p.locked = false;
+        p.period = nominal_period;
+        p.next_ref = now + p.period;
+        dpll_publish(&p);
+        return;
+    }
+
+    adjust += error / time_constant;
+    if (adjust > max_adjust) {
+        adjust = max_adjust;
+    } else if (adjust < -max_adjust) {
+        adjust = -max_adjust;
+    }
+
+    p.period = nominal_period + adjust;
+    p.next_ref += p.period + ((error * 64) / time_constant);
+
+    // 2^32 is one period.  (error << 32) would overflow for errors over
+    // 2^15 us, which periods over 65 ms allow.
+    phase_error = (error << 16) / (p.period >> DPLL_FP_SHIFT);
+
+    if (dpll_abs(error) < (p.period / 8)) {
+        if (lock_count < DPLL_LOCK_COUNT) {
+            ++lock_count;
+        }
+    } else {
+        lock_count = 0;
+    }
+    p.locked = (lock_count >= DPLL_LOCK_COUNT);
+
+    dpll_publish(&p);
+}
+
+
+// True if references are arriving, so the predictions mean something.
+static bool dpll_tracking(dpll_prediction_t const * p, uint64_t now_us) {
+    if (!p->running) {
+        return false;
+    }
+    uint64_t timeout = (DPLL_TIMEOUT_PERIODS * p->period) >> DPLL_FP_SHIFT;
+    return (now_us - p->last_ref_us) < timeout;
+}
+
+
+bool hm2_dpll_locked(void) {
+    dpll_prediction_t p;
+    dpll_snapshot(&p);
+    return p.locked && dpll_tracking(&p, time_us_64());
+}
+
+
+// The first time later than `after` (fixed point us) that something
+// happens at `offset` from the predicted references (65536 = one
+// reference period), rounded up to whole us.
+static uint64_t dpll_next_us(dpll_prediction_t const * p, int16_t offset, int64_t after) {
+    // It happens at first + m * period, for every integer m.
+    int64_t first = p->next_ref + ((p->period * offset) >> 16);
+
+    int64_t m = (after - first) / p->period;
+    int64_t t = first + (m * p->period);
+    while (t <= after) {
+        t += p->period;
+    }
+    while ((t - p->period) > after) {
+        t -= p->period;
+    }
+
+    return (t + (1 << DPLL_FP_SHIFT) - 1) >> DPLL_FP_SHIFT;
+}
+
+
+uint64_t hm2_dpll_timer_us(int timer, uint64_t after_us) {
+    dpll_prediction_t p;
+    dpll_snapshot(&p);
+
+    if (!dpll_tracking(&p, time_us_64()) || (p.period <= 0)) {
+        return UINT64_MAX;
+    }
+
+    int64_t after = ((int64_t)after_us << DPLL_FP_SHIFT) + (p.period / 2);
+    return dpll_next_us(&p, p.timer[timer - 1], after);
+}
+
+
+uint64_t hm2_dpll_next_us(int timer, uint64_t after_us) {
+    dpll_prediction_t p;
+    dpll_snapshot(&p);
+
+    if (!dpll_tracking(&p, time_us_64()) || (p.period <= 0)) {
+        return UINT64_MAX;
+    }
+
+    int16_t offset = (timer == 0) ? 0 : p.timer[timer - 1];
+    return dpll_next_us(&p, offset, (int64_t)after_us << DPLL_FP_SHIFT);
+}
+
+
+static int dpll_write(uint16_t addr, uint32_t const * buf, size_t num_uint32) {
+    bool reconfigure = false;
+
+    for (size_t i = 0; i < num_uint32; ++i) {
+        uint16_t reg = (addr >> 8);
+
+        if ((addr & 0xff) == 0) {
+            if (reg == DPLL_SYNC) {
+                dpll_reference(time_us_64());
+            } else if ((reg != DPLL_PHASE_ERROR) && (reg != DPLL_TSC)) {
+                DPLL_REG(reg) = buf[i];
+                reconfigure = true;
+            }
+        }
+
+        addr += 4;
+    }
+
+    if (reconfigure) {
+        dpll_configure();
+    }
+    return 0;
+}
+
+
+static int dpll_read(uint16_t addr, uint32_t * buf, size_t num_uint32) {
+    for (size_t i = 0; i < num_uint32; ++i) {
+        uint16_t reg = (addr >> 8);
+
+        if ((addr & 0xff) != 0) {
+            buf[i] = 0;
+        } else if (reg == DPLL_PHASE_ERROR) {
+            buf[i] = phase_error;
+        } else if (reg == DPLL_CONTROL_1) {
+            buf[i] = DPLL_REG(reg) | (hm2_dpll_locked() ? DPLL_CONTROL_1_LOCKED : 0);
+        } else if (reg == DPLL_TSC) {
+            buf[i] = time_us_32();
+        } else {
+            buf[i] = DPLL_REG(reg);
+        }
+
+        addr += 4;
+    }
+    return 0;
+}
+
+
+static int dpll_init(void) {
+    dpll_configure();
+    return 0;
+}
+
+
+hm2_region_t const hm2_dpll_region = {
+    .name = "dpll",
+    .addr = HM2_DPLL_ADDR,
+    .size = HM2_DPLL_SIZE,
+    .init = dpll_init,
+    .write = dpll_write,
+    .read = dpll_read,
+};
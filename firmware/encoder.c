@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/gpio.h"
+#include "hardware/pio.h"
+#include "hardware/timer.h"
+
+#include "hm2-fw.h"
+#include "hm2-dma.h"
+#include "encoder.pio.h"
+
+
+// 0x3000  Count, one per instance (stride 4)
+//
+//     Bits 15:0 are the count, bits 31:16 the timestamp of the last
+//     count change.  Writes are ignored.
+//
+// 0x3100  Latch/Control, one per instance
+//
+//     Bits 31:16 are the count latched at index (read only).
+//
+//     Bit 15:  Quadrature error (always 0, invalid transitions are
+//              ignored)
+//     Bit 14:  AB mask polarity (ignored)
+//     Bit 13:  Latch on probe (ignored)
+//     Bit 12:  Probe polarity (ignored)
+//     Bit 11:  Filter: a new count has to last 15 filter clocks, not 3
+//     Bit 10:  Counter mode (ignored, always quadrature)
+//     Bit 9:   Index mask (ignored)
+//     Bit 8:   Index mask polarity (ignored)
+//     Bit 6:   Latch and clear on index just once, then clear bits 4
+//              and 5
+//     Bit 5:   Clear the count on index
+//     Bit 4:   Latch the count on index
+//     Bit 3:   Index polarity, 1 = active high
+//     Bit 2:   Index input (read only)
+//     Bit 1:   B input (read only)
+//     Bit 0:   A input (read only)
+//
+// 0x3200  Timestamp divisor
+//
+//     The timestamp clock is ClockLow / (divisor + 2).
+//
+// 0x3300  Timestamp count
+//
+//     The timestamp clock, at the time the counts were read.  Read only.
+//
+// 0x3400  Filter rate
+//
+//     Bits 11:0, the filter clock is ClockLow / (rate + 2).  The other
+//     bits are ignored.
+//
+//
+// Each encoder is a PIO state machine that decodes A and B and pushes
+// the new count, with the time, every time the count changes (see
+// encoder.pio).  An endless DMA stream (see hm2-dma.h) empties its
+// FIFO into a small ring buffer, so however fast the count changes it
+// costs core 1 nothing: every update, core 1 just picks up the newest
+// entry.  Only while latch or clear on index is armed does it look at
+// all the entries since the last update, to find the index edge.
+//
+// The PIO loop counter wraps every 2^13 passes, about 0.9 ms at
+// 133 MHz, so the update period must be well under that.
+//
+// There's no room left in PIO1 to filter the inputs in the state
+// machine, so the filter works on the counts instead: a count is only
+// published once it has lasted the filter time (see the Filter bit and
+// the filter rate), so a glitch shorter than that, which the decoder
+// counts and then counts back, never shows.  The timestamp is still
+// when the count changed.  Index isn't filtered.
+
+
+#define ENCODER_UPDATE_PERIOD_US 100
+
+// The encoders share PIO1, the program only leaves room for the
+// one-instruction capture program there (which takes a state machine
+// too, when it's compiled in).
+#define ENCODER_MAX_INSTANCES 4
+
+// Cycles per pass through the PIO program's loop.
+#define ENCODER_LOOP_CYCLES 15
+
+#define ENCODER_RING_WORDS 64
+#define ENCODER_RING_BITS  8     // log2 of the ring size in bytes
+
+_Static_assert((ENCODER_RING_WORDS * 4) == (1 << ENCODER_RING_BITS), "encoder ring size must be a power of 2");
+
+#define ENCODER_REG(reg, instance) (hm2_register_file32[((HM2_ENCODER_ADDR + ((reg) * 0x100)) / 4) + (instance)])
+
+#define ENCODER_COUNT          0
+#define ENCODER_LATCH_CONTROL  1
+#define ENCODER_TS_DIV         2
+#define ENCODER_TS_COUNT       3
+#define ENCODER_FILTER_RATE    4
+
+#define ENCODER_INPUT_A            (1 << 0)
+#define ENCODER_INPUT_B            (1 << 1)
+#define ENCODER_INPUT_INDEX        (1 << 2)
+#define ENCODER_INDEX_POLARITY     (1 << 3)
+#define ENCODER_LATCH_ON_INDEX     (1 << 4)
+#define ENCODER_CLEAR_ON_INDEX     (1 << 5)
+#define ENCODER_INDEX_JUSTONCE     (1 << 6)
+#define ENCODER_FILTER             (1 << 11)
+#define ENCODER_CONTROL_MASK       0x7ff8
+
+
+typedef struct {
+    uint sm;
+    uint dma_chan;
+    uint a_pin;
+
+    // DMA transfers (FIFO entries) handled so far, mod 2^31.
+    uint32_t events;
+
+    // The newest FIFO entry.
+    uint32_t last_event;
+
+    // PIO loop pass of the newest FIFO entry.
+    uint64_t last_event_pass;
+
+    // The newest FIFO entry that has lasted the filter time, and its
+    // pass.  This is what's published.
+    uint32_t settled_event;
+    uint64_t settled_pass;
+
+    // Subtracted from the PIO's count, set when the count is cleared on
+    // index.
+    uint16_t offset;
+    uint16_t latch;
+
+    bool index_active;
+
+    // Control bits, owned by core 1.
+    uint32_t control;
+} encoder_t;
+
+
+static encoder_t encoder[ENCODER_MAX_INSTANCES];
+
+static uint32_t encoder_ring[ENCODER_MAX_INSTANCES][ENCODER_RING_WORDS] __attribute__((aligned(ENCODER_RING_WORDS * 4)));
+
+// Control register writes from the host, handed from core 0 to core 1.
+static uint32_t volatile control_written[ENCODER_MAX_INSTANCES];
+static uint32_t volatile control_write_seq[ENCODER_MAX_INSTANCES];
+static uint32_t control_read_seq[ENCODER_MAX_INSTANCES];
+
+// When the state machines started, in us.
+static uint64_t start_us;
+
+extern uint8_t const hm2_encoder_instances;
+
+
+static inline uint16_t event_count(uint32_t event) {
+    return event & 0xffff;
+}
+
+
+static inline uint32_t event_pass13(uint32_t event) {
+    // X counts down from 0.
+    return -(event >> 16) & 0x1fff;
+}
+
+
+static inline bool event_index(uint32_t event) {
+    return (event >> 31) & 0x1;
+}
+
+
+// The full pass number of an entry pushed less than 2^13 passes ago.
+// `now_pass` comes from the us timer so it can be a few passes behind
+// the PIO, allow for that.
+static uint64_t event_pass(uint32_t event, uint64_t now_pass) {
+    uint32_t ago = (now_pass - event_pass13(event)) & 0x1fff;
+    if (ago > 0x1f00) {
+        return now_pass + (0x2000 - ago);
+    }
+    return now_pass - ago;
+}
+
+
+// How many passes a count has to last to get through the filter, given
+// the Filter bit in `control`.
+static uint32_t encoder_filter_passes(uint32_t control, uint32_t filter_rate) {
+    uint32_t clocks = (control & ENCODER_FILTER) ? 15 : 3;
+    return ((clocks * (filter_rate + 2)) + ENCODER_LOOP_CYCLES - 1) / ENCODER_LOOP_CYCLES;
+}
+
+
+// Handle the index edge in `event`, if the index input just became
+// active.
+static void encoder_check_index(encoder_t * e, uint32_t event) {
+    bool active = (event_index(event) == !!(e->control & ENCODER_INDEX_POLARITY));
+    bool edge = active && !e->index_active;
+    e->index_active = active;
+
+    if (!edge || !(e->control & (ENCODER_LATCH_ON_INDEX | ENCODER_CLEAR_ON_INDEX))) {
+        return;
+    }
+
+    uint16_t count = event_count(event) - e->offset;
+    if (e->control & ENCODER_LATCH_ON_INDEX) {
+        e->latch = count;
+    }
+    if (e->control & ENCODER_CLEAR_ON_INDEX) {
+        e->offset = event_count(event);
+    }
+    if (e->control & ENCODER_INDEX_JUSTONCE) {
+        e->control &= ~(ENCODER_LATCH_ON_INDEX | ENCODER_CLEAR_ON_INDEX);
+    }
+}
+
+
+// `event` has lasted the filter time.  A glitch that came and went
+// leaves the count as it was, and the timestamp with it.
+static void encoder_settle(encoder_t * e, uint32_t event, uint64_t pass) {
+    if (event_count(event) != event_count(e->settled_event)) {
+        e->settled_pass = pass;
+    }
+    e->settled_event = event;
+}
+
+
+static void encoder_update_instance(encoder_t * e, int instance, uint64_t now_pass, uint32_t ts_div, uint32_t filter_rate, uint32_t inputs, bool publish) {
+    uint32_t * ring = encoder_ring[instance];
+
+    if (control_write_seq[instance] != control_read_seq[instance]) {
+        control_read_seq[instance] = control_write_seq[instance];
+        e->control = control_written[instance] & ENCODER_CONTROL_MASK;
+    }
+
+    uint32_t events = hm2_dma_stream_transfers(e->dma_chan);
+    uint32_t newest = (dma_channel_hw_addr(e->dma_chan)->write_addr - (uintptr_t)ring) / 4;
+    newest = (newest + ENCODER_RING_WORDS - 1) % ENCODER_RING_WORDS;
+
+    uint32_t num_new = (events - e->events) & HM2_DMA_STREAM_MASK;
+    e->events = events;
+    if (num_new > ENCODER_RING_WORDS) {
+        num_new = ENCODER_RING_WORDS;
+    }
+
+    bool index = e->control & (ENCODER_LATCH_ON_INDEX | ENCODER_CLEAR_ON_INDEX);
+    uint32_t filter = encoder_filter_passes(e->control, filter_rate);
+
+    if (num_new > 0) {
+        if (index || (filter > 1)) {
+            for (uint32_t i = num_new; i > 0; --i) {
+                uint32_t event = ring[(newest + 1 - i + ENCODER_RING_WORDS) % ENCODER_RING_WORDS];
+                if (index) {
+                    encoder_check_index(e, event);
+                }
+
+                // Each entry ends the count before it.
+                uint64_t pass = event_pass(event, now_pass);
+                if ((pass - e->last_event_pass) >= filter) {
+                    encoder_settle(e, e->last_event, e->last_event_pass);
+                }
+                e->last_event = event;
+                e->last_event_pass = pass;
+            }
+        }
+
+        e->last_event = ring[newest];
+        e->last_event_pass = event_pass(e->last_event, now_pass);
+        e->index_active = (event_index(e->last_event) == !!(e->control & ENCODER_INDEX_POLARITY));
+    }
+
+    // The newest entry's pass can be a little ahead of `now_pass`.
+    if ((filter <= 1) || ((int64_t)(now_pass - e->last_event_pass) >= filter)) {
+        encoder_settle(e, e->last_event, e->last_event_pass);
+    }
+
+    if (!publish) {
+        return;
+    }
+
+    uint32_t timestamp = (e->settled_pass * ENCODER_LOOP_CYCLES) / (ts_div + 2);
+    uint16_t count = event_count(e->settled_event) - e->offset;
+    ENCODER_REG(ENCODER_COUNT, instance) = (timestamp << 16) | count;
+
+    uint32_t pins = (inputs >> e->a_pin) & (ENCODER_INPUT_A | ENCODER_INPUT_B | ENCODER_INPUT_INDEX);
+    ENCODER_REG(ENCODER_LATCH_CONTROL, instance) = ((uint32_t)e->latch << 16) | e->control | pins;
+}
+
+
+// Pick up the new counts and handle index.  If `publish` is true, also
+// publish the counts to the host.
+static void encoder_run(bool publish) {
+    // In whole seconds and the rest, so it doesn't overflow 64 bits
+    // however long the firmware runs.
+    uint64_t now_us = time_us_64() - start_us;
+    uint32_t hz = clock_get_hz(clk_sys);
+    uint64_t now_cycles = ((now_us / (1000 * 1000)) * hz) + (((now_us % (1000 * 1000)) * hz) / (1000 * 1000));
+    uint64_t now_pass = now_cycles / ENCODER_LOOP_CYCLES;
+    uint32_t ts_div = ENCODER_REG(ENCODER_TS_DIV, 0) & 0xffff;
+    uint32_t filter_rate = ENCODER_REG(ENCODER_FILTER_RATE, 0) & 0xfff;
+    uint32_t inputs = gpio_get_all();
+
+    if (publish) {
+        hm2_fw_publish_begin(HM2_ENCODER_ADDR);
+    }
+    for (int i = 0; i < hm2_encoder_instances; ++i) {
+        encoder_update_instance(&encoder[i], i, now_pass, ts_div, filter_rate, inputs, publish);
+    }
+    if (publish) {
+        ENCODER_REG(ENCODER_TS_COUNT, 0) = now_cycles / (ts_div + 2);
+        hm2_fw_publish_end(HM2_ENCODER_ADDR);
+    }
+}
+
+
+// While the DPLL is locked the counts are published only at DPLL timer
+// 1, so the host sees them as of the same point in every servo period.
+// Index still has to be handled every update, before the ring buffer
+// wraps.
+static void encoder_update(void) {
+    encoder_run(!hm2_dpll_locked());
+}
+
+
+static void encoder_sample(void) {
+    encoder_run(true);
+}
+
+
+static int encoder_write(uint16_t addr, uint32_t const * buf, size_t num_uint32) {
+    for (size_t i = 0; i < num_uint32; ++i) {
+        uint16_t reg = (addr >> 8);
+        uint16_t instance = (addr & 0xff) / 4;
+
+        if (reg == ENCODER_LATCH_CONTROL) {
+            if (instance < hm2_encoder_instances) {
+                control_written[instance] = buf[i];
+                ++control_write_seq[instance];
+            }
+        } else if ((reg != ENCODER_COUNT) && (reg != ENCODER_TS_COUNT)) {
+            hm2_register_file32[(HM2_ENCODER_ADDR + addr) / 4] = buf[i];
+        }
+
+        addr += 4;
+    }
+    return 0;
+}
+
+
+static int encoder_init(void) {
+    if (hm2_encoder_instances > ENCODER_MAX_INSTANCES) {
+        printf("encoder: %d instances requested, max is %d\n", hm2_encoder_instances, ENCODER_MAX_INSTANCES);
+        return -1;
+    }
+
+    if (!pio_can_add_program_at_offset(pio1, &encoder_program, 0)) {
+        printf("encoder: no room for the PIO program\n");
+        return -1;
+    }
+    pio_add_program_at_offset(pio1, &encoder_program, 0);
+
+    uint32_t sm_mask = 0;
+
+    for (int i = 0; i < hm2_encoder_instances; ++i) {
+        encoder_t * e = &encoder[i];
+
+        int a_pin = hm2_fw_find_pin(HM2_GTAG_ENCODER, i, HM2_ENCODER_A);
+        if (
+            (a_pin < 0)
+            || (hm2_fw_find_pin(HM2_GTAG_ENCODER, i, HM2_ENCODER_B) != a_pin + 1)
+            || (hm2_fw_find_pin(HM2_GTAG_ENCODER, i, HM2_ENCODER_INDEX) != a_pin + 2)
+        ) {
+            printf("encoder %d: A, B, and Index must be on consecutive pins in the pin map\n", i);
+            return -1;
+        }
+
+        int sm = pio_claim_unused_sm(pio1, false);
+        if (sm < 0) {
+            printf("encoder %d: no free PIO state machine\n", i);
+            return -1;
+        }
+
+        e->sm = sm;
+        e->a_pin = a_pin;
+        e->events = 0;
+        e->last_event = 0;
+        e->last_event_pass = 0;
+        e->settled_event = 0;
+        e->settled_pass = 0;
+        e->offset = 0;
+        e->latch = 0;
+        e->index_active = false;
+        e->control = 0;
+
+        encoder_program_init(pio1, e->sm, e->a_pin);
+
+        e->dma_chan = dma_claim_unused_channel(true);
+        dma_channel_config c = dma_channel_get_default_config(e->dma_chan);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+        channel_config_set_read_increment(&c, false);
+        channel_config_set_write_increment(&c, true);
+        channel_config_set_ring(&c, true, ENCODER_RING_BITS);
+        channel_config_set_dreq(&c, pio_get_dreq(pio1, e->sm, false));
+        if (hm2_dma_stream_init(e->dma_chan, &c) < 0) {
+            return -1;
+        }
+        hm2_dma_stream_start(e->dma_chan, encoder_ring[i], &pio1->rxf[e->sm]);
+
+        sm_mask |= 1u << e->sm;
+    }
+
+    // Start them together, their loop counters all count the same time.
+    pio_enable_sm_mask_in_sync(pio1, sm_mask);
+    start_us = time_us_64();
+
+    return 0;
+}
+
+
+hm2_region_t const hm2_encoder_region = {
+    .name = "encoder",
+    .addr = HM2_ENCODER_ADDR,
+    .size = HM2_ENCODER_SIZE,
+    .init = encoder_init,
+    .update = encoder_update,
+    .period_us = ENCODER_UPDATE_PERIOD_US,
+    .sample = encoder_sample,
+    .dpll_timer = 1,
+    .write = encoder_write,
+};
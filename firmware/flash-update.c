@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/flash.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "hardware/watchdog.h"
+
+#include "hm2-fw.h"
+#include "flash-update.h"
+
+
+// How many erases and page programs can be waiting.  Enough for the
+// pages of several full packets.
+#define FLASH_QUEUE_LEN 16
+
+typedef struct {
+    uint32_t offset;
+    uint32_t erase_size;        // bytes left to erase, or 0 to program
+    uint8_t page[FLASH_PAGE_SIZE];
+} flash_op_t;
+
+static flash_op_t flash_queue[FLASH_QUEUE_LEN];
+static uint flash_queue_head;
+static uint flash_queue_len;
+
+// The page that FlashData writes are filling, before it's queued.
+static struct {
+    bool dirty;
+    uint32_t offset;
+    uint8_t data[FLASH_PAGE_SIZE];
+} staged;
+
+static uint32_t flash_address;
+
+// The end of the running image, from the linker script.
+extern char __flash_binary_end;
+
+
+static bool in_update_slot(uint32_t offset, size_t size) {
+    return (offset >= FLASH_UPDATE_SLOT) && ((offset + size) <= PICO_FLASH_SIZE_BYTES);
+}
+
+
+// Do the next step of the queued work: a page program, or one sector
+// of an erase, so that packets get handled between the sectors of a
+// block.  The caller makes sure the W5500's interrupt can't run
+// meanwhile.
+static void flash_run_op(void) {
+    flash_op_t * op = &flash_queue[flash_queue_head];
+
+    if (op->erase_size > 0) {
+        flash_range_erase(op->offset, FLASH_SECTOR_SIZE);
+        op->offset += FLASH_SECTOR_SIZE;
+        op->erase_size -= FLASH_SECTOR_SIZE;
+        if (op->erase_size > 0) {
+            return;
+        }
+    } else {
+        flash_range_program(op->offset, op->page, FLASH_PAGE_SIZE);
+    }
+
+    flash_queue_head = (flash_queue_head + 1) % FLASH_QUEUE_LEN;
+    --flash_queue_len;
+}
+
+
+// Queue an op at `offset`.  Returns NULL if the queue is full.
+static flash_op_t * flash_queue_push(uint32_t offset) {
+    if (flash_queue_len == FLASH_QUEUE_LEN) {
+        return NULL;
+    }
+
+    flash_op_t * op = &flash_queue[(flash_queue_head + flash_queue_len) % FLASH_QUEUE_LEN];
+    op->offset = offset;
+    op->erase_size = 0;
+    ++flash_queue_len;
+    return op;
+}
+
+
+// Returns -1 if the queue is full, and the page stays staged.
+static int flash_queue_page(void) {
+    if (staged.dirty) {
+        flash_op_t * op = flash_queue_push(staged.offset);
+        if (op == NULL) {
+            return -1;
+        }
+        memcpy(op->page, staged.data, FLASH_PAGE_SIZE);
+        staged.dirty = false;
+    }
+    return 0;
+}
+
+
+// Get the flash up to date with everything the host has written.  Not
+// for interrupt context.
+static void flash_finish(void) {
+    while ((flash_queue_page() < 0) || (flash_queue_len > 0)) {
+        flash_run_op();
+        hm2_watchdog_core0_poll();
+    }
+}
+
+
+int flash_update_read(uint16_t addr, uint32_t * value) {
+    switch (addr) {
+        case FLASH_UPDATE_ADDRESS:
+            *value = flash_address;
+            return 0;
+
+        case FLASH_UPDATE_DATA: {
+            if ((flash_address + 4) > PICO_FLASH_SIZE_BYTES) {
+                return -1;
+            }
+            if (flash_queue_len > 0) {
+                // The flash isn't up to date yet (a packet read back what
+                // it had just written, see flash_update_busy()).
+                return -1;
+            }
+            *value = *(uint32_t const *)(XIP_BASE + flash_address);
+            uint32_t page = flash_address & ~(FLASH_PAGE_SIZE - 1);
+            if (staged.dirty && (staged.offset == page)) {
+                // Programming only clears bits.
+                uint32_t data;
+                memcpy(&data, &staged.data[flash_address - page], 4);
+                *value &= data;
+            }
+            flash_address += 4;
+            return 0;
+        }
+
+        case FLASH_UPDATE_ID: {
+            // Nothing else uses the flash meanwhile: erases and programs
+            // run with this interrupt off.
+            uint8_t tx[4] = { 0x9f };   // JEDEC ID
+            uint8_t rx[4];
+            flash_do_cmd(tx, rx, sizeof(rx));
+            *value = rx[3];
+            return 0;
+        }
+
+        default:
+            return -1;
+    }
+}
+
+
+int flash_update_write(uint16_t addr, uint32_t value) {
+    switch (addr) {
+        case FLASH_UPDATE_ADDRESS:
+            flash_address = value & ~0x3;
+            return 0;
+
+        case FLASH_UPDATE_DATA: {
+            if (!in_update_slot(flash_address, 4)) {
+                return -1;
+            }
+            uint32_t page = flash_address & ~(FLASH_PAGE_SIZE - 1);
+            if (staged.dirty && (staged.offset != page) && (flash_queue_page() < 0)) {
+                return -1;
+            }
+            if (!staged.dirty) {
+                // Programming 0xff leaves a byte as it is.
+                memset(staged.data, 0xff, sizeof(staged.data));
+                staged.offset = page;
+                staged.dirty = true;
+            }
+            memcpy(&staged.data[flash_address - page], &value, 4);
+            flash_address += 4;
+            if ((flash_address % FLASH_PAGE_SIZE) == 0) {
+                // If the queue is full it goes with the next write.
+                flash_queue_page();
+            }
+            return 0;
+        }
+
+        case FLASH_UPDATE_SEC_ERASE: {
+            uint32_t block = flash_address & ~(FLASH_BLOCK_SIZE - 1);
+            if (!in_update_slot(block, FLASH_BLOCK_SIZE)) {
+                return -1;
+            }
+            if (flash_queue_page() < 0) {
+                return -1;
+            }
+            flash_op_t * op = flash_queue_push(block);
+            if (op == NULL) {
+                return -1;
+            }
+            op->erase_size = FLASH_BLOCK_SIZE;
+            return 0;
+        }
+
+        default:
+            return -1;
+    }
+}
+
+
+bool flash_update_busy(void) {
+    return flash_queue_len > 0;
+}
+
+
+bool flash_update_poll(void) {
+    irq_set_enabled(IO_IRQ_BANK0, false);
+    if (flash_queue_len > 0) {
+        flash_run_op();
+    }
+    bool more = (flash_queue_len > 0);
+    irq_set_enabled(IO_IRQ_BANK0, true);
+    return more;
+}
+
+
+// The boot ROM only boots an image whose first 256 bytes (boot2) end
+// in their CRC32: polynomial 0x04c11db7, not reflected, starting from
+// all ones, not inverted at the end.
+static bool boot2_valid(uint8_t const * boot2) {
+    uint32_t crc = 0xffffffff;
+    for (int i = 0; i < 252; ++i) {
+        crc ^= (uint32_t)boot2[i] << 24;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc & 0x80000000) ? ((crc << 1) ^ 0x04c11db7) : (crc << 1);
+        }
+    }
+
+    uint32_t expected;
+    memcpy(&expected, &boot2[252], sizeof(expected));
+    return crc == expected;
+}
+
+
+// The CRC-32 of zlib and Ethernet (reflected polynomial 0xedb88320),
+// a nibble at a time.  Core 1 only feeds the RP2040 watchdog while core
+// 0's main loop is going (see watchdog.c), so this says it's still
+// going every sector.
+static uint32_t image_crc32(uint8_t const * data, size_t size) {
+    static uint32_t const table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < size; ++i) {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ table[crc & 0xf];
+        crc = (crc >> 4) ^ table[crc & 0xf];
+        if ((i % FLASH_SECTOR_SIZE) == 0) {
+            hm2_watchdog_core0_poll();
+        }
+    }
+    return ~crc;
+}
+
+
+// The length of the complete image in the update slot, or 0 if there
+// isn't one: the trailer has to describe an image that fits in the slot
+// before it, and the image has to start with a valid boot2 and match
+// the trailer's CRC.
+static size_t image_length(uint8_t const * slot) {
+    flash_update_trailer_t trailer;
+    memcpy(&trailer, (void const *)(XIP_BASE + FLASH_UPDATE_TRAILER), sizeof(trailer));
+
+    if (trailer.magic != FLASH_UPDATE_MAGIC) {
+        printf("no image in the update slot\n");
+        return 0;
+    }
+    if ((trailer.length < 256) || (trailer.length > FLASH_UPDATE_MAX_IMAGE)) {
+        printf("the update slot's image is %u bytes, too big or too small\n", trailer.length);
+        return 0;
+    }
+    if (!boot2_valid(slot)) {
+        printf("the update slot's image has no valid boot2\n");
+        return 0;
+    }
+    uint32_t crc = image_crc32(slot, trailer.length);
+    if (crc != trailer.crc) {
+        printf("the update slot's image has CRC 0x%08x, not 0x%08x\n", crc, trailer.crc);
+        return 0;
+    }
+    return trailer.length;
+}
+
+
+void flash_update_reboot(void) {
+    irq_set_enabled(IO_IRQ_BANK0, false);
+    flash_finish();
+
+    uint8_t const * slot = (uint8_t const *)(XIP_BASE + FLASH_UPDATE_SLOT);
+    size_t length = image_length(slot);
+
+    if (length > 0) {
+        // Copy over all of the running image, even past the end of the
+        // new one, so none of it is left behind.
+        size_t size = (length + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+        size_t running = ((uintptr_t)&__flash_binary_end - XIP_BASE + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+        if (running > size) {
+            size = MIN(running, FLASH_UPDATE_MAX_IMAGE);
+        }
+        printf("installing the %zu byte image from the update slot\n", length);
+
+        // Nothing runs but this from here on: the outputs are stopped,
+        // core 1 is held in reset, and the RP2040 watchdog (which core 1
+        // was feeding) is off.
+        hm2_fw_safe();
+        multicore_reset_core1();
+        save_and_disable_interrupts();
+        hw_clear_bits(&watchdog_hw->ctrl, WATCHDOG_CTRL_ENABLE_BITS);
+
+        // The first sector, with boot2, is erased first and written
+        // last, so if this is cut short the boot ROM finds no boot2 and
+        // starts the USB bootloader.
+        static uint8_t sector[FLASH_SECTOR_SIZE];
+        flash_range_erase(0, FLASH_SECTOR_SIZE);
+        for (size_t offset = FLASH_SECTOR_SIZE; offset < size; offset += FLASH_SECTOR_SIZE) {
+            memcpy(sector, &slot[offset], FLASH_SECTOR_SIZE);
+            flash_range_erase(offset, FLASH_SECTOR_SIZE);
+            flash_range_program(offset, sector, FLASH_SECTOR_SIZE);
+        }
+        memcpy(sector, slot, FLASH_SECTOR_SIZE);
+        flash_range_program(0, sector, FLASH_SECTOR_SIZE);
+
+        // So the next reset doesn't install it again.
+        flash_range_erase(FLASH_UPDATE_SLOT, FLASH_SECTOR_SIZE);
+        flash_range_erase(FLASH_UPDATE_TRAILER & ~(FLASH_SECTOR_SIZE - 1), FLASH_SECTOR_SIZE);
+    }
+
+    watchdog_reboot(0, 0, 0);
+    while (true) {
+        tight_loop_contents();
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef FLASH_UPDATE_H
+#define FLASH_UPDATE_H
+
+
+/*
+
+Firmware update over LBP16 memory space 3 ("Flash"), the way mesaflash
+talks to a Mesa Ethernet card's config flash.  The memory space has
+four 32-bit registers:
+
+    0x0000  FlashAddress  Byte offset in the flash of the next FlashData
+                          access (and of the block FlashSecErase erases).
+    0x0004  FlashData     Reads and programs the flash at FlashAddress,
+                          32 bits at a time, and moves FlashAddress on
+                          4 bytes.
+    0x0008  FlashID       The flash chip's JEDEC capacity byte (0x15 for
+                          the 16 Mbit chip on the W5500-EVB-Pico), which
+                          is what mesaflash expects.
+    0x000C  FlashSecErase Writing anything erases the 64 KB block that
+                          FlashAddress is in.
+
+The RP2040 can only boot the image at the start of the flash, so a new
+image goes into the update slot, the upper half of the flash, and
+erases and programs are refused anywhere else.  After the image, the
+host writes a 12-byte trailer in the last bytes of the flash (at
+FLASH_UPDATE_TRAILER, the end of the update slot):
+
+    0x0  magic   FLASH_UPDATE_MAGIC, "hm2u"
+    0x4  length  the image's length in bytes
+    0x8  crc     the CRC-32 of the image (zlib's, as in `zlib.crc32()`)
+
+flash_update_reboot() then checks the whole image against the trailer,
+and that it starts with a boot2 that the boot ROM would accept, copies
+it over the running image and reboots into it.  If anything doesn't
+check out, it just reboots into the running image.
+
+The update isn't power-fail safe.  The boot ROM only looks at the start
+of the flash, and there's no boot stage of our own that could pick
+whichever slot has a good trailer, so the copy overwrites the running
+image.  boot2 is written last, so a board whose copy was cut short
+boots to the USB bootloader, and can only be recovered over USB, by
+holding BOOTSEL and loading an image again.
+
+Programming the flash turns off execute-in-place, so the firmware using
+this must be built to run from RAM (copy_to_ram), so that core 1's
+Module updates carry on while core 0 erases and programs.
+
+Erases and programs are queued in RAM, and flash_update_poll() does
+them one at a time from core 0's main loop, with the GPIO interrupt
+(which handles the W5500's packets) held off only for each one.  They
+never run in interrupt context.  While flash_update_busy() says there's
+queued work, the transport holds back packets that access this memory
+space, and handles them from its main loop once the work is done: the
+host gets the reply to a FlashData read only once everything it wrote
+before is in the flash.  Within one packet, a FlashData read of
+something the packet itself wrote, or a write when the queue is full,
+is an error.
+
+*/
+
+
+#define FLASH_UPDATE_SLOT (PICO_FLASH_SIZE_BYTES / 2)
+
+#define FLASH_UPDATE_TRAILER (PICO_FLASH_SIZE_BYTES - sizeof(flash_update_trailer_t))
+#define FLASH_UPDATE_MAGIC   0x75326d68
+
+// The image can't reach the trailer's sector.
+#define FLASH_UPDATE_MAX_IMAGE (PICO_FLASH_SIZE_BYTES - FLASH_UPDATE_SLOT - FLASH_SECTOR_SIZE)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t length;
+    uint32_t crc;
+} flash_update_trailer_t;
+
+#define FLASH_UPDATE_ADDRESS   0x0000
+#define FLASH_UPDATE_DATA      0x0004
+#define FLASH_UPDATE_ID        0x0008
+#define FLASH_UPDATE_SEC_ERASE 0x000C
+
+
+// Read or write a 32-bit register at `addr` in memory space 3.  Return
+// -1 for an access that isn't allowed, 0 if all is well.
+int flash_update_read(uint16_t addr, uint32_t * value);
+int flash_update_write(uint16_t addr, uint32_t value);
+
+// True while there are queued erases or programs.
+bool flash_update_busy(void);
+
+// Do one queued erase or program, if there are any.  Returns true if
+// there's more to do.  Call this from the main loop, not in interrupt
+// context.
+bool flash_update_poll(void);
+
+// Finish the queued work, install the image in the update slot if
+// there is one, and reboot.  Doesn't return.
+void flash_update_reboot(void);
+
+
+#endif // FLASH_UPDATE_H
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/dma.h"
+
+#include "hm2-dma.h"
+
+
+// Endless DMA streams, see hm2-dma.h.
+
+
+static int restart_chan = -1;
+
+// The stream channels, bit N = channel N.  The restart channel writes
+// this to MULTI_CHAN_TRIGGER.
+static uint32_t volatile stream_mask;
+
+
+int hm2_dma_stream_init(uint chan, dma_channel_config * config) {
+    if (restart_chan < 0) {
+        restart_chan = dma_claim_unused_channel(false);
+        if (restart_chan < 0) {
+            printf("hm2-dma: no free DMA channel to restart the streams\n");
+            return -1;
+        }
+
+        // One word, as fast as it can go, whenever a stream chains to it.
+        dma_channel_config c = dma_channel_get_default_config(restart_chan);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+        channel_config_set_read_increment(&c, false);
+        channel_config_set_write_increment(&c, false);
+        dma_channel_configure(restart_chan, &c, &dma_hw->multi_channel_trigger, &stream_mask, 1, false);
+    }
+
+    channel_config_set_chain_to(config, restart_chan);
+    dma_channel_set_config(chan, config, false);
+    return 0;
+}
+
+
+void hm2_dma_stream_start(uint chan, volatile void * write_addr, volatile void const * read_addr) {
+    // Chained again, in case hm2_dma_stream_stop() unchained it.
+    hw_write_masked(&dma_hw->ch[chan].al1_ctrl, restart_chan << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB, DMA_CH0_CTRL_TRIG_CHAIN_TO_BITS);
+    stream_mask |= 1u << chan;
+
+    dma_channel_set_write_addr(chan, write_addr, false);
+    dma_channel_set_read_addr(chan, read_addr, false);
+    dma_channel_set_trans_count(chan, HM2_DMA_STREAM_COUNT, true);
+}
+
+
+void hm2_dma_stream_stop(uint chan) {
+    stream_mask &= ~(1u << chan);
+
+    // Unchain it first: on the RP2040, aborting a channel can trigger
+    // the channel it chains to (erratum RP2040-E13).
+    hw_write_masked(&dma_hw->ch[chan].al1_ctrl, chan << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB, DMA_CH0_CTRL_TRIG_CHAIN_TO_BITS);
+
+    // The restart channel may already have read the old mask.
+    while (dma_channel_is_busy(restart_chan)) {
+        tight_loop_contents();
+    }
+
+    dma_channel_abort(chan);
+}
+
+
+uint32_t hm2_dma_stream_transfers(uint chan) {
+    // The count goes down from HM2_DMA_STREAM_COUNT, and reads 0 between
+    // running out and the restart.
+    return (HM2_DMA_STREAM_COUNT - dma_channel_hw_addr(chan)->transfer_count) & HM2_DMA_STREAM_MASK;
+}
@@ -0,0 +1,67 @@
+#ifndef HM2_DMA_H
+#define HM2_DMA_H
+
+
+/*
+
+Endless DMA streams, for the Modules that keep a DMA channel going
+between a state machine and a ring buffer for as long as the firmware
+runs.
+
+A DMA channel stops when its transfer count runs out, and then whatever
+it feeds stalls until something triggers it again.  So each stream
+channel chains to one shared restart channel, which writes the mask of
+all the stream channels to the DMA's MULTI_CHAN_TRIGGER register: the
+channel that just finished starts again from where its addresses (and
+rings) had got to, with its count reloaded, and the others are busy and
+ignore the trigger.  Nothing has to notice that the count ran out, and
+the stream doesn't stop for longer than the two DMA transfers that
+restart it.
+
+    // In the region's init()
+    dma_channel_config c = dma_channel_get_default_config(chan);
+    channel_config_set_ring(&c, true, RING_BITS);
+    ...
+    if (hm2_dma_stream_init(chan, &c) < 0) {
+        return -1;
+    }
+    hm2_dma_stream_start(chan, ring, &pio->rxf[sm]);
+
+    // In the region's update(), the words written since last time:
+    uint32_t count = hm2_dma_stream_transfers(chan);
+    uint32_t new_words = (count - last_count) & HM2_DMA_STREAM_MASK;
+
+The count is reloaded with HM2_DMA_STREAM_COUNT, so a stream's count of
+transfers wraps at 2^31, not 2^32.
+
+Channels used any other way (the W5500's SPI, say) must not be set up
+with hm2_dma_stream_init(): the restart channel would trigger them.
+
+*/
+
+#include "hardware/dma.h"
+
+
+#define HM2_DMA_STREAM_COUNT (1u << 31)
+#define HM2_DMA_STREAM_MASK  (HM2_DMA_STREAM_COUNT - 1)
+
+
+// Configure DMA channel `chan` with `config`, chained to the restart
+// channel, without starting it.  The first call claims the restart
+// channel.  Returns -1 if there's no DMA channel left for it, 0 if all
+// is well.
+int hm2_dma_stream_init(uint chan, dma_channel_config * config);
+
+// Start (or restart) the stream on `chan` from these addresses, with
+// its count of transfers at 0.
+void hm2_dma_stream_start(uint chan, volatile void * write_addr, volatile void const * read_addr);
+
+// Stop the stream on `chan`, until the next hm2_dma_stream_start().
+void hm2_dma_stream_stop(uint chan);
+
+// How many transfers the stream on `chan` has done since it started,
+// mod 2^31.
+uint32_t hm2_dma_stream_transfers(uint chan);
+
+
+#endif // HM2_DMA_H
@@ -0,0 +1,102 @@
+#ifndef HM2_FIFO_H
+#define HM2_FIFO_H
+
+
+/*
+
+Lock-free single-producer, single-consumer queues of uint32_t's, for
+FIFO registers.
+
+The register file can't hold a FIFO register: a FIFO is a queue
+between the host and a Module, and each read or write of the register
+pops or pushes one entry.  Reads and writes come in on core 0 (see
+hm2_fw_read_fifo() and hm2_fw_write_fifo()) and the Module's work
+happens on core 1, so a FIFO register is backed by one of these
+queues, with one core pushing and the other popping:
+
+    static uint32_t tx_storage[256];
+    static hm2_fifo_t tx_fifo = HM2_FIFO_INIT(tx_storage);
+
+    // core 0, in the region's write()
+    if (!hm2_fifo_push(&tx_fifo, buf[i])) {
+        // full
+    }
+
+    // core 1, in the region's update()
+    uint32_t val;
+    while (hm2_fifo_pop(&tx_fifo, &val)) {
+        ...
+    }
+
+Only the producer writes `head` and only the consumer writes `tail`, so
+neither side ever waits for the other.  The storage size must be a
+power of 2.
+
+*/
+
+#include "hardware/sync.h"
+
+
+typedef struct {
+    uint32_t * buf;
+    uint32_t size;
+
+    // Number of entries ever pushed, written only by the producer.
+    uint32_t volatile head;
+
+    // Number of entries ever popped, written only by the consumer.
+    uint32_t volatile tail;
+} hm2_fifo_t;
+
+
+#define HM2_FIFO_INIT(storage) { .buf = (storage), .size = sizeof(storage) / sizeof((storage)[0]), .head = 0, .tail = 0 }
+
+
+// Number of entries in the FIFO.  Either side can call this, the
+// other side may change it right after.
+static inline uint32_t hm2_fifo_level(hm2_fifo_t const * fifo) {
+    return fifo->head - fifo->tail;
+}
+
+
+// Producer only.  Returns false (and drops `val`) if the FIFO is full.
+static inline bool hm2_fifo_push(hm2_fifo_t * fifo, uint32_t val) {
+    uint32_t head = fifo->head;
+    if ((head - fifo->tail) >= fifo->size) {
+        return false;
+    }
+
+    fifo->buf[head & (fifo->size - 1)] = val;
+
+    // The entry has to be there before the consumer sees the new head.
+    __dmb();
+    fifo->head = head + 1;
+    return true;
+}
+
+
+// Consumer only.  Returns false if the FIFO is empty.
+static inline bool hm2_fifo_pop(hm2_fifo_t * fifo, uint32_t * val) {
+    uint32_t tail = fifo->tail;
+    if (tail == fifo->head) {
+        return false;
+    }
+
+    __dmb();
+    *val = fifo->buf[tail & (fifo->size - 1)];
+
+    // Done with the entry before the producer can reuse its slot.
+    __dmb();
+    fifo->tail = tail + 1;
+    return true;
+}
+
+
+// Consumer only.  Empties the FIFO.
+static inline void hm2_fifo_flush(hm2_fifo_t * fifo) {
+    __dmb();
+    fifo->tail = fifo->head;
+}
+
+
+#endif // HM2_FIFO_H
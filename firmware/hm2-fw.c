@@ -1,15 +1,24 @@
 #include <stdio.h>
+#include <string.h>
 #include "pico/stdlib.h"
+#include "hardware/gpio.h"
+#include "hardware/structs/systick.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
 
 #include "hm2-fw.h"
 
 
-hm2_region_t hm2_region[HM2_MAX_REGIONS];
-size_t hm2_num_regions;
-
 uint8_t hm2_register_file[1<<16];
 uint32_t * hm2_register_file32 = (uint32_t *)hm2_register_file;
 
+uint8_t hm2_pin_alt_function[HM2_NUM_GPIOS] = {
+    [0 ... HM2_NUM_GPIOS - 1] = GPIO_FUNC_NULL
+};
+
+// Set by hm2_fw_safe(), see hm2_fw_write().
+static bool volatile hm2_fw_outputs_held;
+
 
 void hm2_fw_log_uint8(uint8_t const * const data, size_t num_uint8) {
     size_t i;
@@ -39,96 +48,494 @@ void hm2_fw_log_uint32(uint32_t const * const data, size_t num_uint32) {
 }
 
 
-uint8_t * hm2_fw_register(
-    char const * name,
-    uint16_t addr,
-    size_t size,
-    void (*module_update)(void),
-    int (*module_write)(uint16_t addr, uint32_t const * buf, size_t num_uint32),
-    int (*module_read)(uint16_t addr, uint32_t * buf, size_t num_uint32)
-) {
-    // Register a handler for a region of the address space.
-    if (hm2_num_regions >= HM2_MAX_REGIONS) {
-        printf("Failed to register hm2 region handler, array is full.");
-        return NULL;
+void hm2_fw_cycle_counter_init(void) {
+    systick_hw->csr = 0;
+    systick_hw->rvr = 0x00ffffff;
+    systick_hw->cvr = 0;
+    systick_hw->csr = M0PLUS_SYST_CSR_CLKSOURCE_BITS | M0PLUS_SYST_CSR_ENABLE_BITS;
+}
+
+
+// The per-handler profiling (see profile.c) reads the cycle counter
+// twice per handler call.  Builds that time dispatch alone (like
+// host/bench-dispatch.c) set HM2_FW_PROFILE to 0 to leave it out.
+#ifndef HM2_FW_PROFILE
+#define HM2_FW_PROFILE 1
+#endif
+
+
+static inline uint32_t hm2_fw_cycles(void) {
+#if HM2_FW_PROFILE
+    return systick_hw->cvr;
+#else
+    return 0;
+#endif
+}
+
+
+// SysTick is a 24-bit down-counter, so this is only correct for
+// intervals shorter than 2^24 cycles (about 126 ms at 133 MHz).
+static inline uint32_t hm2_fw_cycles_since(uint32_t start) {
+#if HM2_FW_PROFILE
+    return (start - systick_hw->cvr) & 0x00ffffff;
+#else
+    return 0;
+#endif
+}
+
+
+static void hm2_fw_profile(hm2_profile_t * profile, uint32_t cycles) {
+#if HM2_FW_PROFILE
+    if ((profile->calls == 0) || (cycles < profile->min_cycles)) {
+        profile->min_cycles = cycles;
+    }
+    if (cycles > profile->max_cycles) {
+        profile->max_cycles = cycles;
+    }
+    profile->total_cycles += cycles;
+    ++profile->calls;
+#endif
+}
+
+
+int hm2_fw_find_pin(uint8_t sec_tag, uint8_t sec_unit, uint8_t sec_pin) {
+    for (int i = 0; i < HM2_NUM_GPIOS; ++i) {
+        if (
+            (hm2_pin[i].sec_tag == sec_tag)
+            && (hm2_pin[i].sec_unit == sec_unit)
+            && (hm2_pin[i].sec_pin == sec_pin)
+        ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+int hm2_fw_init(void) {
+    // hm2_fw_read() and hm2_fw_write() run on this core.
+    hm2_fw_cycle_counter_init();
+
+    if (idrom_init() < 0) {
+        printf("failed to initialize idrom\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < hm2_num_regions; ++i) {
+        hm2_region_t const * region = hm2_region[i];
+        if ((region->update != NULL) && (region->period_us == 0)) {
+            // The scheduler divides by it.
+            printf("region %s has an update() but no period_us\n", region->name);
+            return -1;
+        }
+        if ((region->init != NULL) && (region->init() < 0)) {
+            printf("failed to initialize region %s\n", region->name);
+            return -1;
+        }
     }
 
-    printf("registering region %d (%s): addr=0x%04x, size=%u\n", hm2_num_regions, name, addr, size);
+    return 0;
+}
+
 
-    hm2_region[hm2_num_regions].name = name;
-    hm2_region[hm2_num_regions].addr = addr;
-    hm2_region[hm2_num_regions].size = size;
-    hm2_region[hm2_num_regions].update = module_update;
-    hm2_region[hm2_num_regions].write = module_write;
-    hm2_region[hm2_num_regions].read = module_read;
+// Find the longest run of uint32_t's, starting at `addr` and at most
+// `num_uint32` long, that either lies entirely inside one region or
+// entirely outside all regions.  Sets `*index` to the index of the
+// region (or -1) and returns the length of the run.
+//
+// This is one lookup in the page table, no matter which region is hit
+// or how many regions are compiled in.  That's for the bounded worst
+// case, not for speed: with few regions a linear scan is as cheap.
 
-    ++hm2_num_regions;
+static size_t hm2_fw_find_run(uint16_t addr, size_t num_uint32, int * index) {
+    int i = (int)hm2_page_region[addr >> HM2_PAGE_SHIFT] - 1;
+    hm2_region_t const * r = (i >= 0) ? hm2_region[i] : NULL;
+    uint32_t end;
 
-    return &hm2_register_file[addr];
+    if ((r != NULL) && (addr >= r->addr) && (addr < (r->addr + r->size))) {
+        *index = i;
+        end = r->addr + r->size;
+    } else {
+        // Not in a region.  The unclaimed run ends at the start of this
+        // page's region (if the region starts later in the page), or at
+        // the end of the page.
+        *index = -1;
+        end = (addr | (HM2_PAGE_SIZE - 1)) + 1;
+        if ((r != NULL) && (r->addr > addr) && (r->addr < end)) {
+            end = r->addr;
+        }
+    }
+
+    // `addr` and the region boundaries are all word-aligned, so this is
+    // at least 1.
+    size_t n = (end - addr) / 4;
+    if (n > num_uint32) {
+        n = num_uint32;
+    }
+    return n;
+}
+
+
+// Accesses are whole registers: word-aligned, and inside the 64 KB
+// address space (they don't wrap around to 0x0000).
+static bool hm2_fw_access_ok(uint16_t addr, size_t num_uint32) {
+    return ((addr & 0x3) == 0) && (num_uint32 <= ((sizeof(hm2_register_file) - addr) / 4));
+}
+
+
+//
+// Module registers in the register file are written by core 1 and read
+// by core 0 (on behalf of the host) at the same time.  Each region has
+// a sequence counter (a seqlock) to keep multi-register reads
+// consistent:
+//
+// The writer (the module's update(), on core 1) makes the counter odd,
+// updates its registers, then makes the counter even again.  It never
+// waits for anything.
+//
+// The reader (hm2_fw_read(), on core 0) copies the registers out,
+// and tries again if the counter was odd or changed during the copy.
+//
+
+void hm2_fw_publish_begin(uint16_t addr) {
+    hm2_region_state_t * state = &hm2_region_state[hm2_page_region[addr >> HM2_PAGE_SHIFT] - 1];
+    state->seq = state->seq + 1;
+    __dmb();
+}
+
+
+void hm2_fw_publish_end(uint16_t addr) {
+    hm2_region_state_t * state = &hm2_region_state[hm2_page_region[addr >> HM2_PAGE_SHIFT] - 1];
+    __dmb();
+    state->seq = state->seq + 1;
+}
+
+
+static void hm2_fw_read_consistent(hm2_region_state_t const * state, uint16_t addr, uint32_t * buf, size_t num_uint32) {
+    uint32_t seq;
+
+    do {
+        seq = state->seq;
+        if (seq & 1) {
+            // The writer is in the middle of an update.
+            continue;
+        }
+        __dmb();
+        memcpy(buf, &hm2_register_file[addr], num_uint32 * 4);
+        __dmb();
+    } while ((seq & 1) || (seq != state->seq));
 }
 
 
 // Read `num_uint32` uint32_t values from `addr` into `buf`.
 //
-// Returns -1 on failure (caller should read directly from the hm2
-// register file memory).
+// The access may span several regions.  Each part of it is handed to
+// the read() function of the region it falls in.  Parts that fall
+// outside all regions, or in regions without a read() function, or
+// whose read() function returns -1, are read directly from the hm2
+// register file.  Each region's part of the register file is read
+// as a consistent snapshot of one update.
 //
-// Returns 0 on success.
+// Returns -1 (and reads all zeros) if `addr` isn't word-aligned or the
+// access runs past the end of the address space, 0 if all is well.
 
 int hm2_fw_read(uint16_t addr, uint32_t * buf, size_t num_uint32) {
-    for (size_t i = 0; i < hm2_num_regions; ++i) {
-        if (
-            (addr >= hm2_region[i].addr)
-            && ((addr + (num_uint32 * 4)) < (hm2_region[i].addr + hm2_region[i].size))
-        ) {
-            if (hm2_region[i].read != NULL) {
-                return hm2_region[i].read(addr - hm2_region[i].addr, buf, num_uint32);
-            } else {
-                // We found the right region, but it doesn't have a read() function.
-                return -1;
+    if (!hm2_fw_access_ok(addr, num_uint32)) {
+        memset(buf, 0, num_uint32 * 4);
+        return -1;
+    }
+
+    while (num_uint32 > 0) {
+        int i;
+        size_t n = hm2_fw_find_run(addr, num_uint32, &i);
+
+        if (i < 0) {
+            memcpy(buf, &hm2_register_file[addr], n * 4);
+        } else {
+            hm2_region_t const * region = hm2_region[i];
+            hm2_region_state_t * state = &hm2_region_state[i];
+            int r = -1;
+            if (region->read != NULL) {
+                uint32_t start = hm2_fw_cycles();
+                r = region->read(addr - region->addr, buf, n);
+                hm2_fw_profile(&state->read_profile, hm2_fw_cycles_since(start));
+            }
+            if (r < 0) {
+                hm2_fw_read_consistent(state, addr, buf, n);
             }
         }
+
+        addr += n * 4;
+        buf += n;
+        num_uint32 -= n;
     }
 
-    // We didn't find the right region.
-    return -1;
+    return 0;
 }
 
 
 // Write `num_uint32` uint32_t values from `buf` into `addr`.
 //
-// Returns -1 on failure (caller should write directly to the hm2 register
-// file memory).
+// The access may span several regions.  Each part of it is handed to
+// the write() function of the region it falls in.  Parts that fall
+// outside all regions, or in regions without a write() function, or
+// whose write() function returns -1, are written directly to the hm2
+// register file.
 //
-// Returns 0 on success.
+// Returns -1 (and writes nothing) if `addr` isn't word-aligned or the
+// access runs past the end of the address space, 0 if all is well.
 
 int hm2_fw_write(uint16_t addr, uint32_t const * buf, size_t num_uint32) {
-    for (size_t i = 0; i < hm2_num_regions; ++i) {
-        if (
-            (addr >= hm2_region[i].addr)
-            && ((addr + (num_uint32 * 4)) < (hm2_region[i].addr + hm2_region[i].size))
-        ) {
-            if (hm2_region[i].write != NULL) {
-                return hm2_region[i].write(addr - hm2_region[i].addr, buf, num_uint32);
-            } else {
-                // We found the right region, but it doesn't have a read() function.
-                return -1;
+    if (!hm2_fw_access_ok(addr, num_uint32)) {
+        return -1;
+    }
+
+    while (num_uint32 > 0) {
+        int i;
+        size_t n = hm2_fw_find_run(addr, num_uint32, &i);
+
+        // The watchdog bite is an interrupt on this core.  It has to
+        // land either before a write to a region with outputs, which
+        // then gets dropped, or after it, and undo it: not in the
+        // middle, where the rest of the write would drive the outputs
+        // again after safe() had stopped them.
+        bool has_outputs = (i >= 0) && (hm2_region[i]->safe != NULL);
+        uint32_t irq_status = 0;
+        if (has_outputs) {
+            irq_status = save_and_disable_interrupts();
+        }
+
+        if (!has_outputs || !hm2_fw_outputs_held) {
+            int r = -1;
+            if ((i >= 0) && (hm2_region[i]->write != NULL)) {
+                hm2_region_t const * region = hm2_region[i];
+                uint32_t start = hm2_fw_cycles();
+                r = region->write(addr - region->addr, buf, n);
+                hm2_fw_profile(&hm2_region_state[i].write_profile, hm2_fw_cycles_since(start));
+            }
+            if (r < 0) {
+                memcpy(&hm2_register_file[addr], buf, n * 4);
             }
         }
+
+        if (has_outputs) {
+            restore_interrupts(irq_status);
+        }
+
+        addr += n * 4;
+        buf += n;
+        num_uint32 -= n;
     }
 
-    // We didn't find the right region.
-    return -1;
+    return 0;
+}
+
+
+// Read the register at `addr` `num_uint32` times, into `buf`.  This is
+// how hosts read FIFO registers (for example LBP16 reads with
+// addr_increment off): each read goes to the region's read() function
+// separately, which pops one entry per read (see hm2-fifo.h).
+//
+// Returns 0.
+
+int hm2_fw_read_fifo(uint16_t addr, uint32_t * buf, size_t num_uint32) {
+    for (size_t i = 0; i < num_uint32; ++i) {
+        hm2_fw_read(addr, &buf[i], 1);
+    }
+    return 0;
+}
+
+
+// Write `num_uint32` values from `buf` to the register at `addr`, one
+// after the other.  The write counterpart of hm2_fw_read_fifo().
+//
+// Returns 0.
+
+int hm2_fw_write_fifo(uint16_t addr, uint32_t const * buf, size_t num_uint32) {
+    for (size_t i = 0; i < num_uint32; ++i) {
+        hm2_fw_write(addr, &buf[i], 1);
+    }
+    return 0;
+}
+
+
+// Put every module's outputs in their safe state, and keep them there
+// until hm2_fw_resume().
+
+void hm2_fw_safe(void) {
+    hm2_fw_outputs_held = true;
+    for (size_t i = 0; i < hm2_num_regions; ++i) {
+        if (hm2_region[i]->safe != NULL) {
+            hm2_region[i]->safe();
+        }
+    }
+}
+
+
+void hm2_fw_resume(void) {
+    hm2_fw_outputs_held = false;
+}
+
+
+//
+// The module scheduler runs on core 1.
+//
+// Every region with an update() function runs it once per period.
+// Scheduling is non-preemptive and rate-monotonic: after each update()
+// returns, the highest-priority (shortest-period) module that is due
+// runs next, so a slow housekeeping module delays a time-critical one
+// by at most one housekeeping update() rather than by a whole pass over
+// all the modules.
+//
+// Regions with a sample() function run it when their DPLL timer fires.
+// Those are the most time-critical jobs of all, so they go before any
+// update() that's due.
+//
+// When no module is due, core 1 sleeps until the earliest deadline,
+// woken by one of the RP2040's hardware timer alarms.
+//
+
+// Indices of the regions with an update() function, sorted by period,
+// shortest first.
+static uint8_t hm2_schedule[HM2_MAX_REGIONS];
+static size_t hm2_num_scheduled;
+
+// Indices of the regions with a sample() function.
+static uint8_t hm2_sampled[HM2_MAX_REGIONS];
+static size_t hm2_num_sampled;
+
+static volatile bool hm2_alarm_fired;
+
+// The longest core 1 sleeps, even if nothing is due.
+#define HM2_FW_MAX_SLEEP_US (10 * 1000)
+
+
+static void hm2_fw_alarm_callback(uint alarm_num) {
+    hm2_alarm_fired = true;
+}
+
+
+void hm2_fw_schedule_init(uint64_t now) {
+    hm2_num_scheduled = 0;
+    hm2_num_sampled = 0;
+
+    for (size_t i = 0; i < hm2_num_regions; ++i) {
+        hm2_region_t const * region = hm2_region[i];
+
+        if (region->sample != NULL) {
+            hm2_region_state[i].last_sample = 0;
+            hm2_sampled[hm2_num_sampled++] = i;
+        }
+
+        if (region->update == NULL) {
+            continue;
+        }
+
+        hm2_region_state[i].deadline = now;
+
+        // Insertion sort by period.
+        size_t j = hm2_num_scheduled;
+        while ((j > 0) && (hm2_region[hm2_schedule[j - 1]]->period_us > region->period_us)) {
+            hm2_schedule[j] = hm2_schedule[j - 1];
+            --j;
+        }
+        hm2_schedule[j] = i;
+        ++hm2_num_scheduled;
+    }
+}
+
+
+bool hm2_fw_run_one(uint64_t now) {
+    for (size_t i = 0; i < hm2_num_sampled; ++i) {
+        hm2_region_t const * region = hm2_region[hm2_sampled[i]];
+        hm2_region_state_t * state = &hm2_region_state[hm2_sampled[i]];
+
+        if (now < hm2_dpll_timer_us(region->dpll_timer, state->last_sample)) {
+            continue;
+        }
+
+        uint32_t start = hm2_fw_cycles();
+        region->sample();
+        hm2_fw_profile(&state->update_profile, hm2_fw_cycles_since(start));
+
+        // If this ran late, the next one is still on the DPLL's grid,
+        // hm2_dpll_timer_us() looks half a period past this.
+        state->last_sample = now;
+
+        return true;
+    }
+
+    for (size_t i = 0; i < hm2_num_scheduled; ++i) {
+        hm2_region_t const * region = hm2_region[hm2_schedule[i]];
+        hm2_region_state_t * state = &hm2_region_state[hm2_schedule[i]];
+
+        if (now < state->deadline) {
+            continue;
+        }
+
+        uint32_t start = hm2_fw_cycles();
+        region->update();
+        hm2_fw_profile(&state->update_profile, hm2_fw_cycles_since(start));
+
+        // Stay on the original time grid.  If we're more than a whole
+        // period late, the skipped updates are deadline misses.
+        uint64_t periods_late = (now - state->deadline) / region->period_us;
+        state->deadline_misses += periods_late;
+        state->deadline += (periods_late + 1) * region->period_us;
+
+        return true;
+    }
+
+    return false;
 }
 
 
 void hm2_fw_run(void) {
+    // The alarm interrupt is enabled on the core that sets the callback,
+    // which is this one.
+    uint alarm = hardware_alarm_claim_unused(true);
+    hardware_alarm_set_callback(alarm, hm2_fw_alarm_callback);
+
+    hm2_fw_cycle_counter_init();
+
+    hm2_fw_schedule_init(time_us_64());
+
     while (true) {
-        for (size_t i = 0; i < hm2_num_regions; ++i) {
-            if (hm2_region[i].update != NULL) {
-                hm2_region[i].update();
+        do {
+            // Keep going until nothing is due, but keep feeding the
+            // watchdog even if something is always due.
+            hm2_watchdog_core1_poll();
+        } while (hm2_fw_run_one(time_us_64()));
+
+        uint64_t next_deadline = UINT64_MAX;
+        for (size_t i = 0; i < hm2_num_scheduled; ++i) {
+            if (hm2_region_state[hm2_schedule[i]].deadline < next_deadline) {
+                next_deadline = hm2_region_state[hm2_schedule[i]].deadline;
             }
         }
-        // sleep_ms(1);
+        for (size_t i = 0; i < hm2_num_sampled; ++i) {
+            hm2_region_state_t const * state = &hm2_region_state[hm2_sampled[i]];
+            uint64_t due = hm2_dpll_timer_us(hm2_region[hm2_sampled[i]]->dpll_timer, state->last_sample);
+            if (due < next_deadline) {
+                next_deadline = due;
+            }
+        }
+
+        // Wake up now and then even if nothing's due (or only sample()s
+        // are, and the DPLL isn't tracking the host yet), to feed the
+        // watchdog and to notice the DPLL locking.
+        uint64_t latest = time_us_64() + HM2_FW_MAX_SLEEP_US;
+        if (next_deadline > latest) {
+            next_deadline = latest;
+        }
+
+        hm2_alarm_fired = false;
+        if (hardware_alarm_set_target(alarm, from_us_since_boot(next_deadline))) {
+            // That deadline already passed.
+            continue;
+        }
+        while (!hm2_alarm_fired) {
+            __wfe();
+        }
     }
 }
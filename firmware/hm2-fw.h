@@ -2,24 +2,212 @@
 #define HM2_FW_H
 
 
-#define HM2_GTAG_IOPORT  3
-#define HM2_GTAG_STEPGEN 5
+#define HM2_GTAG_WATCHDOG     2
+#define HM2_GTAG_IOPORT       3
+#define HM2_GTAG_ENCODER      4
+#define HM2_GTAG_STEPGEN      5
+#define HM2_GTAG_PWMGEN       6
+#define HM2_GTAG_HM2DPLL     26
+#define HM2_GTAG_PKTUART_TX  27
+#define HM2_GTAG_PKTUART_RX  28
 
-#define HM2_GTAG_END     0
+#define HM2_GTAG_END          0
 
 
-#define HM2_MAX_REGIONS 8
+// Module Descriptor ClockTags.
+#define HM2_CLOCK_LOW_TAG  1
+#define HM2_CLOCK_HIGH_TAG 2
 
 
+// Secondary pin numbers (the SecPin byte of the Pin Descriptors).
+// Output pins have bit 7 set.
+#define HM2_ENCODER_A     0x01
+#define HM2_ENCODER_B     0x02
+#define HM2_ENCODER_INDEX 0x03
+
+#define HM2_STEPGEN_STEP 0x81
+#define HM2_STEPGEN_DIR  0x82
+
+#define HM2_PWMGEN_OUT0  0x81
+#define HM2_PWMGEN_OUT1  0x82
+
+#define HM2_PKTUART_TX_DATA   0x81
+#define HM2_PKTUART_TX_ENABLE 0x82
+#define HM2_PKTUART_RX_DATA   0x01
+
+
+// The RP2040 has 30 GPIOs in bank 0 (GPIO 29 is not brought out on most
+// boards).
+#define HM2_NUM_GPIOS 30
+
+// hm2 I/O pin N is GPIO N, on ioport instance (port) N / 24, so it takes
+// two ports to cover all the GPIOs.
+#define HM2_IOPORT_PORT_WIDTH 24
+#define HM2_IOPORT_MAX_PORTS  ((HM2_NUM_GPIOS + HM2_IOPORT_PORT_WIDTH - 1) / HM2_IOPORT_PORT_WIDTH)
+
+
+// The most regions a firmware can have.
+#define HM2_MAX_REGIONS 16
+
+
+// Where each region lives in the hm2 address space, and how it appears
+// in the IDROM's Module Descriptors.
+//
+// HM2_<NAME>_MD(M, instances) expands to
+//
+//     M(gtag, version, clock_tag, instances, base_address, num_registers, strides, mp_bitmap)
+//
+// for regions that are hostmot2 Modules, and to nothing for the ones
+// that aren't (they're not in the IDROM).  hm2-registry.h builds the
+// IDROM image from these at compile time.
+
+#define HM2_LED_ADDR      0x0200
+#define HM2_LED_SIZE      4
+#define HM2_LED_MD(M, instances)
+
+#define HM2_WATCHDOG_ADDR 0x0c00
+#define HM2_WATCHDOG_SIZE 0x0300
+#define HM2_WATCHDOG_MD(M, instances) M(HM2_GTAG_WATCHDOG, 0, HM2_CLOCK_LOW_TAG, instances, HM2_WATCHDOG_ADDR, 3, 0x00, 0x00)
+
+#define HM2_IOPORT_ADDR   0x1000
+#define HM2_IOPORT_SIZE   0x0500
+#define HM2_IOPORT_MD(M, instances) M(HM2_GTAG_IOPORT, 0, HM2_CLOCK_LOW_TAG, instances, HM2_IOPORT_ADDR, 5, 0x00, 0x1f)
+
+#define HM2_STEPGEN_ADDR  0x2000
+#define HM2_STEPGEN_SIZE  0x0a00
+#define HM2_STEPGEN_MD(M, instances) M(HM2_GTAG_STEPGEN, 2, HM2_CLOCK_LOW_TAG, instances, HM2_STEPGEN_ADDR, 10, 0x00, 0x1ff)
+
+#define HM2_ENCODER_ADDR  0x3000
+#define HM2_ENCODER_SIZE  0x0500
+#define HM2_ENCODER_MD(M, instances) M(HM2_GTAG_ENCODER, 2, HM2_CLOCK_LOW_TAG, instances, HM2_ENCODER_ADDR, 5, 0x00, 0x03)
+
+#define HM2_PWMGEN_ADDR   0x4000
+#define HM2_PWMGEN_SIZE   0x0500
+#define HM2_PWMGEN_MD(M, instances) M(HM2_GTAG_PWMGEN, 0, HM2_CLOCK_HIGH_TAG, instances, HM2_PWMGEN_ADDR, 5, 0x00, 0x03)
+
+#define HM2_PKTUART_TX_ADDR 0x6100
+#define HM2_PKTUART_TX_SIZE 0x0400
+#define HM2_PKTUART_TX_MD(M, instances) M(HM2_GTAG_PKTUART_TX, 0, HM2_CLOCK_LOW_TAG, instances, HM2_PKTUART_TX_ADDR, 4, 0x00, 0x0f)
+
+#define HM2_PKTUART_RX_ADDR 0x6500
+#define HM2_PKTUART_RX_SIZE 0x0400
+#define HM2_PKTUART_RX_MD(M, instances) M(HM2_GTAG_PKTUART_RX, 0, HM2_CLOCK_LOW_TAG, instances, HM2_PKTUART_RX_ADDR, 4, 0x00, 0x0f)
+
+#define HM2_DPLL_ADDR     0x7000
+#define HM2_DPLL_SIZE     0x0800
+#define HM2_DPLL_MD(M, instances) M(HM2_GTAG_HM2DPLL, 0, HM2_CLOCK_LOW_TAG, instances, HM2_DPLL_ADDR, 7, 0x00, 0x00)
+
+#define HM2_CAPTURE_ADDR  0xe000
+#define HM2_CAPTURE_SIZE  0x0300
+#define HM2_CAPTURE_MD(M, instances)
+
+#define HM2_PROFILE_ADDR  0xf000
+#define HM2_PROFILE_SIZE  (0x40 + (HM2_MAX_REGIONS * 0x40))
+#define HM2_PROFILE_MD(M, instances)
+
+
+// The hm2 address space is divided into 256-byte pages, one page per
+// hostmot2 register (RegisterStride0 is 256).  Each page belongs to at
+// most one region.
+#define HM2_PAGE_SHIFT 8
+#define HM2_PAGE_SIZE  (1 << HM2_PAGE_SHIFT)
+#define HM2_NUM_PAGES  ((1 << 16) >> HM2_PAGE_SHIFT)
+
+
+// Execution-time statistics for one of a region's handler functions,
+// measured in CPU clock cycles.
+typedef struct {
+    uint32_t calls;
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+    uint64_t total_cycles;
+} hm2_profile_t;
+
+
+// One Module Descriptor in the IDROM, laid out as the host reads it
+// (see idrom.c).
+typedef struct {
+    uint8_t gtag;
+    uint8_t version;
+    uint8_t clock_tag;
+    uint8_t instances;
+    uint16_t base_address;
+    uint8_t num_registers;
+    uint8_t strides;
+    // Bitmap of which registers are per-instance, LSb = register 0.
+    uint32_t mp_bitmap;
+} hm2_md_t;
+
+#define HM2_MAX_MODULE_DESCRIPTORS 32
+#define HM2_MAX_PIN_DESCRIPTORS    (HM2_IOPORT_MAX_PORTS * HM2_IOPORT_PORT_WIDTH)
+
+#define HM2_PIN_DESCRIPTOR(sec_pin, sec_tag, sec_unit, primary_tag) \
+    (uint32_t)(((primary_tag) << 24) | ((sec_unit) << 16) | ((sec_tag) << 8) | (sec_pin))
+
+// The IDROM, at 0x0400 in the hm2 address space, with the Module
+// Descriptors at 0x0440 and the Pin Descriptors at 0x0600.  Built at
+// compile time by hm2-registry.h from the firmware's module list and
+// pin map, and copied into the register file at boot by idrom_init().
+typedef struct {
+    uint32_t idrom_type;
+    uint32_t offset_to_modules;
+    uint32_t offset_to_pin_desc;
+    char board_name[8];
+    uint32_t fpga_size;
+    uint32_t fpga_pins;
+    uint32_t io_ports;
+    uint32_t io_width;
+    uint32_t port_width;
+    uint32_t clock_low;
+    uint32_t clock_high;
+    uint32_t instance_stride[2];
+    uint32_t register_stride[2];
+
+    // Ends with a descriptor whose gtag is HM2_GTAG_END.
+    hm2_md_t md[HM2_MAX_MODULE_DESCRIPTORS + 1];
+    uint8_t reserved[0x200 - 0x40 - ((HM2_MAX_MODULE_DESCRIPTORS + 1) * 12)];
+
+    // io_width of these are used.
+    uint32_t pd[HM2_MAX_PIN_DESCRIPTORS];
+} hm2_idrom_t;
+
+extern hm2_idrom_t const hm2_idrom;
+
+
+// Each module defines one of these (as `hm2_<name>_region`), describing
+// the region of the hm2 address space that it handles.  They're const,
+// so they live in flash.
 typedef struct {
     char const * name;
     uint16_t addr;
     size_t size;
 
-    // This gets called frequently to do any ongoing processing that
-    // the module needs.
+    // This gets called once at startup, on the boot core, before core
+    // 1 starts running update().
+    int (*init)(void);
+
+    // This gets called every `period_us` microseconds to do any ongoing
+    // processing that the module needs.
     void (*update)(void);
 
+    // How often update() should run, in microseconds.  Modules with
+    // shorter periods have higher priority: when several modules are
+    // due at once, the one with the shortest period runs first.  It
+    // can't be 0 if there's an update(), hm2_fw_init() fails if it is.
+    uint32_t period_us;
+
+    // If set, this gets called once per DPLL reference period, when
+    // DPLL timer `dpll_timer` (1-4) fires, so the module can sample its
+    // inputs in step with the host's servo thread.  It's not called
+    // while the DPLL isn't tracking the host.
+    void (*sample)(void);
+    uint8_t dpll_timer;
+
+    // This gets called when the watchdog bites, from an interrupt on
+    // core 0.  It puts the module's outputs in their safe state, right
+    // away.
+    void (*safe)(void);
+
     // This gets called when a write to a module register happens.
     int (*write)(uint16_t addr, uint32_t const * buf, size_t num_uint32);
 
@@ -27,32 +215,149 @@ typedef struct {
     int (*read)(uint16_t addr, uint32_t * buf, size_t num_uint32);
 } hm2_region_t;
 
-extern hm2_region_t hm2_region[HM2_MAX_REGIONS];
-extern size_t hm2_num_regions;
+
+// The run-time state of each region, in RAM.
+typedef struct {
+    // When update() is next due, in microseconds since boot.
+    uint64_t deadline;
+
+    // Number of times update() ran more than a whole period late, so
+    // that at least one of its updates was skipped.
+    uint32_t deadline_misses;
+
+    // When sample() last ran, in microseconds since boot.
+    uint64_t last_sample;
+
+    // Sequence counter for publishing the region's registers, see
+    // hm2_fw_publish_begin().  Odd while an update is in progress.
+    uint32_t volatile seq;
+
+    hm2_profile_t update_profile;
+    hm2_profile_t write_profile;
+    hm2_profile_t read_profile;
+} hm2_region_state_t;
+
+
+//
+// The region table is built at compile time by each firmware, from its
+// list of compiled-in modules.  See hm2-registry.h.
+//
+
+extern hm2_region_t const * const hm2_region[];
+extern hm2_region_state_t hm2_region_state[];
+extern uint8_t const hm2_region_instances[];
+extern size_t const hm2_num_regions;
+
+// Page-indexed dispatch table, maps each 256-byte page of the hm2
+// address space to 1 + the index of the region that owns it, or to 0
+// if no region owns it.
+extern uint8_t hm2_page_region[HM2_NUM_PAGES];
 
 extern uint8_t hm2_register_file[1<<16];
 extern uint32_t * hm2_register_file32;
 
 
-uint8_t * hm2_fw_register(
-    char const * const name,
-    uint16_t const addr,
-    size_t const size,
-    void (*update)(void),
-    int (*write)(uint16_t addr, uint32_t const * buf, size_t num_uint32),
-    int (*read)(uint16_t addr, uint32_t * buf, size_t num_uint32)
-);
+//
+// The board pin map, built at compile time by each firmware from its
+// list of pins (see hm2-registry.h).  hm2 I/O pin N is RP2040 GPIO N.
+// Each entry says which Module instance (if any) can use that pin as
+// its secondary (alternate source) function.
+//
+
+typedef struct {
+    uint8_t sec_pin;
+    uint8_t sec_tag;
+    uint8_t sec_unit;
+} hm2_pin_t;
+
+extern hm2_pin_t const hm2_pin[HM2_NUM_GPIOS];
+
+// Returns the GPIO that Module instance `sec_unit` of type `sec_tag`
+// uses for its secondary pin `sec_pin`, or -1 if there isn't one.
+int hm2_fw_find_pin(uint8_t sec_tag, uint8_t sec_unit, uint8_t sec_pin);
+
+// The GPIO function (`enum gpio_function`) each pin switches to when
+// the host selects its alternate source in the ioport AltSource
+// register.  Modules fill this in for the pins they use, in init().
+// GPIO_FUNC_NULL for pins that have no alternate source.
+extern uint8_t hm2_pin_alt_function[HM2_NUM_GPIOS];
+
 
+// Initialize the register file and all the compiled-in modules.
+// Runs on the boot core.
+int hm2_fw_init(void);
 
+// Run the module scheduler on core 1.  Doesn't return.
 void hm2_fw_run(void);
 
+// hm2_fw_run() is these two in a loop, sleeping whenever nothing is
+// due.  Set up the schedule with every update() due at `now`:
+void hm2_fw_schedule_init(uint64_t now);
+
+// Run the highest-priority module that's due at `now`, if any.
+// Returns true if a module ran, false if no module was due.
+bool hm2_fw_run_one(uint64_t now);
+
+// A module that updates a group of related registers in the register
+// file (for example a count and its timestamp) brackets the update with
+// these, so the host never reads a mix of old and new values.  `addr`
+// is any address in the module's region.
+void hm2_fw_publish_begin(uint16_t addr);
+void hm2_fw_publish_end(uint16_t addr);
+
+
+//
+// The DPLL (see dpll.c) predicts when the host's servo thread will
+// next talk to the board.
+//
+
+#define HM2_DPLL_NUM_TIMERS 4
+
+// True if the DPLL is locked to the host's reference.
+bool hm2_dpll_locked(void);
+
+// Returns the first time (in microseconds since boot) that DPLL timer
+// `timer` (1-4) fires, more than half a reference period after
+// `after_us`.  Returns UINT64_MAX if the DPLL isn't tracking the host.
+uint64_t hm2_dpll_timer_us(int timer, uint64_t after_us);
+
+// Returns the first time (in microseconds since boot) after `after_us`
+// that DPLL timer `timer` (1-4) fires, or that the host's reference is
+// predicted if `timer` is 0.  Returns UINT64_MAX if the DPLL isn't
+// tracking the host.
+uint64_t hm2_dpll_next_us(int timer, uint64_t after_us);
+
+
+// Core 0 calls this every time around its main loop, between packets,
+// and core 1 every time around the module scheduler's loop, to show the
+// watchdog (see watchdog.c) that they're still getting work done.
+void hm2_watchdog_core0_poll(void);
+void hm2_watchdog_core1_poll(void);
+
 int hm2_fw_read(uint16_t addr, uint32_t * buf, size_t num_uint32);
 int hm2_fw_write(uint16_t addr, uint32_t const * buf, size_t num_uint32);
 
+// Repeated reads or writes of the one register at `addr`, for FIFO
+// registers.
+int hm2_fw_read_fifo(uint16_t addr, uint32_t * buf, size_t num_uint32);
+int hm2_fw_write_fifo(uint16_t addr, uint32_t const * buf, size_t num_uint32);
+
+// Call every region's safe() function, for the watchdog bite and
+// anything else that has to stop the outputs.  From then on, writes to
+// the regions that have a safe() function are dropped, so the host
+// can't drive the outputs again until it calls hm2_fw_resume() (by
+// clearing the watchdog's bitten bit).
+void hm2_fw_safe(void);
+void hm2_fw_resume(void);
+
+
+// Each core has its own SysTick counter, this starts it free-running
+// at the CPU clock on the calling core.  hm2_fw_run() starts it on
+// core 1, hm2_fw_init() starts it on the boot core.
+void hm2_fw_cycle_counter_init(void);
+
 
 int idrom_init(void);
-int ioport_init(void);
-int led_init(void);
 
 
 // This is a helper function to blink the LED, to show that the hostmot2
@@ -0,0 +1,222 @@
+#ifndef HM2_REGISTRY_H
+#define HM2_REGISTRY_H
+
+
+/*
+
+The compile-time module registry.
+
+Each firmware lists the modules it wants compiled in, the board's pin
+map, and the system clock it runs at, then includes this file (in
+exactly one source file) to build the region table, the page-indexed
+dispatch table, the pin table, and the IDROM:
+
+    #define HM2_SYS_CLOCK_HZ (125 * 1000 * 1000)
+
+    #define HM2_MODULES(X)        \
+        X(ioport,  IOPORT,  1)    \
+        X(stepgen, STEPGEN, 2)    \
+        X(led,     LED,     1)
+
+    #define HM2_PINS(P)                          \
+        P(0, STEPGEN, 0, HM2_STEPGEN_STEP)       \
+        P(1, STEPGEN, 0, HM2_STEPGEN_DIR)        \
+        P(2, STEPGEN, 1, HM2_STEPGEN_STEP)       \
+        P(3, STEPGEN, 1, HM2_STEPGEN_DIR)
+
+    #include "hm2-registry.h"
+
+Each `X(name, NAME, instances)` entry refers to the module's region
+descriptor `hm2_<name>_region`, and to its address and size in the hm2
+address space, `HM2_<NAME>_ADDR` and `HM2_<NAME>_SIZE` from hm2-fw.h.
+`instances` is how many instances of the Module this firmware has, it's
+advertised in the IDROM and the module reads it at init from
+`hm2_<name>_instances`.  The region's Module Descriptor, if it has one,
+is `HM2_<NAME>_MD` from hm2-fw.h.
+
+Each `P(gpio, TAG, unit, sec_pin)` entry gives a GPIO to instance `unit`
+of Module `HM2_GTAG_<TAG>`, as its secondary pin `sec_pin`.  GPIOs that
+aren't listed are plain ioport pins.  HM2_PINS is optional.
+
+HM2_SYS_CLOCK_HZ is the IDROM's ClockLow and ClockHigh.  idrom_init()
+checks that it's what the system clock really is.
+
+Everything here is resolved by the compiler and linker: there's no
+registration at boot.  A module that's not listed gets no region, no
+IDROM entry and no pins, and its init(), update() and handlers never
+run, but its code may still be linked in.  In particular the DPLL's and
+the watchdog's entry points are called from outside their modules (by
+the scheduler, the transports and the other modules), so those two are
+always linked.  Unlisted, they don't run: hm2_dpll_locked() stays
+false, and hm2_watchdog_core1_poll() returns without doing anything.
+
+*/
+
+#include "hm2-fw.h"
+
+
+#ifndef HM2_MODULES
+#error "define HM2_MODULES before including hm2-registry.h"
+#endif
+
+
+#ifndef HM2_PINS
+#define HM2_PINS(P)
+#endif
+
+
+#ifndef HM2_SYS_CLOCK_HZ
+#error "define HM2_SYS_CLOCK_HZ before including hm2-registry.h"
+#endif
+
+
+#define HM2_REGISTRY_DECLARE(name, NAME, instances) \
+    extern hm2_region_t const hm2_##name##_region;
+
+#define HM2_REGISTRY_INSTANCES(name, NAME, instances) \
+    uint8_t const hm2_##name##_instances = (instances);
+
+#define HM2_REGISTRY_INDEX(name, NAME, instances) \
+    HM2_REGION_INDEX_##NAME,
+
+#define HM2_REGISTRY_ENTRY(name, NAME, instances) \
+    &hm2_##name##_region,
+
+#define HM2_REGISTRY_INSTANCE_COUNT(name, NAME, instances) \
+    (instances),
+
+// Mark each page of the region with 1 + the region's index.
+#define HM2_REGISTRY_PAGES(name, NAME, instances) \
+    [HM2_##NAME##_ADDR >> HM2_PAGE_SHIFT ... (HM2_##NAME##_ADDR + HM2_##NAME##_SIZE - 1) >> HM2_PAGE_SHIFT] = HM2_REGION_INDEX_##NAME + 1,
+
+#define HM2_REGISTRY_CHECK(name, NAME, instances) \
+    _Static_assert(HM2_##NAME##_SIZE > 0, #name " region is empty"); \
+    _Static_assert(HM2_##NAME##_ADDR + HM2_##NAME##_SIZE <= (1 << 16), #name " region is outside the hm2 address space"); \
+    _Static_assert(((HM2_##NAME##_ADDR | HM2_##NAME##_SIZE) & 0x3) == 0, #name " region isn't word-aligned"); \
+    _Static_assert(((instances) > 0) && ((instances) < 256), #name " has a bad number of instances");
+
+#define HM2_REGISTRY_PIN(gpio, TAG, unit, sec_pin_number) \
+    [gpio] = { .sec_pin = (sec_pin_number), .sec_tag = HM2_GTAG_##TAG, .sec_unit = (unit) },
+
+#define HM2_REGISTRY_PIN_DESCRIPTOR(gpio, TAG, unit, sec_pin_number) \
+    [gpio] = HM2_PIN_DESCRIPTOR((sec_pin_number), HM2_GTAG_##TAG, (unit), HM2_GTAG_IOPORT),
+
+// The HM2_<NAME>_MD's of the regions that are Modules, as Module
+// Descriptors, as a count, and as the number of ioports.
+#define HM2_REGISTRY_MD(gtag_, version_, clock_tag_, instances_, base_address_, num_registers_, strides_, mp_bitmap_) \
+    { \
+        .gtag = (gtag_), \
+        .version = (version_), \
+        .clock_tag = (clock_tag_), \
+        .instances = (instances_), \
+        .base_address = (base_address_), \
+        .num_registers = (num_registers_), \
+        .strides = (strides_), \
+        .mp_bitmap = (mp_bitmap_), \
+    },
+
+#define HM2_REGISTRY_MD_COUNT(gtag, version, clock_tag, instances, base_address, num_registers, strides, mp_bitmap) \
+    + 1
+
+#define HM2_REGISTRY_MD_IO_PORTS(gtag, version, clock_tag, instances, base_address, num_registers, strides, mp_bitmap) \
+    + (((gtag) == HM2_GTAG_IOPORT) ? (instances) : 0)
+
+#define HM2_REGISTRY_MODULE_DESCRIPTOR(name, NAME, instances) \
+    HM2_##NAME##_MD(HM2_REGISTRY_MD, instances)
+
+#define HM2_REGISTRY_MODULE_COUNT(name, NAME, instances) \
+    HM2_##NAME##_MD(HM2_REGISTRY_MD_COUNT, instances)
+
+#define HM2_REGISTRY_IO_PORTS(name, NAME, instances) \
+    HM2_##NAME##_MD(HM2_REGISTRY_MD_IO_PORTS, instances)
+
+
+HM2_MODULES(HM2_REGISTRY_DECLARE)
+
+HM2_MODULES(HM2_REGISTRY_CHECK)
+
+HM2_MODULES(HM2_REGISTRY_INSTANCES)
+
+enum {
+    HM2_MODULES(HM2_REGISTRY_INDEX)
+    HM2_NUM_REGIONS
+};
+
+_Static_assert(HM2_NUM_REGIONS <= HM2_MAX_REGIONS, "too many regions, increase HM2_MAX_REGIONS");
+
+
+hm2_region_t const * const hm2_region[] = {
+    HM2_MODULES(HM2_REGISTRY_ENTRY)
+};
+
+uint8_t const hm2_region_instances[] = {
+    HM2_MODULES(HM2_REGISTRY_INSTANCE_COUNT)
+};
+
+size_t const hm2_num_regions = HM2_NUM_REGIONS;
+
+hm2_region_state_t hm2_region_state[HM2_NUM_REGIONS];
+
+
+// Two regions claiming the same page would silently override each
+// other's initializers, make that a compile error instead.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Woverride-init"
+
+uint8_t hm2_page_region[HM2_NUM_PAGES] = {
+    HM2_MODULES(HM2_REGISTRY_PAGES)
+};
+
+// Same for two pin map entries for one GPIO.
+hm2_pin_t const hm2_pin[HM2_NUM_GPIOS] = {
+    HM2_PINS(HM2_REGISTRY_PIN)
+};
+
+#pragma GCC diagnostic pop
+
+
+#define HM2_NUM_MODULES (0 HM2_MODULES(HM2_REGISTRY_MODULE_COUNT))
+#define HM2_IO_PORTS    (0 HM2_MODULES(HM2_REGISTRY_IO_PORTS))
+
+_Static_assert(HM2_NUM_MODULES <= HM2_MAX_MODULE_DESCRIPTORS, "too many Modules for the IDROM");
+_Static_assert(HM2_IO_PORTS <= HM2_IOPORT_MAX_PORTS, "too many ioports");
+
+// The pins that aren't in the pin map are plain ioport pins, which
+// means overriding that default for the ones that are.  (Two entries
+// for one GPIO are already an error, in hm2_pin.)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+
+hm2_idrom_t const hm2_idrom = {
+    .idrom_type = 2,
+    .offset_to_modules = 0x0040,
+    .offset_to_pin_desc = 0x0200,
+    .board_name = { '*', 'R', 'P', '2', '0', '4', '0', '*' },
+    .fpga_size = 0,
+    .fpga_pins = 56,
+    .io_ports = HM2_IO_PORTS,
+    .io_width = HM2_IO_PORTS * HM2_IOPORT_PORT_WIDTH,
+    .port_width = HM2_IOPORT_PORT_WIDTH,
+
+    // The Modules count in system clock cycles (the PIO state machines
+    // run undivided), there's no faster clock for ClockHigh.
+    .clock_low = HM2_SYS_CLOCK_HZ,
+    .clock_high = HM2_SYS_CLOCK_HZ,
+
+    .instance_stride = { 4, 64 },
+    .register_stride = { 256, 256 },
+
+    .md = {
+        HM2_MODULES(HM2_REGISTRY_MODULE_DESCRIPTOR)
+    },
+
+    .pd = {
+        [0 ... HM2_MAX_PIN_DESCRIPTORS - 1] = HM2_PIN_DESCRIPTOR(0, 0, 0, HM2_GTAG_IOPORT),
+        HM2_PINS(HM2_REGISTRY_PIN_DESCRIPTOR)
+    },
+};
+
+#pragma GCC diagnostic pop
+
+
+#endif // HM2_REGISTRY_H
@@ -4,10 +4,15 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "pico/multicore.h"
+#include "hardware/dma.h"
+#include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "hardware/spi.h"
 
 #include "port_common.h"
 
@@ -17,149 +22,88 @@
 #include "socket.h"
 
 #include "hm2-fw.h"
-#include "lbp16.h"
-
-
-#define DEBUG_COMM 0
 
 
 #define PLL_SYS_KHZ (133 * 1000)
 
+#define HM2_SYS_CLOCK_HZ (PLL_SYS_KHZ * 1000)
+
+// The hostmot2 modules compiled into this firmware.
+#define HM2_MODULES(X) \
+    X(watchdog,   WATCHDOG,   1) \
+    X(ioport,     IOPORT,     2) \
+    X(stepgen,    STEPGEN,    3) \
+    X(encoder,    ENCODER,    2) \
+    X(pwmgen,     PWMGEN,     1) \
+    X(pktuart_tx, PKTUART_TX, 1) \
+    X(pktuart_rx, PKTUART_RX, 1) \
+    X(dpll,       DPLL,       1) \
+    X(capture,    CAPTURE,    1) \
+    X(led,        LED,        1) \
+    X(profile,    PROFILE,    1)
+
+// Which GPIOs the Modules' secondary pins are on.
+#define HM2_PINS(P)                          \
+    P(0, STEPGEN, 0, HM2_STEPGEN_STEP)       \
+    P(1, STEPGEN, 0, HM2_STEPGEN_DIR)        \
+    P(2, STEPGEN, 1, HM2_STEPGEN_STEP)       \
+    P(3, STEPGEN, 1, HM2_STEPGEN_DIR)        \
+    P(4, STEPGEN, 2, HM2_STEPGEN_STEP)       \
+    P(5, STEPGEN, 2, HM2_STEPGEN_DIR)        \
+    P(6, PKTUART_TX, 0, HM2_PKTUART_TX_DATA) \
+    P(7, PKTUART_RX, 0, HM2_PKTUART_RX_DATA) \
+    P(8, ENCODER, 0, HM2_ENCODER_A)          \
+    P(9, ENCODER, 0, HM2_ENCODER_B)          \
+    P(10, ENCODER, 0, HM2_ENCODER_INDEX)     \
+    P(11, ENCODER, 1, HM2_ENCODER_A)         \
+    P(12, ENCODER, 1, HM2_ENCODER_B)         \
+    P(13, ENCODER, 1, HM2_ENCODER_INDEX)     \
+    P(14, PWMGEN, 0, HM2_PWMGEN_OUT0)        \
+    P(15, PWMGEN, 0, HM2_PWMGEN_OUT1)
+
+#include "hm2-registry.h"
+#include "flash-update.h"
+#include "lbp16.h"
 
-static wiz_NetInfo const g_net_info = {
-    .mac = {0x00, 0x08, 0xDC, 0x12, 0x34, 0x56}, // MAC address
-    .ip = {192, 168, 1, 121},                    // IP address
-    .sn = {255, 255, 255, 0},                    // Subnet Mask
-    .gw = {192, 168, 1, 1},                      // Gateway
-    .dns = {8, 8, 8, 8},                         // DNS server
-    .dhcp = NETINFO_STATIC                       // DHCP enable/disable
-};
 
+#define DEBUG_COMM 0
 
-typedef struct {
-    uint16_t cookie;
-    uint16_t memsizes;
-    uint16_t memranges;
-    uint16_t address_pointer;
-    uint8_t spacename[9];  // It's really only 8 bytes, but it's convenient to store the terminating NULL.
-} hm2_eth_info_area_t;
 
+// The W5500's INTn (active low) is on GPIO 21 of the W5500-EVB-Pico.
+#define W5500_INT_PIN 21
 
+// LinuxCNC's servo thread talks to the realtime socket, on the port
+// hm2_eth uses.  Tools can use the management socket instead, which is
+// only served when the realtime socket has nothing waiting, so they
+// can't hold up a servo packet.  The W5500 picks the socket by
+// destination port, so they're on different ports.
 //
-// MEMSIZES arguments:
-//
-//     writable:
-//         0: read-only
-//         1: writable
-//
-//     type:
-//         01: register
-//         02: memory
-//         0E: EEPROM
-//         0F: flash
-//
-//     access (bitmap):
-//         1: 8 bit
-//         2: 16 bit
-//         4: 32 bit
-//         8: 64 bit
+// mesaflash and elbpcom only know the realtime port, so packets that
+// arrive there without touching the hm2 registers (see
+// lbp16_is_management()) are put aside, and handled like the
+// management socket's, once the realtime socket is empty.
 //
+// The W5500 has 16 KB each of RX and TX buffer to share among its 8
+// sockets, in sizes of 0, 1, 2, 4, 8 or 16 KB.  Other sockets get none.
+#define W5500_RT_SOCKET    0
+#define W5500_RT_PORT      27181
+#define W5500_RT_RX_KB     8
+#define W5500_RT_TX_KB     8
 
-#define MEMSIZES(writable, type, access) \
-    ( \
-        (writable << 15) \
-        | (type << 8) \
-        | (access) \
-    )
+#define W5500_MGMT_SOCKET  1
+#define W5500_MGMT_PORT    27182
+#define W5500_MGMT_RX_KB   4
+#define W5500_MGMT_TX_KB   4
 
 
-//
-// MEMRANGES arguments:
-//
-//     erase_block_size: Erase block size is 2^E.  Used for flash only,
-//         should be 0 for non-flash memory spaces.
-//
-//     page_size: Page size is 2^P.  Used for flash only, should be 0
-//         for non-flash memory spaces.
-//
-//     ps_address_range: Ps Address Range is 2^S.
-//
-
-#define MEMRANGES(erase_block_size, page_size, ps_address_range) \
-    ( \
-        (erase_block_size << 11) \
-        | (page_size << 6) \
-        | (ps_address_range) \
-    )
-
-
-hm2_eth_info_area_t eth_info_area[8] = {
-
-    {
-        .cookie = 0x5a00,
-        .memsizes = MEMSIZES(1, 1, 4),
-        .memranges = MEMRANGES(0, 0, 16),
-        .address_pointer = 0x0000,
-        .spacename = "HostMot2"
-    },
-
-    {
-        .cookie = 0x5a01,
-        .memsizes = MEMSIZES(1, 1, 2),
-        .memranges = MEMRANGES(0, 0, 8),
-        .address_pointer = 0x0000,
-        .spacename = "W5500"
-    },
-
-    {
-        .cookie = 0x5a02,
-        .memsizes = MEMSIZES(1, 0x0e, 2),
-        .memranges = MEMRANGES(0, 0, 7),
-        .address_pointer = 0x0000,
-        .spacename = "EtherEEP"
-    },
-
-    {
-        .cookie = 0x5a03,
-        .memsizes = MEMSIZES(1, 0x0f, 4),
-        .memranges = MEMRANGES(16, 8, 24),
-        .address_pointer = 0x0000,
-        .spacename = "Flash"
-    },
-
-    {
-        .cookie = 0x5a04,
-        .memsizes = MEMSIZES(1, 2, 2),
-        .memranges = MEMRANGES(0, 0, 4),
-        .address_pointer = 0x0000,
-        .spacename = "Timers"
-    },
-
-    // There is no memory space 5.
-    {
-        .cookie = 0x0000,
-        .memsizes = MEMSIZES(1, 1, 7),
-        .memranges = MEMRANGES(0, 0, 0),
-        .address_pointer = 0x0000,
-        .spacename = "unused"
-    },
-
-    {
-        .cookie = 0x5a06,
-        .memsizes = MEMSIZES(1, 2, 2),
-        .memranges = MEMRANGES(0, 0, 4),
-        .address_pointer = 0x0000,
-        .spacename = "LBP16RW"
-    },
-
-    {
-        .cookie = 0x5a07,
-        .memsizes = MEMSIZES(0, 2, 2),
-        .memranges = MEMRANGES(0, 0, 4),
-        .address_pointer = 0x0000,
-        .spacename = "LBP16RO"
-    },
 
+static wiz_NetInfo const g_net_info = {
+    .mac = {0x00, 0x08, 0xDC, 0x12, 0x34, 0x56}, // MAC address
+    .ip = {192, 168, 1, 121},                    // IP address
+    .sn = {255, 255, 255, 0},                    // Subnet Mask
+    .gw = {192, 168, 1, 1},                      // Gateway
+    .dns = {8, 8, 8, 8},                         // DNS server
+    .dhcp = NETINFO_STATIC                       // DHCP enable/disable
 };
 
 
@@ -215,112 +159,8 @@ uint8_t memory_space_2[128] = {
 };
 
 
-// SPACE 4 LBP TIMER/UTILITY AREA
-//
-// Address space 4 is for read/write access to LBP specific timing registers. All
-// memory space 4 access is 16 bit.
-//
-// MEMORY SPACE 4 LAYOUT:
-// ADDRESS DATA
-// 0000 uSTimeStampReg
-// 0002 WaituSReg
-// 0004 HM2Timeout
-// 0006 WaitForHM2RefTime
-// 0008 WaitForHM2Timer1
-// 000A WaitForHM2Timer2
-// 000C WaitForHM2Timer3
-// 000E WaitForHM2Timer4
-// 0010..001E Scratch registers for any use
-//
-// The uSTimeStamp register reads the free running hardware microsecond
-// timer. It is useful for timing internal 7I80 operations. Writes to
-// the uSTimeStamp register are a no- op.
-//
-// The WaituS register delays processing for the specified number of
-// microseconds when written, (0 to 65535 uS) reads return the last wait
-// time written.
-//
-// The HM2TimeOut register sets the timeout value for all WaitForHM2 times
-// (0 to 65536 uS).
-//
-// All the WaitForHM2Timer registers wait for the rising edge of the
-// specified timer or reference output when read or written, write data
-// is don’t care, and reads return the wait time in uS.
-//
-// The HM2TimeOut register places an upper bound on how long the
-// WaitForHM2 operations will wait. HM2Timeouts set the HM2TImeout error
-// bit in the error register.
-
-uint8_t memory_space_4[32] = {
-    // addr 0x0000
-    0x00, 0x00,
-};
-
-
-
-
-#define MS6_ERROR             0
-#define MS6_LBP_PARSE_ERRORS  1
-#define MS6_LBP_MEM_ERRORS    2
-#define MS6_LBP_WRITE_ERRORS  3
-#define MS6_RX_PKT_COUNT      4
-#define MS6_RX_UDP_COUNT      5
-#define MS6_RX_BAD_COUNT      6
-#define MS6_TX_PKT_COUNT      7
-#define MS6_TX_UDP_COUNT      8
-#define MS6_TX_BAD_COUNT      9
-#define MS6_LED_MODE         10
-#define MS6_DEBUG_LED_PTR    11
-#define MS6_SCRATCH          12
-#define MS6_EEPROM_WENA      14
-#define MS6_RESET            15
-
-uint16_t memory_space_6[16] = {
-    // addr 0x0000
-    0x0000,
-    0x0000,
-    0x0000,
-    0x0000,
-    0x0000,
-    0x0000,
-    0x0000,
-    0x0000,
-
-    // addr 0x0010
-    0x0000,
-    0x0000,
-    0x0000,
-    0x0000,
-    0x0000,
-    0x0000,
-    0x0000,
-    0x0000
-};
-
-
-// Read-only const board id.  From the 7i93 manual v1.0:
-// MEMORY SPACE 7 LAYOUT:
-// ADDRESS DATA
-// 0000 CardNameChar-0,1
-// 0002 CardNameChar-2,3
-// 0004 CardNameChar-4,5
-// 0006 CardNameChar-6,7
-// 0008 CardNameChar-8,9
-// 000A CardNameChar-10,11
-// 000C CardNameChar-12.13
-// 000E CardNameChar-14,15
-// 0010 LBPVersion
-// 0012 FirmwareVersion
-// 0014 Option Jumpers
-// 0016 Reserved
-// 0018 RecvStartTS 1 uSec timestamps
-// 001A RecvDoneTS For performance monitoring
-// 001C SendStartTS Send timestamps are
-// 001E SendDoneTS from previous packet
-//
-// Only the CardName seems to be used.  Should be all uppercase.
-uint8_t const memory_space_7[32] = {
-    "W5500-EVB-PICO"
+memory_space_7_t memory_space_7 = {
+    .card_name = "W5500-EVB-PICO",
 };
 
 
@@ -339,237 +179,438 @@ static void set_clock_khz(void) {
 }
 
 
-static int handle_info_area_access(
-    lbp16_cmd_t const * const cmd,
-    uint16_t addr,
-    uint8_t const * const data,
-    uint8_t * reply_packet
-) {
-    uint8_t * info_area = (uint8_t *)&eth_info_area[cmd->memory_space];
+// The received packet, and the reply being built.  They're words so
+// that register data in them is word-aligned wherever it can be: the
+// hm2 register functions take uint32_t pointers, and the Cortex-M0+
+// faults on unaligned word loads and stores.
+//
+// The received packet comes with the 8-byte header that the W5500 puts
+// in front of each UDP packet in the socket's RX buffer (source IP,
+// source port, length), so that one SPI burst reads both, and the
+// packet is still word-aligned after it.
+static struct {
+    uint8_t header[8];
+    uint32_t packet[LBP16_MAX_PACKET / 4];
+} rx;
+
+static uint32_t reply_packet[LBP16_MAX_PACKET / 4];
+
+// A management packet that came in on the realtime socket, put aside
+// until there are no realtime packets waiting.  `size` is 0 when
+// there's none.
+static struct {
+    int size;
+    uint8_t addr[4];
+    uint16_t port;
+    uint32_t packet[LBP16_MAX_PACKET / 4];
+} deferred;
+
+// Whether the last reply on each socket is still being sent by the
+// W5500.
+static bool send_pending[_WIZCHIP_SOCK_NUM_];
 
-    if (cmd->transfer_bytes != 2) {
-        printf("i only know how to transfer 16-bit chunks to info areas\n");
-        return 0;
-    }
 
-    if (cmd->memory_space == 5) {
-        printf("no info area for memory space 5\n");
-        return 0;
-    }
+//
+// DMA for the W5500's SPI bursts.
+//
+// ioLibrary does every register and buffer access in one chip select,
+// as a 3-byte address and control phase and then the data.  Without
+// burst callbacks it moves the data a byte at a time through the SPI
+// callbacks of the port, with core 0 polling the SPI FIFOs for every
+// byte.  These move the data with DMA instead, at the SPI clock rate:
+// one channel feeds the TX FIFO and the other drains the RX FIFO,
+// since SPI always does both.
+//
 
-    // Lucky us, the RP2040 is little-endian just like the LBP16 network
-    // protocol.
-    if (cmd->write) {
-        memcpy(&info_area[addr], data, cmd->num_bytes);
-        return 0;
-    } else {
-        memcpy(reply_packet, &info_area[addr], cmd->num_bytes);
-        return cmd->num_bytes;
-    }
+static uint w5500_dma_tx;
+static uint w5500_dma_rx;
+static dma_channel_config w5500_dma_tx_config;
+static dma_channel_config w5500_dma_rx_config;
+
+
+static void w5500_dma_transfer(uint8_t const * tx_buf, bool tx_increment, uint8_t * rx_buf, bool rx_increment, uint16_t len) {
+    channel_config_set_read_increment(&w5500_dma_tx_config, tx_increment);
+    channel_config_set_write_increment(&w5500_dma_rx_config, rx_increment);
+    dma_channel_configure(w5500_dma_tx, &w5500_dma_tx_config, &spi_get_hw(SPI_PORT)->dr, tx_buf, len, false);
+    dma_channel_configure(w5500_dma_rx, &w5500_dma_rx_config, rx_buf, &spi_get_hw(SPI_PORT)->dr, len, false);
+    dma_start_channel_mask((1u << w5500_dma_tx) | (1u << w5500_dma_rx));
+
+    // The RX side finishes last, once the last byte is all the way out
+    // and back, so the chip select can go up after this.
+    dma_channel_wait_for_finish_blocking(w5500_dma_rx);
 }
 
 
-// Handle an LBP16 command.
-//
-// Write commands copy bytes from `data` (from the user) to the local
-// destination specified by `cmd`.  Returns 0.
+static void w5500_read_burst(uint8_t * buf, uint16_t len) {
+    static uint8_t const dummy_tx = 0xff;
+    w5500_dma_transfer(&dummy_tx, false, buf, true, len);
+}
+
+
+static void w5500_write_burst(uint8_t * buf, uint16_t len) {
+    static uint8_t dummy_rx;
+    w5500_dma_transfer(buf, true, &dummy_rx, false, len);
+}
+
+
+// After wizchip_initialize(), which installs the byte-at-a-time SPI
+// callbacks.
+static void w5500_dma_init(void) {
+    w5500_dma_tx = dma_claim_unused_channel(true);
+    w5500_dma_rx = dma_claim_unused_channel(true);
+
+    w5500_dma_tx_config = dma_channel_get_default_config(w5500_dma_tx);
+    channel_config_set_transfer_data_size(&w5500_dma_tx_config, DMA_SIZE_8);
+    channel_config_set_dreq(&w5500_dma_tx_config, spi_get_dreq(SPI_PORT, true));
+    channel_config_set_write_increment(&w5500_dma_tx_config, false);
+
+    w5500_dma_rx_config = dma_channel_get_default_config(w5500_dma_rx);
+    channel_config_set_transfer_data_size(&w5500_dma_rx_config, DMA_SIZE_8);
+    channel_config_set_dreq(&w5500_dma_rx_config, spi_get_dreq(SPI_PORT, false));
+    channel_config_set_read_increment(&w5500_dma_rx_config, false);
+
+    reg_wizchip_spiburst_cbfunc(w5500_read_burst, w5500_write_burst);
+}
+
+
+// Receive a UDP packet on socket `sn`, into `rx`.  Returns the packet's
+// size, 0 if there isn't one, or -1 if it was too big for `rx` and was
+// dropped.
 //
-// Read commands copy bytes from the local source specified by `cmd`
-// to the `reply_packet` which will be sent to the user.  Returns the
-// number of bytes written to `reply_packet`.
-
-static int handle_lbp16(
-    lbp16_cmd_t const * const cmd,
-    uint8_t const * data,
-    uint8_t * reply_packet
-) {
-
-    uint16_t addr;
-    if (cmd->has_addr) {
-        addr = data[0] | (data[1] << 8);
-        data += 2;
-    } else {
-        // FIXME: use addr_ptr from the info area
-        printf("no addr??\n");
+// Unlike the socket library's recvfrom(), which reads the W5500's UDP
+// header and the packet in two SPI bursts, this reads them together:
+// as much as the RX buffer holds, up to the biggest packet there could
+// be.  If that includes some of the next packet, it's read again next
+// time, since only this packet is marked as read.
+
+static int udp_receive(uint8_t sn, uint8_t addr[4], uint16_t * port) {
+    uint16_t received = getSn_RX_RSR(sn);
+    if (received == 0) {
         return 0;
     }
+    memory_space_7.recv_start_ts = time_us_32();
+    ++memory_space_6[MS6_RX_PKT_COUNT];
 
-#if DEBUG_COMM
-    lbp16_log_cmd(cmd);
-    printf("    addr: 0x%04x\n", addr);
-#endif
+    if (received > sizeof(rx)) {
+        received = sizeof(rx);
+    }
 
-    if (cmd->info_area) {
-        if (!cmd->has_addr) {
-            printf("info area access with no addr?\n");
-            return 0;
-        }
-        return handle_info_area_access(cmd, addr, data, reply_packet);
+    uint16_t ptr = getSn_RX_RD(sn);
+    uint32_t addrsel = ((uint32_t)ptr << 8) + (WIZCHIP_RXBUF_BLOCK(sn) << 3);
+    WIZCHIP_READ_BUF(addrsel, (uint8_t *)&rx, received);
+
+    memcpy(addr, &rx.header[0], 4);
+    *port = (rx.header[4] << 8) | rx.header[5];
+    uint16_t size = (rx.header[6] << 8) | rx.header[7];
+
+    setSn_RX_RD(sn, ptr + sizeof(rx.header) + size);
+    setSn_CR(sn, Sn_CR_RECV);
+    while (getSn_CR(sn)) {
+        // The W5500 takes the command.
     }
 
-    // Lucky us, the RP2040 is little-endian just like the LBP16 network
-    // protocol.
-
-    if (cmd->write) {
-        uint8_t * dest;
-
-        switch (cmd->memory_space) {
-            case 0:
-                int r = hm2_fw_write(addr, (uint32_t*)data, cmd->num_bytes/4);
-                if (r >= 0) {
-                    return 0;
-                }
-                dest = hm2_register_file;
-                break;
-            case 4:
-                dest = memory_space_4;
-                break;
-            case 6:
-                dest = (uint8_t *)memory_space_6;
-                break;
-            default:
-                printf("can't write to memory space %d, addr=0x%04x\n", cmd->memory_space, addr);
-                lbp16_log_cmd(cmd);
-                break;
-        }
-        memcpy(&dest[addr], data, cmd->num_bytes);
-        return 0;
+    if ((sizeof(rx.header) + size) > received) {
+        ++memory_space_6[MS6_RX_BAD_COUNT];
+        return -1;
+    }
+    memory_space_7.recv_done_ts = time_us_32();
+    return size;
+}
 
-    } else {
-        uint8_t * src;
-
-        switch (cmd->memory_space) {
-            case 0:
-                int r = hm2_fw_read(addr, (uint32_t*)reply_packet, cmd->num_bytes/4);
-                if (r >= 0) {
-                    return cmd->num_bytes;
-                }
-                src = hm2_register_file;
-                break;
-            case 2:
-                src = memory_space_2;
-                break;
-            case 4:
-                src = memory_space_4;
-                break;
-            case 6:
-                src = (uint8_t *)memory_space_6;
-                break;
-            case 7:
-                src = (uint8_t *)memory_space_7;
-                break;
-            default:
-                printf("can't read from memory space %d, addr=0x%04x\n", cmd->memory_space, addr);
-                lbp16_log_cmd(cmd);
-                break;
-        }
 
-        memcpy(reply_packet, &src[addr], cmd->num_bytes);
-        ++memory_space_6[MS6_TX_PKT_COUNT];
-        return cmd->num_bytes;
+// The W5500 has finished sending the last packet on socket `sn`, or
+// given up.  `ir` is its SENDOK or TIMEOUT interrupt.
+static void udp_send_done(uint8_t sn, uint8_t ir) {
+    memory_space_7.send_done_ts = time_us_32();
+    setSn_IR(sn, ir);
+    if (ir & Sn_IR_TIMEOUT) {
+        ++memory_space_6[MS6_TX_BAD_COUNT];
     }
+    send_pending[sn] = false;
 }
 
 
-// Parse a UDP packet as one or more LBP16 commands.
-static void handle_udp(uint8_t const * packet, size_t size, uint8_t reply_addr[4], uint16_t reply_port) {
-    uint8_t reply_packet[1450];
-    size_t reply_packet_offset = 0;
+// Send a UDP packet on socket `sn`, without waiting for the W5500 to
+// finish sending it: the packet goes on the wire while the next
+// request is received and handled, and the next send waits for it
+// instead, if it has to.  (The socket library's sendto() waits every
+// time.)
 
-#if DEBUG_COMM
-    hm2_fw_log_uint8(packet, size);
-#endif
+static void udp_send(uint8_t sn, uint8_t * packet, uint16_t size, uint8_t addr[4], uint16_t port) {
+    memory_space_7.send_start_ts = time_us_32();
+
+    if (send_pending[sn]) {
+        uint8_t ir;
+        do {
+            ir = getSn_IR(sn) & (Sn_IR_SENDOK | Sn_IR_TIMEOUT);
+        } while (ir == 0);
+        udp_send_done(sn, ir);
+    }
+
+    setSn_DIPR(sn, addr);
+    setSn_DPORT(sn, port);
+    wiz_send_data(sn, packet, size);
+    setSn_CR(sn, Sn_CR_SEND);
+    while (getSn_CR(sn)) {
+        // The W5500 takes the command.
+    }
+    send_pending[sn] = true;
+    ++memory_space_6[MS6_TX_PKT_COUNT];
+    ++memory_space_6[MS6_TX_UDP_COUNT];
+}
+
+
+// Handle a UDP packet of one or more LBP16 commands from socket `sn`,
+// and send the reply.  Only the servo thread's packets (realtime, and
+// not `management`) are worth caching plans for.
+static void handle_udp(uint8_t sn, bool management, uint8_t const * packet, size_t size, uint8_t reply_addr[4], uint16_t reply_port) {
+    uint8_t * reply = (uint8_t *)reply_packet;
 
     ++memory_space_6[MS6_RX_UDP_COUNT];
 
-    while (size > 0) {
-        uint16_t raw_cmd = packet[0] | (packet[1] << 8);
-        packet += 2;
-        size -= 2;
+    bool cache = (sn == W5500_RT_SOCKET) && !management;
+    int reply_size = lbp16_handle_packet(packet, size, reply, cache);
+    if (reply_size > 0) {
+        udp_send(sn, reply, reply_size, reply_addr, reply_port);
+    }
+}
 
-        lbp16_cmd_t cmd;
-        lbp16_decode_cmd(raw_cmd, &cmd);
 
-        ++memory_space_6[MS6_RX_PKT_COUNT];
+// The W5500 pulls INTn low while one of the sockets has received
+// packets that haven't been acknowledged (its RECV interrupt), and this
+// handles them, so packets are handled as soon as they arrive without
+// core 0 polling the W5500 over SPI in between.  It's level triggered,
+// so it runs again if a packet arrives right after the RECV interrupt
+// is cleared.
+//
+// The realtime socket's servo packets all go first.  A management
+// packet (from the management socket, or put aside from the realtime
+// socket) is only handled when there are none, and then the realtime
+// socket is checked again before the next one.  Management packets on
+// the realtime socket stay in order: if one is already put aside when
+// the next arrives, the older one is handled then, and the new one put
+// aside in its place.
+//
+// INTn also goes low when a reply has been sent (SENDOK or TIMEOUT),
+// so the send is timestamped when it finishes rather than when the
+// next one starts.
+//
+// This runs in interrupt context, at the default priority, and a packet
+// can keep it busy for a while: memory space 4's WaituS and WaitForHM2
+// busy-wait, for up to 50 ms a packet (see lbp16.c).  The watchdog bite (watchdog.c) is
+// an alarm interrupt on core 0 with a higher priority, so it preempts
+// this instead of waiting for it.
+
+static uint8_t const w5500_sockets[] = { W5500_RT_SOCKET, W5500_MGMT_SOCKET };
+
+// A packet that accesses the flash while erases or programs are queued
+// is held in `rx`, with the W5500's interrupt off, until main() has done
+// them (see flash-update.h).  The packets after it wait in the W5500.
+static struct {
+    bool volatile held;
+    uint8_t sn;
+    bool management;
+    int size;
+    uint8_t addr[4];
+    uint16_t port;
+} held_packet;
+
+
+// Swap the packet in `rx` with the one put aside, which may be none.
+static void swap_deferred(int * size, uint8_t addr[4], uint16_t * port) {
+    size_t num_uint32 = (MAX(*size, deferred.size) + 3) / 4;
+    for (size_t i = 0; i < num_uint32; ++i) {
+        uint32_t word = rx.packet[i];
+        rx.packet[i] = deferred.packet[i];
+        deferred.packet[i] = word;
+    }
+    for (size_t i = 0; i < sizeof(deferred.addr); ++i) {
+        uint8_t byte = addr[i];
+        addr[i] = deferred.addr[i];
+        deferred.addr[i] = byte;
+    }
+    uint16_t p = *port;
+    *port = deferred.port;
+    deferred.port = p;
+    int s = *size;
+    *size = deferred.size;
+    deferred.size = s;
+}
 
-        if (cmd.transfer_count < 1 || cmd.transfer_count > 127) {
-            printf("transfer count %d out of bounds\n", cmd.transfer_count);
-            ++memory_space_6[MS6_RX_BAD_COUNT];
-            return;
+static void w5500_irq(uint gpio, uint32_t events) {
+    for (uint i = 0; i < sizeof(w5500_sockets); ++i) {
+        uint8_t sn = w5500_sockets[i];
+        uint8_t ir = getSn_IR(sn) & (Sn_IR_SENDOK | Sn_IR_TIMEOUT);
+        if (ir != 0) {
+            udp_send_done(sn, ir);
         }
 
-        int bytes_needed = 0;
-        if (cmd.has_addr) {
-            bytes_needed += 2;
-        }
-        if (cmd.write) {
-            bytes_needed += cmd.num_bytes;
+        // Clear it first, so a packet arriving while these are handled
+        // sets it again.
+        setSn_IR(sn, Sn_IR_RECV);
+    }
+
+    while (true) {
+        uint8_t addr[4];
+        uint16_t port;
+
+        uint8_t sn = W5500_RT_SOCKET;
+        bool management = false;
+        int r = udp_receive(sn, addr, &port);
+        if ((r > 0) && lbp16_is_management((uint8_t const *)rx.packet, r)) {
+            // Put it aside, and if there was one already, it's its turn.
+            swap_deferred(&r, addr, &port);
+            if (r == 0) {
+                continue;
+            }
+            management = true;
+        } else if ((r == 0) && (deferred.size > 0)) {
+            swap_deferred(&r, addr, &port);
+            management = true;
         }
-        if (size < bytes_needed) {
-            printf("lbp16 command doesn't have enough data");
-            ++memory_space_6[MS6_RX_BAD_COUNT];
-            return;
+        if (r == 0) {
+            sn = W5500_MGMT_SOCKET;
+            management = true;
+            r = udp_receive(sn, addr, &port);
         }
-
-        int r = handle_lbp16(&cmd, packet, &reply_packet[reply_packet_offset]);
 #if DEBUG_COMM
-        printf("that lbp16 cmd added %d bytes to the reply\n", r);
+        printf("udp_receive %d (socket %u, addr=%u.%u.%u.%u, port=%u)\n", r, sn, addr[0], addr[1], addr[2], addr[3], port);
 #endif
-        reply_packet_offset += r;
+        if (r == 0) {
+            break;
+        }
+        if (r < 0) {
+            continue;
+        }
+        if (flash_update_busy() && lbp16_uses_flash((uint8_t const *)rx.packet, r)) {
+            held_packet.held = true;
+            held_packet.sn = sn;
+            held_packet.management = management;
+            held_packet.size = r;
+            memcpy(held_packet.addr, addr, sizeof(held_packet.addr));
+            held_packet.port = port;
+            gpio_set_irq_enabled(W5500_INT_PIN, GPIO_IRQ_LEVEL_LOW, false);
+            break;
+        }
+        handle_udp(sn, management, (uint8_t const *)rx.packet, r, addr, port);
+    }
+}
+
+
+// Once the flash work is done, handle the held packet and the ones that
+// came after it, as the interrupt would have.
+static void w5500_release_held_packet(void) {
+    irq_set_enabled(IO_IRQ_BANK0, false);
+
+    held_packet.held = false;
+    handle_udp(held_packet.sn, held_packet.management, (uint8_t const *)rx.packet, held_packet.size, held_packet.addr, held_packet.port);
 
-        packet += bytes_needed;
-        size -= bytes_needed;
+    // Their RECV interrupts were already cleared, so INTn won't say
+    // they're there.
+    w5500_irq(W5500_INT_PIN, 0);
+    if (!held_packet.held) {
+        gpio_set_irq_enabled(W5500_INT_PIN, GPIO_IRQ_LEVEL_LOW, true);
     }
 
-    if (reply_packet_offset > 0) {
-        int32_t r = sendto(0, reply_packet, reply_packet_offset, reply_addr, reply_port);
-        ++memory_space_6[MS6_TX_UDP_COUNT];
+    irq_set_enabled(IO_IRQ_BANK0, true);
+}
+
+
+static void w5500_sockets_init(void) {
+    uint8_t buf_kb[2][_WIZCHIP_SOCK_NUM_] = { 0 };
+    buf_kb[0][W5500_RT_SOCKET] = W5500_RT_TX_KB;
+    buf_kb[1][W5500_RT_SOCKET] = W5500_RT_RX_KB;
+    buf_kb[0][W5500_MGMT_SOCKET] = W5500_MGMT_TX_KB;
+    buf_kb[1][W5500_MGMT_SOCKET] = W5500_MGMT_RX_KB;
+    if (ctlwizchip(CW_INIT_WIZCHIP, buf_kb) != 0) {
+        printf("bad W5500 socket buffer sizes\n");
+    }
+
+    if (socket(W5500_RT_SOCKET, Sn_MR_UDP, W5500_RT_PORT, 0) != W5500_RT_SOCKET) {
+        printf("can't open the realtime socket\n");
+    }
+    if (socket(W5500_MGMT_SOCKET, Sn_MR_UDP, W5500_MGMT_PORT, 0) != W5500_MGMT_SOCKET) {
+        printf("can't open the management socket\n");
+    }
+}
+
+
+static void w5500_irq_init(void) {
+    // Only the sockets' own interrupts drive INTn.
+    uint8_t simr = 0;
+    for (uint i = 0; i < sizeof(w5500_sockets); ++i) {
+        setSn_IMR(w5500_sockets[i], Sn_IR_RECV | Sn_IR_SENDOK | Sn_IR_TIMEOUT);
+        simr |= 1 << w5500_sockets[i];
     }
+    setSIMR(simr);
+
+    gpio_init(W5500_INT_PIN);
+    gpio_set_dir(W5500_INT_PIN, GPIO_IN);
+    gpio_pull_up(W5500_INT_PIN);
+    gpio_set_irq_enabled_with_callback(W5500_INT_PIN, GPIO_IRQ_LEVEL_LOW, true, w5500_irq);
 }
 
 
 int main() {
+    // The PIO Modules time things in system clock cycles, so set the
+    // clock before initializing them.
+    set_clock_khz();
+
     stdio_init_all();
 
     led_blink(4, 200);
 
     printf("Hostmot2 firwmare starting\n");
 
-    ioport_init();
-    idrom_init();
-    led_init();
+    if (hm2_fw_init() < 0) {
+        // Don't start the Modules (core 1) on a broken setup.
+        printf("Hostmot2 firmware failed to initialize, stopping\n");
+        while (true) {
+            tight_loop_contents();
+        }
+    }
 
     printf("Hostmot2 firmware initialized!\n");
 
 
     multicore_launch_core1(hm2_fw_run);
 
-
-    set_clock_khz();
-
     wizchip_spi_initialize();
     wizchip_cris_initialize();
 
     wizchip_reset();
     wizchip_initialize();
     wizchip_check();
+    w5500_dma_init();
+
+    // Setting the buffer sizes resets the W5500, so this goes before
+    // the network settings.
+    w5500_sockets_init();
 
     network_initialize(g_net_info);
 
     print_network_information(g_net_info);
 
+    w5500_irq_init();
 
-    int8_t sock = socket(0, Sn_MR_UDP, 27181, 0);
-
+    // Packets are handled by w5500_irq().  In between, this core
+    // programs the flash, handles a packet that was held until that was
+    // done, and tells the watchdog it's getting through the packets.  A
+    // packet that queues flash work or asks for a reset wakes it; if one
+    // slips in just before __wfi(), the watchdog's heartbeat timer wakes
+    // it soon after.
     while (true) {
-        uint8_t packet[1024];
-        uint8_t addr[4];
-        uint16_t port;
-
-        int32_t r = recvfrom(0, packet, sizeof(packet), addr, &port);
-#if DEBUG_COMM
-        printf("recvfrom %d (addr=%u.%u.%u.%u, port=%u)\n", r, addr[0], addr[1], addr[2], addr[3], port);
-#endif
-        handle_udp(packet, r, addr, port);
+        hm2_watchdog_core0_poll();
+        if (memory_space_6[MS6_RESET] == MS6_RESET_MAGIC) {
+            flash_update_reboot();
+        }
+        if (flash_update_poll()) {
+            continue;
+        }
+        if (held_packet.held) {
+            w5500_release_held_packet();
+        } else {
+            __wfi();
+        }
     }
 }
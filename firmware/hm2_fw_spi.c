@@ -33,6 +33,19 @@
 #include "hm2-fw.h"
 
 
+// This firmware leaves the system clock at the SDK's default.
+#define HM2_SYS_CLOCK_HZ (125 * 1000 * 1000)
+
+// The hostmot2 modules compiled into this firmware.
+#define HM2_MODULES(X) \
+    X(watchdog, WATCHDOG, 1) \
+    X(dpll,     DPLL,     1) \
+    X(led,      LED,      1) \
+    X(profile,  PROFILE,  1)
+
+#include "hm2-registry.h"
+
+
 #if !defined(spi_default) || !defined(PICO_DEFAULT_SPI_SCK_PIN) || !defined(PICO_DEFAULT_SPI_TX_PIN) || !defined(PICO_DEFAULT_SPI_RX_PIN) || !defined(PICO_DEFAULT_SPI_CSN_PIN)
 #error hm2-fw requires a board with SPI pins
 #endif
@@ -62,6 +75,33 @@ void printbuf(uint8_t buf[], size_t len) {
 }
 
 
+// spi_write_read_blocking(), except that it tells the watchdog this
+// core is still going while it waits for the host to clock the bytes,
+// since the host can stop for as long as it likes, even in the middle
+// of a frame.  `src` is `len` bytes, or one byte sent `len` times if
+// `src_increment` is false.
+static void spi_transfer(uint8_t const * src, bool src_increment, uint8_t * dst, size_t len) {
+    size_t const fifo_depth = 8;
+    size_t rx_remaining = len;
+    size_t tx_remaining = len;
+
+    while ((rx_remaining > 0) || (tx_remaining > 0)) {
+        if ((tx_remaining > 0) && spi_is_writable(spi_default) && (rx_remaining < tx_remaining + fifo_depth)) {
+            spi_get_hw(spi_default)->dr = *src;
+            if (src_increment) {
+                ++src;
+            }
+            --tx_remaining;
+        }
+        if ((rx_remaining > 0) && spi_is_readable(spi_default)) {
+            *dst++ = (uint8_t)spi_get_hw(spi_default)->dr;
+            --rx_remaining;
+        }
+        hm2_watchdog_core0_poll();
+    }
+}
+
+
 int main() {
     // Enable stdio so we can print log/debug messages.
     stdio_init_all();
@@ -70,8 +110,13 @@ int main() {
 
     printf("Hostmot2 firwmare starting\n");
 
-    idrom_init();
-    led_init();
+    if (hm2_fw_init() < 0) {
+        // Don't start the Modules (core 1) on a broken setup.
+        printf("Hostmot2 firmware failed to initialize, stopping\n");
+        while (true) {
+            tight_loop_contents();
+        }
+    }
 
     printf("Hostmot2 firmware initialized!\n");
 
@@ -105,11 +150,12 @@ int main() {
 
     // Main loop
     while (true) {
+        static uint8_t const garbage_tx = 0x5a;
         uint8_t cmd_frame[4];
 
         // Read a command frame from the control computer (while writing
         // some garbage that will be ignored).
-        spi_read_blocking(spi_default, 0x5A, cmd_frame, 4);
+        spi_transfer(&garbage_tx, false, cmd_frame, 4);
         // printbuf(cmd_frame, 4);
 
         uint16_t addr = ((uint16_t)cmd_frame[0] << 8) | (cmd_frame[1]);
@@ -121,8 +167,10 @@ int main() {
         if (cmd == HM2_SPI_CMD_READ) {
             for (size_t i = 0; i < size; ++i) {
                 // printf("read 4 bytes from 0x%04x\n", addr);
+                uint32_t val;
                 uint8_t garbage[4];
-                spi_write_read_blocking(spi_default, &hm2_register_file[addr], (uint8_t*)&garbage, 4);
+                hm2_fw_read(addr, &val, 1);
+                spi_transfer((uint8_t*)&val, true, (uint8_t*)&garbage, 4);
                 if (addr_auto_increment) {
                     addr += 4;
                 }
@@ -131,7 +179,9 @@ int main() {
 
         if (cmd == HM2_SPI_CMD_WRITE) {
             for (size_t i = 0; i < size; ++i) {
-                spi_read_blocking(spi_default, 0x5a, (uint8_t*)&hm2_register_file32[addr/4], 4);
+                uint32_t val;
+                spi_transfer(&garbage_tx, false, (uint8_t*)&val, 4);
+                hm2_fw_write(addr, &val, 1);
                 if (addr_auto_increment) {
                     addr += 4;
                 }
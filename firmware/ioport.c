@@ -56,64 +56,154 @@
 //     not inverted.
 
 
-static uint32_t * reg;
+//
+// hm2 I/O pin N is GPIO N, which is bit N % 24 of port (instance) N / 24,
+// so GPIOs 0-23 are in the first port's registers and GPIOs 24-29 are in
+// bits 0-5 of the second port's.
+//
+// The registers are kept as the host wrote them, for reading back, and
+// every write also folds them into bitmaps of GPIOs (bit N = GPIO N), so
+// that writing the outputs (what the host does every servo period) is
+// one masked write of the SIO output register, plus one of the SIO
+// output enables if any pins are open drain.  Only writes to DDR,
+// AltSource, OpenDrain, and OutputInvert touch the GPIOs one at a time,
+// and then only the ones whose function changes.
+//
+// The RP2040 has no open drain outputs, so an open drain pin on the
+// ioport is driven low for a 0 and made an input for a 1, for an
+// external pull-up to pull high.  OpenDrain does nothing on a pin given to its alternate
+// source: the Module drives the pin.
+//
+// OutputInvert inverts the output register bits in software, and the
+// Module's output with the GPIO's output override for a pin given to
+// its alternate source.
+//
 
 
 //
 // A "1" bit indicates the corresponding GPIO line is available, "0"
 // indicates it's not.
 //
-// The RP2040 has 29 GPIO lines.  On the W5500-EVB-Pico, GPIOs 0-15,
+// The RP2040 has 30 GPIO lines.  On the W5500-EVB-Pico, GPIOs 0-15,
 // 22, and 26-28 are available for GPIO.
 //
-// The bitmaps are:
-// GPIO 00-23: 0000 0000  0100 0000  1111 1111  1111 1111
-// GPIO 24-29: 0000 0000  0000 0000  0000 0000  0001 1100
-//
 
-static uint32_t lines_available[2] = { 0x0040ffff, 0x0000001c };
+static uint32_t const lines_available = 0x1c40ffff;
 
+#define PORT_MASK ((1u << HM2_IOPORT_PORT_WIDTH) - 1)
 
-//
-// Data direction register.
-//
-// A "1" bit indicates the corresponding GPIO line is an output, "0"
-// indicates it's an input.
-//
+extern uint8_t const hm2_ioport_instances;
 
-static uint32_t ddr[2] = { 0, 0 };
 
-// Output value register.
-static uint32_t output_val[2] = { 0, 0 };
+// The registers, one word per port, as the host wrote them.
+static uint32_t output_val[HM2_IOPORT_MAX_PORTS];
+static uint32_t ddr[HM2_IOPORT_MAX_PORTS];
+static uint32_t alt_source[HM2_IOPORT_MAX_PORTS];
+static uint32_t open_drain[HM2_IOPORT_MAX_PORTS];
+static uint32_t output_invert[HM2_IOPORT_MAX_PORTS];
 
+#define IOPORT_NUM_REGS   5
+#define IOPORT_REG_OUTPUT 0
 
-// Set GPIO directions based on ddr.
-static void update_ddr(void) {
-    for (size_t i = 0; i < 29; ++i) {
-        int instance = i / 24;
-        int num_in_instance = i % 24;
+// Indexed by register, (addr >> 8).
+static uint32_t * const ioport_reg[IOPORT_NUM_REGS] = {
+    output_val,
+    ddr,
+    alt_source,
+    open_drain,
+    output_invert,
+};
 
-        if (lines_available[instance] & (1 << num_in_instance)) {
-            if (ddr[instance] & (1 << num_in_instance)) {
-                gpio_set_dir(i, GPIO_OUT);
-            } else {
-                gpio_set_dir(i, GPIO_IN);
-            }
-        }
+// The registers as GPIO bitmaps, only ever of available GPIOs.
+//
+// `out_val` is the output register with OutputInvert already applied,
+// and `invert_pins` are the bits of OutputInvert it applies to (the
+// ones not given to their alternate source).  `push_pull_pins` are the
+// ioport's outputs, `open_drain_pins` are its open drain outputs,
+// `alt_pins` are the GPIOs given to their alternate source, and
+// `outover_pins` are the ones of those whose output is inverted by the
+// GPIO's output override.
+static uint32_t out_val;
+static uint32_t invert_pins;
+static uint32_t push_pull_pins;
+static uint32_t open_drain_pins;
+static uint32_t alt_pins;
+static uint32_t outover_pins;
+
+// The GPIO inputs, as of DPLL timer 1.  The host reads these instead of
+// the live inputs while the DPLL is locked, so they're sampled at the
+// same point in every servo period no matter when the read packet
+// arrives.
+static uint32_t volatile sampled_inputs;
+
+
+// Fold one register's ports into a GPIO bitmap.
+static uint32_t gpio_bits(uint32_t const reg[]) {
+    uint32_t bits = 0;
+    for (int port = 0; port < HM2_IOPORT_MAX_PORTS; ++port) {
+        bits |= (reg[port] & PORT_MASK) << (port * HM2_IOPORT_PORT_WIDTH);
     }
+    return bits & lines_available;
 }
 
 
 static void update_outputs(void) {
-    uint32_t mask;
-    uint32_t val;
+    gpio_put_masked(push_pull_pins, out_val);
+    if (open_drain_pins != 0) {
+        // Driven low for a 0, floating for a 1.
+        gpio_set_dir_masked(open_drain_pins, ~out_val);
+    }
+}
+
 
-    mask = lines_available[0] | (lines_available[1] << 24);
-    mask &= ddr[0] | (ddr[1] << 24);
+// Recompute the bitmaps from the registers, and set up the GPIOs whose
+// function, direction, or output override changed.
+static void update_config(void) {
+    uint32_t alt = 0;
+    uint32_t requested = gpio_bits(alt_source);
+    while (requested != 0) {
+        int pin = __builtin_ctz(requested);
+        requested &= requested - 1;
+        if (hm2_pin_alt_function[pin] != GPIO_FUNC_NULL) {
+            alt |= 1u << pin;
+        }
+    }
 
-    val = output_val[0] | (output_val[1] << 24);
+    uint32_t invert = gpio_bits(output_invert);
+    uint32_t outover = alt & invert;
 
-    gpio_put_masked(mask, val);
+    // Give each GPIO that changed hands either to SIO (the ioport) or to
+    // its alternate source.
+    uint32_t changed = alt ^ alt_pins;
+    while (changed != 0) {
+        int pin = __builtin_ctz(changed);
+        changed &= changed - 1;
+        gpio_set_function(pin, (alt & (1u << pin)) ? hm2_pin_alt_function[pin] : GPIO_FUNC_SIO);
+    }
+
+    changed = outover ^ outover_pins;
+    while (changed != 0) {
+        int pin = __builtin_ctz(changed);
+        changed &= changed - 1;
+        gpio_set_outover(pin, (outover & (1u << pin)) ? GPIO_OVERRIDE_INVERT : GPIO_OVERRIDE_NORMAL);
+    }
+
+    uint32_t sio = lines_available & ~alt;
+    uint32_t od = gpio_bits(open_drain) & sio;
+    uint32_t pp = gpio_bits(ddr) & sio & ~od;
+
+    alt_pins = alt;
+    outover_pins = outover;
+    open_drain_pins = od;
+    push_pull_pins = pp;
+    invert_pins = invert & sio;
+    out_val = gpio_bits(output_val) ^ invert_pins;
+
+    // Open drain pins only ever drive a 0, their direction is their
+    // output.
+    gpio_put_masked(od, 0);
+    gpio_set_dir_masked(sio & ~od, pp);
+    update_outputs();
 }
 
 
@@ -121,75 +211,111 @@ static int ioport_write(uint16_t addr, uint32_t const * buf, size_t num_uint32)
     // printf("%s: addr=0x%04x, num_uint32=%u\n", __FUNCTION__, addr, num_uint32);
     // log_uint32(buf, num_uint32);
 
-    if (addr < 0x0100) {
-        // Write the GPIO outputs.
-        if (addr >= 2) {
-            return -1;
-        }
-        for (size_t i = 0; i < num_uint32; ++i) {
-            output_val[addr + i] = buf[i];
-        }
-        update_outputs();
+    bool config = false;
+    bool outputs = false;
+
+    for (size_t i = 0; i < num_uint32; ++i) {
+        unsigned int reg = addr >> 8;
+        unsigned int port = (addr & 0xff) / 4;
+        addr += 4;
 
-    } else if (addr < 0x0200) {
-        // Write the DDR (data direction) register.
-        uint16_t ddr_addr = addr - 0x0100;
-        if (ddr_addr >= 2) {
-            return -1;
+        if ((reg >= IOPORT_NUM_REGS) || (port >= hm2_ioport_instances)) {
+            continue;
         }
-        for (size_t i = 0; i < num_uint32; ++i) {
-            ddr[ddr_addr + i] = buf[i];
+        ioport_reg[reg][port] = buf[i];
+        if (reg == IOPORT_REG_OUTPUT) {
+            outputs = true;
+        } else {
+            config = true;
         }
-        update_ddr();
-        return 0;
     }
 
-    return -1;
+    if (config) {
+        update_config();
+    } else if (outputs) {
+        out_val = gpio_bits(output_val) ^ invert_pins;
+        update_outputs();
+    }
+
+    return 0;
 }
 
 
 static int ioport_read(uint16_t addr, uint32_t * buf, size_t num_uint32) {
-    if (addr < 0x0100) {
-        // Read GPIO inputs.
-        uint32_t in_values = gpio_get_all();
-        uint32_t p[2];
-        p[0] = in_values & lines_available[0];
-        p[1] = (in_values >> 24) & lines_available[1];
-        for (size_t i = 0; i < num_uint32; ++i) {
-            buf[i] = p[i];
+    uint32_t in_values = 0;
+    if ((addr >> 8) == IOPORT_REG_OUTPUT) {
+        // Reads of the output register read the GPIO inputs.
+        in_values = hm2_dpll_locked() ? sampled_inputs : gpio_get_all();
+        in_values &= lines_available;
+    }
+
+    for (size_t i = 0; i < num_uint32; ++i) {
+        unsigned int reg = addr >> 8;
+        unsigned int port = (addr & 0xff) / 4;
+        addr += 4;
+
+        if ((reg >= IOPORT_NUM_REGS) || (port >= hm2_ioport_instances)) {
+            buf[i] = 0;
+        } else if (reg == IOPORT_REG_OUTPUT) {
+            buf[i] = (in_values >> (port * HM2_IOPORT_PORT_WIDTH)) & PORT_MASK;
+        } else {
+            buf[i] = ioport_reg[reg][port];
         }
-        return 0;
+    }
 
-    } else if (addr < 0x0200) {
-        // Read the DDR (data direction) register.
-        for (size_t i = 0; i < num_uint32; ++i) {
-            buf[i] = ddr[i];
+    return 0;
+}
+
+
+// The watchdog bit: make every pin a plain input, which also takes the
+// pins away from the Modules using them.
+static void ioport_safe(void) {
+    for (size_t reg = 0; reg < IOPORT_NUM_REGS; ++reg) {
+        for (int port = 0; port < HM2_IOPORT_MAX_PORTS; ++port) {
+            ioport_reg[reg][port] = 0;
         }
-        return 0;
     }
+    update_config();
+}
 
-    return -1;
+
+static void ioport_sample(void) {
+    sampled_inputs = gpio_get_all();
 }
 
 
-int ioport_init(void) {
-    for (size_t i = 0; i < 29; ++i) {
-        int instance = i / 24;
-        int num_in_instance = i % 24;
+static int ioport_init(void) {
+    if (hm2_ioport_instances > HM2_IOPORT_MAX_PORTS) {
+        printf("ioport: %d instances requested, max is %d\n", hm2_ioport_instances, HM2_IOPORT_MAX_PORTS);
+        return -1;
+    }
 
-        if (lines_available[instance] & (1 << num_in_instance)) {
+    for (int i = 0; i < HM2_NUM_GPIOS; ++i) {
+        if (lines_available & (1u << i)) {
             printf("initializing GPIO%d for input, pulled down\n", i);
             gpio_init(i);
             gpio_set_function(i, GPIO_FUNC_SIO);
+            gpio_set_outover(i, GPIO_OVERRIDE_NORMAL);
             gpio_pull_down(i);
         }
     }
 
-    update_ddr();
+    alt_pins = 0;
+    outover_pins = 0;
+    ioport_safe();
 
-    reg = (uint32_t *)hm2_fw_register("ioport", 0x1000, 0x500, NULL, ioport_write, ioport_read);
-    if (reg == NULL) {
-        return -1;
-    }
     return 0;
 }
+
+
+hm2_region_t const hm2_ioport_region = {
+    .name = "ioport",
+    .addr = HM2_IOPORT_ADDR,
+    .size = HM2_IOPORT_SIZE,
+    .init = ioport_init,
+    .sample = ioport_sample,
+    .safe = ioport_safe,
+    .dpll_timer = 1,
+    .write = ioport_write,
+    .read = ioport_read,
+};
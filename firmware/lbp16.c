@@ -0,0 +1,873 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+
+#include "hm2-fw.h"
+#include "flash-update.h"
+#include "lbp16.h"
+
+
+// LBP16 packets, and the memory spaces behind them, see lbp16.h.
+
+
+#define DEBUG_COMM 0
+
+
+//
+// MEMSIZES arguments:
+//
+//     writable:
+//         0: read-only
+//         1: writable
+//
+//     type:
+//         01: register
+//         02: memory
+//         0E: EEPROM
+//         0F: flash
+//
+//     access (bitmap):
+//         1: 8 bit
+//         2: 16 bit
+//         4: 32 bit
+//         8: 64 bit
+//
+
+#define MEMSIZES(writable, type, access) \
+    ( \
+        (writable << 15) \
+        | (type << 8) \
+        | (access) \
+    )
+
+
+//
+// MEMRANGES arguments:
+//
+//     erase_block_size: Erase block size is 2^E.  Used for flash only,
+//         should be 0 for non-flash memory spaces.
+//
+//     page_size: Page size is 2^P.  Used for flash only, should be 0
+//         for non-flash memory spaces.
+//
+//     ps_address_range: Ps Address Range is 2^S.
+//
+
+#define MEMRANGES(erase_block_size, page_size, ps_address_range) \
+    ( \
+        (erase_block_size << 11) \
+        | (page_size << 6) \
+        | (ps_address_range) \
+    )
+
+
+hm2_eth_info_area_t eth_info_area[8] = {
+
+    {
+        .cookie = 0x5a00,
+        .memsizes = MEMSIZES(1, 1, 4),
+        .memranges = MEMRANGES(0, 0, 16),
+        .address_pointer = 0x0000,
+        .spacename = "HostMot2"
+    },
+
+    {
+        .cookie = 0x5a01,
+        .memsizes = MEMSIZES(1, 1, 2),
+        .memranges = MEMRANGES(0, 0, 8),
+        .address_pointer = 0x0000,
+        .spacename = "W5500"
+    },
+
+    {
+        .cookie = 0x5a02,
+        .memsizes = MEMSIZES(1, 0x0e, 2),
+        .memranges = MEMRANGES(0, 0, 7),
+        .address_pointer = 0x0000,
+        .spacename = "EtherEEP"
+    },
+
+    {
+        .cookie = 0x5a03,
+        .memsizes = MEMSIZES(1, 0x0f, 4),
+        .memranges = MEMRANGES(16, 8, 24),
+        .address_pointer = 0x0000,
+        .spacename = "Flash"
+    },
+
+    {
+        .cookie = 0x5a04,
+        .memsizes = MEMSIZES(1, 2, 2),
+        .memranges = MEMRANGES(0, 0, 4),
+        .address_pointer = 0x0000,
+        .spacename = "Timers"
+    },
+
+    // There is no memory space 5.
+    {
+        .cookie = 0x0000,
+        .memsizes = MEMSIZES(1, 1, 7),
+        .memranges = MEMRANGES(0, 0, 0),
+        .address_pointer = 0x0000,
+        .spacename = "unused"
+    },
+
+    {
+        .cookie = 0x5a06,
+        .memsizes = MEMSIZES(1, 2, 2),
+        .memranges = MEMRANGES(0, 0, 4),
+        .address_pointer = 0x0000,
+        .spacename = "LBP16RW"
+    },
+
+    {
+        .cookie = 0x5a07,
+        .memsizes = MEMSIZES(0, 2, 2),
+        .memranges = MEMRANGES(0, 0, 4),
+        .address_pointer = 0x0000,
+        .spacename = "LBP16RO"
+    },
+
+};
+
+
+// SPACE 4 LBP TIMER/UTILITY AREA
+//
+// Address space 4 is for read/write access to LBP specific timing registers. All
+// memory space 4 access is 16 bit.
+//
+// MEMORY SPACE 4 LAYOUT:
+// ADDRESS DATA
+// 0000 uSTimeStampReg
+// 0002 WaituSReg
+// 0004 HM2Timeout
+// 0006 WaitForHM2RefTime
+// 0008 WaitForHM2Timer1
+// 000A WaitForHM2Timer2
+// 000C WaitForHM2Timer3
+// 000E WaitForHM2Timer4
+// 0010..001E Scratch registers for any use
+//
+// The uSTimeStamp register reads the free running hardware microsecond
+// timer. It is useful for timing internal 7I80 operations. Writes to
+// the uSTimeStamp register are a no- op.
+//
+// The WaituS register delays processing for the specified number of
+// microseconds when written, (0 to 65535 uS) reads return the last wait
+// time written.
+//
+// The HM2TimeOut register sets the timeout value for all WaitForHM2 times
+// (0 to 65536 uS).
+//
+// All the WaitForHM2Timer registers wait for the rising edge of the
+// specified timer or reference output when read or written, write data
+// is don’t care, and reads return the wait time in uS.
+//
+// The HM2TimeOut register places an upper bound on how long the
+// WaitForHM2 operations will wait. HM2Timeouts set the HM2TImeout error
+// bit in the error register.
+//
+// Here the microsecond timer is the RP2040's, and the reference and
+// timers are the ones the DPLL predicts (see hm2_dpll_next_us()).
+// While the DPLL isn't tracking the host there are no edges, so every
+// WaitForHM2 times out.  Waits hold up the rest of the packet, which is
+// the point.
+//
+// Packets are handled in core 0's GPIO interrupt, and core 0 only shows
+// watchdog.c that it's alive from its main loop, between packets.  So
+// all the waits in one packet together stop at LBP16_MAX_WAIT_US after
+// the packet started, well short of the 100 ms that watchdog.c takes for
+// a stalled core, and a wait cut short sets the HM2Timeout error bit
+// too.
+
+#define MS4_US_TIMESTAMP          0
+#define MS4_WAIT_US               1
+#define MS4_HM2_TIMEOUT           2
+#define MS4_WAIT_FOR_HM2_REF_TIME 3
+#define MS4_WAIT_FOR_HM2_TIMER_4  7
+
+#define LBP16_MAX_WAIT_US (50 * 1000)
+
+// When the waits in this packet have to be over.
+static uint64_t wait_deadline;
+
+uint16_t memory_space_4[16] = {
+    // addr 0x0000
+    0x0000,
+    0x0000,
+    1000,   // HM2Timeout, one 1 kHz servo period
+};
+
+
+uint16_t memory_space_6[16] = {
+    // addr 0x0000
+    0x0000,
+    0x0000,
+    0x0000,
+    0x0000,
+    0x0000,
+    0x0000,
+    0x0000,
+    0x0000,
+
+    // addr 0x0010
+    0x0000,
+    0x0000,
+    0x0000,
+    0x0000,
+    0x0000,
+    0x0000,
+    0x0000,
+    0x0000
+};
+
+
+// One LBP16 command moves at most 127 64-bit transfers.
+#define LBP16_MAX_CMD_BYTES (127 * 8)
+
+// For the rare command whose data isn't word-aligned in the packet
+// (because an earlier command in the packet moved an odd number of
+// 16-bit words).
+static uint32_t bounce[LBP16_MAX_CMD_BYTES / 4];
+
+
+static inline bool is_word_aligned(void const * p) {
+    return ((uintptr_t)p & 0x3) == 0;
+}
+
+
+// LBP16 commands and addresses are little-endian, and may not be
+// 16-bit aligned in the packet.
+static inline uint16_t get_uint16(uint8_t const * p) {
+    return p[0] | (p[1] << 8);
+}
+
+
+// The local memory behind an LBP16 memory space other than 0, and its
+// size.  Returns NULL for memory spaces that don't have any.
+static uint8_t * memory_space(lbp16_cmd_t const * const cmd, size_t * size) {
+    if (cmd->info_area) {
+        if (cmd->memory_space == 5) {
+            // There is no memory space 5.
+            return NULL;
+        }
+        *size = sizeof(eth_info_area[0]);
+        return (uint8_t *)&eth_info_area[cmd->memory_space];
+    }
+
+    switch (cmd->memory_space) {
+        case 2:
+            *size = sizeof(memory_space_2);
+            return memory_space_2;
+        case 4:
+            *size = sizeof(memory_space_4);
+            return (uint8_t *)memory_space_4;
+        case 6:
+            *size = sizeof(memory_space_6);
+            return (uint8_t *)memory_space_6;
+        case 7:
+            *size = sizeof(memory_space_7);
+            return (uint8_t *)&memory_space_7;
+        default:
+            return NULL;
+    }
+}
+
+
+// Wait until `until`, or the end of the packet's wait time if that's
+// sooner.  Returns how long it waited, in us.
+static uint16_t wait_until(uint64_t start, uint64_t until) {
+    if (until > wait_deadline) {
+        until = MAX(start, wait_deadline);
+        memory_space_6[MS6_ERROR] |= MS6_ERROR_HM2_TIMEOUT;
+    }
+    busy_wait_until(from_us_since_boot(until));
+    return until - start;
+}
+
+
+// Wait for the next edge of the DPLL reference (`timer` 0) or of DPLL
+// timer `timer` (1-4), for at most HM2Timeout us.  Returns how long it
+// waited, in us.
+static uint16_t wait_for_hm2(int timer) {
+    uint64_t start = time_us_64();
+    uint64_t until = hm2_dpll_next_us(timer, start);
+    uint64_t timeout = start + memory_space_4[MS4_HM2_TIMEOUT];
+    if (until > timeout) {
+        until = timeout;
+        memory_space_6[MS6_ERROR] |= MS6_ERROR_HM2_TIMEOUT;
+    }
+    return wait_until(start, until);
+}
+
+
+// Memory space 4 registers do things when they're accessed, so they go
+// one at a time.  The caller has checked that it's a 16-bit access
+// inside the memory space.
+static int memory_space_4_access(
+    lbp16_cmd_t const * const cmd,
+    uint16_t addr,
+    uint8_t const * const data,
+    uint8_t * reply
+) {
+    for (int i = 0; i < cmd->transfer_count; ++i) {
+        uint reg = (addr / 2) + (cmd->addr_increment ? i : 0);
+        uint16_t value = 0;
+        if (cmd->write) {
+            value = get_uint16(&data[i * 2]);
+        }
+
+        if (reg == MS4_US_TIMESTAMP) {
+            value = time_us_32();
+        } else if ((reg >= MS4_WAIT_FOR_HM2_REF_TIME) && (reg <= MS4_WAIT_FOR_HM2_TIMER_4)) {
+            value = wait_for_hm2(reg - MS4_WAIT_FOR_HM2_REF_TIME);
+        } else if (cmd->write) {
+            // WaituS, HM2Timeout, and the scratch registers.
+            memory_space_4[reg] = value;
+            if (reg == MS4_WAIT_US) {
+                uint64_t start = time_us_64();
+                wait_until(start, start + value);
+            }
+        } else {
+            value = memory_space_4[reg];
+        }
+
+        if (!cmd->write) {
+            reply[i * 2] = value & 0xff;
+            reply[(i * 2) + 1] = value >> 8;
+        }
+    }
+
+    if (cmd->write) {
+        return 0;
+    }
+    return cmd->num_bytes;
+}
+
+
+// Memory space 3 is the flash (see flash-update.h): 32-bit registers
+// that do things when they're accessed, so they go one at a time.
+static int memory_space_3_access(
+    lbp16_cmd_t const * const cmd,
+    uint16_t addr,
+    uint8_t const * const data,
+    uint8_t * reply
+) {
+    int r = (cmd->transfer_bytes == 4) ? 0 : -1;
+
+    for (int i = 0; (r == 0) && (i < cmd->transfer_count); ++i) {
+        uint16_t reg = addr + (cmd->addr_increment ? (i * 4) : 0);
+        uint32_t value = 0;
+        if (cmd->write) {
+            memcpy(&value, &data[i * 4], sizeof(value));
+            r = flash_update_write(reg, value);
+        } else {
+            r = flash_update_read(reg, &value);
+            memcpy(&reply[i * 4], &value, sizeof(value));
+        }
+    }
+
+    if (r < 0) {
+        printf("can't %s memory space 3, addr=0x%04x\n", cmd->write ? "write to" : "read from", addr);
+        lbp16_log_cmd(cmd);
+        if (cmd->write) {
+            ++memory_space_6[MS6_LBP_WRITE_ERRORS];
+        } else {
+            ++memory_space_6[MS6_LBP_MEM_ERRORS];
+            memset(reply, 0, cmd->num_bytes);
+        }
+    }
+
+    return cmd->write ? 0 : cmd->num_bytes;
+}
+
+
+// Memory spaces other than 0, and the info areas.  Accesses outside the
+// memory space, or that it doesn't allow, are errors: writes are
+// dropped, and reads read zeros so the rest of the reply is still where
+// the host expects it.
+//
+// The only writable part of an info area is its address pointer.
+static int handle_memory_space_access(
+    lbp16_cmd_t const * const cmd,
+    uint16_t addr,
+    uint8_t const * const data,
+    uint8_t * reply
+) {
+    if (!cmd->info_area && (cmd->memory_space == 3)) {
+        return memory_space_3_access(cmd, addr, data, reply);
+    }
+
+    size_t size = 0;
+    uint8_t * mem = memory_space(cmd, &size);
+
+    bool ok = (mem != NULL) && ((addr + cmd->num_bytes) <= size);
+    if (cmd->info_area) {
+        // The info areas are all 16-bit.
+        ok = ok && (cmd->transfer_bytes == 2);
+        if (cmd->write) {
+            ok = ok
+                && (addr == offsetof(hm2_eth_info_area_t, address_pointer))
+                && (cmd->num_bytes == 2);
+        }
+    } else if (cmd->write) {
+        ok = ok && ((cmd->memory_space == 4) || (cmd->memory_space == 6));
+    }
+    if (cmd->memory_space == 4) {
+        ok = ok && (cmd->transfer_bytes == 2);
+    }
+
+    if (!ok) {
+        printf("can't %s memory space %d, addr=0x%04x\n", cmd->write ? "write to" : "read from", cmd->memory_space, addr);
+        lbp16_log_cmd(cmd);
+        if (cmd->write) {
+            ++memory_space_6[MS6_LBP_WRITE_ERRORS];
+            return 0;
+        }
+        ++memory_space_6[MS6_LBP_MEM_ERRORS];
+        memset(reply, 0, cmd->num_bytes);
+        return cmd->num_bytes;
+    }
+
+    if (!cmd->info_area && (cmd->memory_space == 4)) {
+        return memory_space_4_access(cmd, addr, data, reply);
+    }
+
+    // Lucky us, the RP2040 is little-endian just like the LBP16 network
+    // protocol.
+    if (cmd->write) {
+        memcpy(&mem[addr], data, cmd->num_bytes);
+        return 0;
+    }
+    memcpy(reply, &mem[addr], cmd->num_bytes);
+    return cmd->num_bytes;
+}
+
+
+// Handle an LBP16 command.
+//
+// Write commands copy bytes from `data` (from the user) to the local
+// destination specified by `cmd`.  Returns 0.
+//
+// Read commands copy bytes from the local source specified by `cmd`
+// to `reply`, which the caller has made sure has room for them.
+// Returns the number of bytes written to `reply`.
+//
+// Commands without an address use the address pointer of their memory
+// space, which every command leaves just past the bytes it moved if
+// addr_increment is set, or at the address it used if not.  Info area
+// commands without an address start at the beginning of the info area,
+// and don't move any address pointer.
+//
+// hm2 register data goes straight between the packets and the
+// registers when it's word-aligned in the packet, which it is unless
+// an earlier command in the packet moved an odd number of 16-bit
+// words.
+
+static int handle_lbp16(
+    lbp16_cmd_t const * const cmd,
+    uint8_t const * data,
+    uint8_t * reply
+) {
+    uint16_t * addr_ptr = &eth_info_area[cmd->memory_space].address_pointer;
+
+    uint16_t addr = 0;
+    if (cmd->has_addr) {
+        addr = get_uint16(data);
+        data += 2;
+    } else if (!cmd->info_area) {
+        addr = *addr_ptr;
+    }
+
+    if (!cmd->info_area) {
+        *addr_ptr = addr + (cmd->addr_increment ? cmd->num_bytes : 0);
+    }
+
+#if DEBUG_COMM
+    lbp16_log_cmd(cmd);
+    printf("    addr: 0x%04x\n", addr);
+#endif
+
+    if (cmd->info_area || (cmd->memory_space != 0)) {
+        return handle_memory_space_access(cmd, addr, data, reply);
+    }
+
+    // The hm2 registers are 32-bit only.  Anything else would lose its
+    // odd bytes, and a short read would move the rest of the reply.
+    if (cmd->transfer_bytes != 4) {
+        printf("can't %s hm2 registers %d bits at a time, addr=0x%04x\n", cmd->write ? "write" : "read", cmd->transfer_bits, addr);
+        lbp16_log_cmd(cmd);
+        ++memory_space_6[MS6_LBP_MEM_ERRORS];
+        if (cmd->write) {
+            return 0;
+        }
+        memset(reply, 0, cmd->num_bytes);
+        return cmd->num_bytes;
+    }
+
+    size_t num_uint32 = cmd->num_bytes / 4;
+
+    if (cmd->write) {
+        uint32_t const * words = (uint32_t const *)data;
+        if (!is_word_aligned(data)) {
+            memcpy(bounce, data, num_uint32 * 4);
+            words = bounce;
+        }
+        if (cmd->addr_increment) {
+            hm2_fw_write(addr, words, num_uint32);
+        } else {
+            hm2_fw_write_fifo(addr, words, num_uint32);
+        }
+        return 0;
+    }
+
+    uint32_t * words = is_word_aligned(reply) ? (uint32_t *)reply : bounce;
+    if (cmd->addr_increment) {
+        hm2_fw_read(addr, words, num_uint32);
+    } else {
+        hm2_fw_read_fifo(addr, words, num_uint32);
+    }
+    if (words == bounce) {
+        memcpy(reply, bounce, num_uint32 * 4);
+    }
+    return num_uint32 * 4;
+}
+
+
+//
+// Cached LBP16 packet plans.
+//
+// LinuxCNC sends the same few packets every servo period: the same
+// commands at the same addresses, with only the written data changing.
+// The first time a packet layout shows up it's parsed and checked one
+// command at a time, and what it did is recorded as a plan: the hm2
+// register copies with their offsets in the packet and the reply, with
+// reads of adjacent registers into adjacent reply bytes merged into one
+// copy.  After that, a packet that has the same size and the same
+// commands and addresses at the same offsets just runs the plan.
+//
+// Commands that aren't word-aligned 32-bit hm2 register copies (memory
+// spaces, info areas, FIFO reads and writes, unaligned data) go in the
+// plan as the command itself, and run through handle_lbp16() again.
+//
+// A command without an address is only cached if an earlier command in
+// the same packet set the address pointer of its memory space, so that
+// its address is fixed by the packet layout.  Running a plan leaves the
+// address pointers where the packet left them.
+//
+
+#define LBP16_NUM_PLANS 4
+
+// Packets with more commands than this are never cached.
+#define LBP16_PLAN_MAX_CMDS 64
+
+enum lbp16_plan_op {
+    LBP16_PLAN_READ,
+    LBP16_PLAN_WRITE,
+    LBP16_PLAN_CMD,
+};
+
+// One command of the packet layout that the plan is for.
+typedef struct {
+    uint16_t offset;
+    uint16_t raw_cmd;
+    uint16_t addr;      // if the command has one
+} lbp16_plan_cmd_t;
+
+typedef struct {
+    uint8_t op;         // enum lbp16_plan_op
+    uint16_t addr;      // hm2 register address
+    uint16_t num_uint32;
+    uint16_t data;      // offset of the data in the packet, or of the
+                        // command itself for LBP16_PLAN_CMD
+    uint16_t reply;     // offset in the reply
+} lbp16_plan_step_t;
+
+typedef struct {
+    bool valid;
+    uint16_t size;
+    uint16_t reply_size;
+    uint16_t num_cmds;
+    uint16_t num_steps;
+    uint8_t addr_ptrs;          // bitmap of the memory spaces it uses
+    uint16_t addr_ptr[8];       // their address pointers afterwards
+    lbp16_plan_cmd_t cmd[LBP16_PLAN_MAX_CMDS];
+    lbp16_plan_step_t step[LBP16_PLAN_MAX_CMDS];
+} lbp16_plan_t;
+
+static lbp16_plan_t lbp16_plans[LBP16_NUM_PLANS];
+
+// New packet layouts are recorded here first.  A realtime packet's plan
+// is copied into lbp16_plans[] only if it turned out cacheable, so that
+// one-off packets don't push the servo thread's plans out, and the
+// management socket's plans are never cached.
+static lbp16_plan_t lbp16_uncached_plan;
+
+// The plan that the next new packet layout replaces.
+static uint lbp16_next_plan;
+
+
+static lbp16_plan_t * lbp16_find_plan(uint8_t const * packet, size_t size) {
+    for (uint i = 0; i < LBP16_NUM_PLANS; ++i) {
+        lbp16_plan_t const * plan = &lbp16_plans[i];
+        if (!plan->valid || (plan->size != size)) {
+            continue;
+        }
+        bool match = true;
+        for (uint c = 0; match && (c < plan->num_cmds); ++c) {
+            lbp16_plan_cmd_t const * cmd = &plan->cmd[c];
+            match = (get_uint16(&packet[cmd->offset]) == cmd->raw_cmd)
+                && (!(cmd->raw_cmd & 0x4000) || (get_uint16(&packet[cmd->offset + 2]) == cmd->addr));
+        }
+        if (match) {
+            return &lbp16_plans[i];
+        }
+    }
+    return NULL;
+}
+
+
+// Add a command to the plan being recorded, as the step `step`.
+// Returns false if the plan is full.
+static bool lbp16_plan_add(lbp16_plan_t * plan, lbp16_plan_cmd_t const * cmd, lbp16_plan_step_t const * step) {
+    if (plan->num_cmds == LBP16_PLAN_MAX_CMDS) {
+        return false;
+    }
+    plan->cmd[plan->num_cmds++] = *cmd;
+
+    if ((step->op == LBP16_PLAN_READ) && (plan->num_steps > 0)) {
+        lbp16_plan_step_t * prev = &plan->step[plan->num_steps - 1];
+        if ((prev->op == LBP16_PLAN_READ)
+            && ((prev->addr + (prev->num_uint32 * 4)) == step->addr)
+            && ((prev->reply + (prev->num_uint32 * 4)) == step->reply)
+        ) {
+            prev->num_uint32 += step->num_uint32;
+            return true;
+        }
+    }
+
+    plan->step[plan->num_steps++] = *step;
+    return true;
+}
+
+
+// Run a plan recorded by lbp16_parse_packet() for a packet with the
+// same layout.  Returns the size of the reply.
+static size_t lbp16_run_plan(lbp16_plan_t const * plan, uint8_t const * packet, uint8_t * reply) {
+    for (uint i = 0; i < plan->num_steps; ++i) {
+        lbp16_plan_step_t const * step = &plan->step[i];
+        switch (step->op) {
+            case LBP16_PLAN_READ:
+                hm2_fw_read(step->addr, (uint32_t *)&reply[step->reply], step->num_uint32);
+                break;
+            case LBP16_PLAN_WRITE:
+                hm2_fw_write(step->addr, (uint32_t const *)&packet[step->data], step->num_uint32);
+                break;
+            default: {
+                lbp16_cmd_t cmd;
+                lbp16_decode_cmd(get_uint16(&packet[step->data]), &cmd);
+                if (!cmd.has_addr && !cmd.info_area) {
+                    // Earlier steps don't move the address pointers.
+                    eth_info_area[cmd.memory_space].address_pointer = step->addr;
+                }
+                handle_lbp16(&cmd, &packet[step->data + 2], &reply[step->reply]);
+                break;
+            }
+        }
+    }
+
+    for (uint i = 0; i < 8; ++i) {
+        if (plan->addr_ptrs & (1 << i)) {
+            eth_info_area[i].address_pointer = plan->addr_ptr[i];
+        }
+    }
+
+    return plan->reply_size;
+}
+
+
+// Parse and run a packet one LBP16 command at a time, recording a plan
+// for it in `plan`.  Returns the size of the reply, or -1 if the packet
+// is bad or its reply doesn't fit.  `plan` is left valid only if the
+// whole packet was good and fit in a plan.
+static int lbp16_parse_packet(uint8_t const * packet, size_t size, uint8_t * reply, lbp16_plan_t * plan) {
+    uint8_t const * const start = packet;
+    size_t reply_size = 0;
+
+    plan->valid = false;
+    plan->size = size;
+    plan->num_cmds = 0;
+    plan->num_steps = 0;
+    plan->addr_ptrs = 0;
+    bool cacheable = true;
+
+    while (size > 0) {
+        if (size < 2) {
+            printf("lbp16 command is cut short\n");
+            ++memory_space_6[MS6_LBP_PARSE_ERRORS];
+            ++memory_space_6[MS6_RX_BAD_COUNT];
+            return -1;
+        }
+        uint16_t raw_cmd = get_uint16(packet);
+
+        lbp16_cmd_t cmd;
+        lbp16_decode_cmd(raw_cmd, &cmd);
+
+        if (cmd.transfer_count < 1 || cmd.transfer_count > 127) {
+            printf("transfer count %d out of bounds\n", cmd.transfer_count);
+            ++memory_space_6[MS6_LBP_PARSE_ERRORS];
+            ++memory_space_6[MS6_RX_BAD_COUNT];
+            return -1;
+        }
+
+        int bytes_needed = 2;
+        if (cmd.has_addr) {
+            bytes_needed += 2;
+        }
+        if (cmd.write) {
+            bytes_needed += cmd.num_bytes;
+        }
+        if (size < bytes_needed) {
+            printf("lbp16 command doesn't have enough data");
+            ++memory_space_6[MS6_LBP_PARSE_ERRORS];
+            ++memory_space_6[MS6_RX_BAD_COUNT];
+            return -1;
+        }
+
+        // Drop the whole reply rather than send part of it.
+        if (!cmd.write && ((reply_size + cmd.num_bytes) > LBP16_MAX_PACKET)) {
+            printf("lbp16 reply is too big\n");
+            ++memory_space_6[MS6_TX_BAD_COUNT];
+            return -1;
+        }
+
+        uint16_t addr = 0;
+        if (cmd.has_addr) {
+            addr = get_uint16(packet + 2);
+        } else if (!cmd.info_area) {
+            addr = eth_info_area[cmd.memory_space].address_pointer;
+        }
+        uint8_t data_offset = cmd.has_addr ? 4 : 2;
+
+        // The address of a command without one only depends on the
+        // packet if an earlier command in it set the address pointer,
+        // and writes to the info areas can move address pointers.
+        if (cmd.info_area) {
+            cacheable = cacheable && !cmd.write;
+        } else {
+            cacheable = cacheable && (cmd.has_addr || (plan->addr_ptrs & (1 << cmd.memory_space)));
+        }
+
+        int r = handle_lbp16(&cmd, packet + 2, &reply[reply_size]);
+#if DEBUG_COMM
+        printf("that lbp16 cmd added %d bytes to the reply\n", r);
+#endif
+
+        if (cacheable) {
+            if (!cmd.info_area) {
+                plan->addr_ptrs |= 1 << cmd.memory_space;
+                plan->addr_ptr[cmd.memory_space] = eth_info_area[cmd.memory_space].address_pointer;
+            }
+            lbp16_plan_cmd_t plan_cmd = {
+                .offset = packet - start,
+                .raw_cmd = raw_cmd,
+                .addr = addr,
+            };
+            lbp16_plan_step_t step = {
+                .op = LBP16_PLAN_CMD,
+                .addr = plan_cmd.addr,
+                .num_uint32 = cmd.num_bytes / 4,
+                .data = plan_cmd.offset,
+                .reply = reply_size,
+            };
+            bool plain = !cmd.info_area && (cmd.memory_space == 0)
+                && (cmd.transfer_bytes == 4) && cmd.addr_increment;
+            if (plain && cmd.write && is_word_aligned(packet + data_offset)) {
+                step.op = LBP16_PLAN_WRITE;
+                step.data += data_offset;
+            } else if (plain && !cmd.write && is_word_aligned(&reply[reply_size])) {
+                step.op = LBP16_PLAN_READ;
+            }
+            cacheable = lbp16_plan_add(plan, &plan_cmd, &step);
+        }
+
+        reply_size += r;
+        packet += bytes_needed;
+        size -= bytes_needed;
+    }
+
+    plan->reply_size = reply_size;
+    plan->valid = cacheable;
+    return reply_size;
+}
+
+
+// True if `match` is true for any of the packet's commands.  Stops at
+// the first one that's cut short.
+static bool lbp16_any_cmd(uint8_t const * packet, size_t size, bool (*match)(lbp16_cmd_t const * cmd)) {
+    while (size >= 2) {
+        lbp16_cmd_t cmd;
+        lbp16_decode_cmd(get_uint16(packet), &cmd);
+        if (match(&cmd)) {
+            return true;
+        }
+
+        size_t bytes_needed = 2;
+        if (cmd.has_addr) {
+            bytes_needed += 2;
+        }
+        if (cmd.write) {
+            bytes_needed += cmd.num_bytes;
+        }
+        if (size < bytes_needed) {
+            break;
+        }
+        packet += bytes_needed;
+        size -= bytes_needed;
+    }
+    return false;
+}
+
+
+static bool lbp16_cmd_uses_flash(lbp16_cmd_t const * cmd) {
+    return !cmd->info_area && (cmd->memory_space == 3);
+}
+
+
+static bool lbp16_cmd_uses_hm2(lbp16_cmd_t const * cmd) {
+    return !cmd->info_area && (cmd->memory_space == 0);
+}
+
+
+bool lbp16_uses_flash(uint8_t const * packet, size_t size) {
+    return lbp16_any_cmd(packet, size, lbp16_cmd_uses_flash);
+}
+
+
+bool lbp16_is_management(uint8_t const * packet, size_t size) {
+    return !lbp16_any_cmd(packet, size, lbp16_cmd_uses_hm2);
+}
+
+
+int lbp16_handle_packet(uint8_t const * packet, size_t size, uint8_t * reply, bool cache) {
+#if DEBUG_COMM
+    hm2_fw_log_uint8(packet, size);
+#endif
+
+    wait_deadline = time_us_64() + LBP16_MAX_WAIT_US;
+
+    if (cache) {
+        lbp16_plan_t const * plan = lbp16_find_plan(packet, size);
+        if (plan != NULL) {
+            return lbp16_run_plan(plan, packet, reply);
+        }
+    }
+
+    int reply_size = lbp16_parse_packet(packet, size, reply, &lbp16_uncached_plan);
+    if (cache && lbp16_uncached_plan.valid) {
+        lbp16_plans[lbp16_next_plan] = lbp16_uncached_plan;
+        lbp16_next_plan = (lbp16_next_plan + 1) % LBP16_NUM_PLANS;
+    }
+    return reply_size;
+}
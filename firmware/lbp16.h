@@ -2,6 +2,37 @@
 #define LBP16_H
 
 
+/*
+
+LBP16, the protocol hm2_eth (and mesaflash) speak to a Mesa Ethernet
+card, over UDP.  This is everything about it that doesn't depend on the
+network chip: the commands, the memory spaces and their info areas, and
+the cached packet plans.
+
+The transport receives each UDP packet, hands it to
+lbp16_handle_packet(), and sends back the reply, if there is one:
+
+    static uint32_t reply[LBP16_MAX_PACKET / 4];
+
+    ++memory_space_6[MS6_RX_UDP_COUNT];
+    int size = lbp16_handle_packet(packet, packet_size, (uint8_t *)reply, realtime);
+    if (size > 0) {
+        // send `size` bytes of `reply`
+    }
+
+It keeps the packet counters in memory space 6 up to date, and defines
+the board's memory space 2 (the MAC address and card name, as Mesa's
+EEPROM has them) and memory space 7 (the board id, and the packet
+timestamps).
+
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
 typedef struct {
     uint16_t raw;
     bool write;
@@ -68,4 +99,123 @@ static void lbp16_log_cmd(lbp16_cmd_t const * const cmd) {
 }
 
 
+// The biggest UDP payload that fits in one Ethernet frame.  Received
+// packets and replies are both at most this big.
+#define LBP16_MAX_PACKET 1472
+
+
+typedef struct {
+    uint16_t cookie;
+    uint16_t memsizes;
+    uint16_t memranges;
+    uint16_t address_pointer;
+    uint8_t spacename[9];  // It's really only 8 bytes, but it's convenient to store the terminating NULL.
+} hm2_eth_info_area_t;
+
+extern hm2_eth_info_area_t eth_info_area[8];
+
+
+// Memory space 2, Mesa's Ethernet EEPROM, with the board's MAC address
+// and name.  The transport defines it.
+extern uint8_t memory_space_2[128];
+
+
+// The counters count UDP packets on the LBP16 port.  The W5500 answers
+// ARP and ping itself, so those aren't counted, and RXPacketCount only
+// differs from RXUDPCount by packets too big to handle.  RXBadCount
+// counts those and packets with bad LBP16 commands, TXBadCount replies
+// that didn't fit in a packet and sends that timed out.  LBPParseErrors
+// counts bad commands, LBPMemErrors and LBPWriteErrors bad accesses to
+// the memory spaces.
+
+#define MS6_ERROR             0
+#define MS6_ERROR_HM2_TIMEOUT   0x0001
+#define MS6_LBP_PARSE_ERRORS  1
+#define MS6_LBP_MEM_ERRORS    2
+#define MS6_LBP_WRITE_ERRORS  3
+#define MS6_RX_PKT_COUNT      4
+#define MS6_RX_UDP_COUNT      5
+#define MS6_RX_BAD_COUNT      6
+#define MS6_TX_PKT_COUNT      7
+#define MS6_TX_UDP_COUNT      8
+#define MS6_TX_BAD_COUNT      9
+#define MS6_LED_MODE         10
+#define MS6_DEBUG_LED_PTR    11
+#define MS6_SCRATCH          12
+#define MS6_EEPROM_WENA      14
+#define MS6_RESET            15
+
+// Writing this to the Reset register reboots the board, into the image
+// in the flash update slot if there is one (see flash-update.h).
+#define MS6_RESET_MAGIC      0x5a
+
+extern uint16_t memory_space_6[16];
+
+
+// Read-only const board id.  From the 7i93 manual v1.0:
+// MEMORY SPACE 7 LAYOUT:
+// ADDRESS DATA
+// 0000 CardNameChar-0,1
+// 0002 CardNameChar-2,3
+// 0004 CardNameChar-4,5
+// 0006 CardNameChar-6,7
+// 0008 CardNameChar-8,9
+// 000A CardNameChar-10,11
+// 000C CardNameChar-12.13
+// 000E CardNameChar-14,15
+// 0010 LBPVersion
+// 0012 FirmwareVersion
+// 0014 Option Jumpers
+// 0016 Reserved
+// 0018 RecvStartTS 1 uSec timestamps
+// 001A RecvDoneTS For performance monitoring
+// 001C SendStartTS Send timestamps are
+// 001E SendDoneTS from previous packet
+//
+// Only the CardName seems to be used.  Should be all uppercase.
+//
+// The timestamps are the low 16 bits of the RP2040's microsecond timer:
+// when the W5500 had a packet to read, when it had been read, when the
+// reply to it started to be sent, and when the W5500 finished sending
+// it.  A packet that reads them gets its own receive timestamps and the
+// previous reply's send timestamps.
+
+typedef struct {
+    char card_name[16];
+    uint16_t lbp_version;
+    uint16_t firmware_version;
+    uint16_t option_jumpers;
+    uint16_t reserved;
+    uint16_t recv_start_ts;
+    uint16_t recv_done_ts;
+    uint16_t send_start_ts;
+    uint16_t send_done_ts;
+} memory_space_7_t;
+
+_Static_assert(sizeof(memory_space_7_t) == 32, "memory space 7 is 32 bytes");
+
+extern memory_space_7_t memory_space_7;
+
+
+// Handle a UDP packet of one or more LBP16 commands, and build the
+// reply in `reply`, which has room for LBP16_MAX_PACKET bytes and is
+// word-aligned.  Returns the size of the reply, or -1 if the packet is
+// bad or its reply doesn't fit (and then there's no reply at all).
+//
+// If `cache` is set, the packet can run a cached plan, and its own plan
+// is cached for the packets after it (see lbp16.c).  That's for the
+// realtime socket, where the same packets come every servo period.
+int lbp16_handle_packet(uint8_t const * packet, size_t size, uint8_t * reply, bool cache);
+
+// True if any of the packet's commands access memory space 3 (the
+// flash).  A bad packet is left for lbp16_handle_packet() to report.
+bool lbp16_uses_flash(uint8_t const * packet, size_t size);
+
+// True if none of the packet's commands access the hm2 registers
+// (memory space 0, not counting its info area).  Those are the servo
+// thread's, the rest (the other memory spaces and the info areas) are
+// for tools like mesaflash and elbpcom.
+bool lbp16_is_management(uint8_t const * packet, size_t size);
+
+
 #endif // LBP16_H
@@ -6,7 +6,10 @@
 
 
 static uint const led_pin = PICO_DEFAULT_LED_PIN;
-static uint32_t const * reg;
+
+// The LED is for humans, it doesn't need to update very often.
+#define LED_UPDATE_PERIOD_US (10 * 1000)
+static uint32_t const * const reg = (uint32_t const *)&hm2_register_file[HM2_LED_ADDR];
 
 
 static void led_update(void) {
@@ -14,6 +17,12 @@ static void led_update(void) {
 }
 
 
+static void led_safe(void) {
+    hm2_register_file32[HM2_LED_ADDR / 4] = 0;
+    gpio_put(led_pin, 0);
+}
+
+
 static int led_write(uint16_t addr, uint32_t const * buf, size_t num_uint32) {
     return -1;
 }
@@ -48,14 +57,23 @@ void led_blink(uint8_t const num_blinks, uint16_t const ms_delay) {
 }
 
 
-int led_init(void) {
+static int led_init(void) {
     led_setup_once();
 
     led_blink(2, 100);
 
-    reg = (uint32_t const *)hm2_fw_register("led", 0x0200, 4, led_update, led_write, led_read);
-    if (reg == NULL) {
-        return -1;
-    }
     return 0;
 }
+
+
+hm2_region_t const hm2_led_region = {
+    .name = "led",
+    .addr = HM2_LED_ADDR,
+    .size = HM2_LED_SIZE,
+    .init = led_init,
+    .update = led_update,
+    .period_us = LED_UPDATE_PERIOD_US,
+    .safe = led_safe,
+    .write = led_write,
+    .read = led_read,
+};
@@ -0,0 +1,593 @@
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/gpio.h"
+#include "hardware/pio.h"
+#include "hardware/timer.h"
+
+#include "hm2-fw.h"
+#include "hm2-dma.h"
+#include "hm2-fifo.h"
+#include "pktuart.pio.h"
+
+
+// PktUART transmitter, one register per instance (stride 4):
+//
+// 0x6100  TX data (write only, FIFO)
+//
+//     Each write queues up to 4 bytes to send, LSB first.  Each frame's
+//     data starts in a new word.
+//
+// 0x6200  TX frame count (FIFO)
+//
+//     Writing N sends the next N bytes of data (1-1024) as one frame.
+//     Reads return the number of frames waiting to be sent.
+//
+// 0x6300  TX bit rate
+//
+//     The bit rate is ClockLow * rate / 2^20.  The receiver runs at this
+//     rate too, see below.
+//
+// 0x6400  TX mode
+//
+//     Bit 21:      The data FIFO isn't empty (read only)
+//     Bits 20:16:  Frames waiting to be sent (read only)
+//     Bits 15:8:   Inter-frame delay, in bit times
+//     Bit 7:       Sending (read only)
+//     Bit 4:       A FIFO overflowed (read only, cleared by writing
+//                  this register)
+//
+//
+// PktUART receiver:
+//
+// 0x6500  RX data (read only, FIFO)
+//
+//     Each read pops up to 4 bytes, LSB first.  Each frame's data starts
+//     in a new word.
+//
+// 0x6600  RX frame count (read only, FIFO)
+//
+//     Each read pops the next received frame's size and status:
+//
+//     Bit 15:      Always 0 (false start bits aren't detected)
+//     Bit 14:      A stop bit was missing
+//     Bits 9:0:    Number of bytes in the frame
+//
+//     Reads return 0 if no frame has been received.
+//
+// 0x6700  RX bit rate (ignored, see below)
+//
+// 0x6800  RX mode
+//
+//     Bit 21:      The data FIFO isn't empty (read only)
+//     Bits 20:16:  Frames received (read only)
+//     Bits 15:8:   Inter-frame delay, in bit times: a gap this long
+//                  ends a frame
+//     Bit 4:       A FIFO overflowed (read only)
+//     Bit 3:       Receive enable
+//     Bit 1:       A stop bit was missing (read only)
+//
+//     Writing this register clears the error bits.
+//
+//
+// Each instance is one PIO state machine that sends and receives 8N1
+// (see pktuart.pio), half duplex: it doesn't receive while it's
+// sending, like a PktUART with the RX mask enabled on an RS-485 bus.
+// Since it's one state machine, both directions run at the TX bit rate.
+//
+// The FIFO registers are queues between the cores (see hm2-fifo.h):
+// the host's reads and writes pop and push them on core 0, and every
+// update core 1 moves bytes between them and the state machine.  An
+// endless DMA stream (see hm2-dma.h) empties the state machine's RX
+// FIFO into a ring buffer, so no byte is lost however late core 1 is.  Received bytes are grouped
+// into frames by the update in which core 1 sees them, so the end of a
+// frame is only noticed to within one update period.
+
+
+#define PKTUART_UPDATE_PERIOD_US 100
+
+#define PKTUART_MAX_INSTANCES 2
+
+// A frame is at most 1024 bytes.
+#define PKTUART_MAX_FRAME_BYTES 1024
+#define PKTUART_DATA_WORDS      (PKTUART_MAX_FRAME_BYTES / 4)
+#define PKTUART_FRAMES          16
+
+#define PKTUART_RX_RING_WORDS 64
+#define PKTUART_RX_RING_BITS  8     // log2 of the ring size in bytes
+
+_Static_assert((PKTUART_RX_RING_WORDS * 4) == (1 << PKTUART_RX_RING_BITS), "pktuart ring size must be a power of 2");
+
+// PIO clocks per bit, see pktuart.pio.
+#define PKTUART_OVERSAMPLE 8
+
+#define PKTUART_TX_REG(reg, instance) (hm2_register_file32[((HM2_PKTUART_TX_ADDR + ((reg) * 0x100)) / 4) + (instance)])
+#define PKTUART_RX_REG(reg, instance) (hm2_register_file32[((HM2_PKTUART_RX_ADDR + ((reg) * 0x100)) / 4) + (instance)])
+
+// Registers, the same in both regions.
+#define PKTUART_DATA        0
+#define PKTUART_FRAME_COUNT 1
+#define PKTUART_BITRATE     2
+#define PKTUART_MODE        3
+
+#define PKTUART_MODE_CONFIG_MASK   0x0000ff0c
+#define PKTUART_MODE_HAS_DATA      (1 << 21)
+#define PKTUART_MODE_FRAMES_SHIFT  16
+#define PKTUART_MODE_TX_ACTIVE     (1 << 7)
+#define PKTUART_MODE_FIFO_ERROR    (1 << 4)
+#define PKTUART_MODE_RX_ENABLE     (1 << 3)
+#define PKTUART_MODE_OVERRUN       (1 << 1)
+
+#define PKTUART_FRAME_OVERRUN      (1 << 14)
+
+
+typedef struct {
+    PIO pio;
+    uint sm;
+    uint offset;
+    uint dma_chan;
+
+    uint32_t bitrate;
+    uint32_t bit_ns;
+
+    // The frame being sent, owned by core 1.
+    uint32_t tx_left;
+    uint32_t tx_word;
+    uint32_t tx_word_bytes;
+    uint64_t tx_next_frame_us;
+    bool volatile tx_active;
+
+    // Set by core 0 when the host overflows a TX FIFO.
+    bool volatile tx_fifo_error;
+
+    // The frame being received, owned by core 1.
+    uint32_t rx_events;
+    uint32_t rx_bytes;
+    uint32_t rx_word;
+    uint32_t rx_frame_errors;
+    uint64_t rx_last_byte_us;
+
+    // RX mode error bits, set by core 1.  Writing the RX mode register
+    // asks core 1 to clear them.
+    uint32_t volatile rx_errors;
+    uint32_t volatile rx_clear_seq;
+    uint32_t rx_cleared_seq;
+} pktuart_t;
+
+
+static pktuart_t pktuart[PKTUART_MAX_INSTANCES];
+
+static uint32_t pktuart_rx_ring[PKTUART_MAX_INSTANCES][PKTUART_RX_RING_WORDS] __attribute__((aligned(PKTUART_RX_RING_WORDS * 4)));
+
+static uint32_t tx_data_storage[PKTUART_MAX_INSTANCES][PKTUART_DATA_WORDS];
+static uint32_t tx_frames_storage[PKTUART_MAX_INSTANCES][PKTUART_FRAMES];
+static uint32_t rx_data_storage[PKTUART_MAX_INSTANCES][PKTUART_DATA_WORDS];
+static uint32_t rx_frames_storage[PKTUART_MAX_INSTANCES][PKTUART_FRAMES];
+
+// Pushed by core 0, popped by core 1.
+static hm2_fifo_t tx_data[PKTUART_MAX_INSTANCES];
+static hm2_fifo_t tx_frames[PKTUART_MAX_INSTANCES];
+
+// Pushed by core 1, popped by core 0.
+static hm2_fifo_t rx_data[PKTUART_MAX_INSTANCES];
+static hm2_fifo_t rx_frames[PKTUART_MAX_INSTANCES];
+
+extern uint8_t const hm2_pktuart_tx_instances;
+extern uint8_t const hm2_pktuart_rx_instances;
+
+
+static uint32_t pktuart_mode_status(hm2_fifo_t const * data, hm2_fifo_t const * frames) {
+    uint32_t num_frames = hm2_fifo_level(frames);
+    if (num_frames > 31) {
+        num_frames = 31;
+    }
+    return (num_frames << PKTUART_MODE_FRAMES_SHIFT) | ((hm2_fifo_level(data) > 0) ? PKTUART_MODE_HAS_DATA : 0);
+}
+
+
+// Time for `bits` bits, in us, rounded up.
+static uint64_t pktuart_bits_us(pktuart_t const * p, uint32_t bits) {
+    return (((uint64_t)bits * p->bit_ns) + 999) / 1000;
+}
+
+
+static void pktuart_set_bitrate(pktuart_t * p, uint32_t bitrate) {
+    p->bitrate = bitrate;
+
+    // The bit rate is ClockLow * rate / 2^20, and ClockLow is the
+    // system clock, so the divider is 2^20 / (8 * rate) whatever the
+    // clock is.  In 16.8 fixed point that's 2^25 / rate.
+    uint32_t div = (bitrate == 0) ? UINT32_MAX : ((1u << 25) / bitrate);
+    if (div < 0x100) {
+        div = 0x100;
+    } else if (div > 0xffffff) {
+        div = 0xffffff;
+    }
+    pio_sm_set_clkdiv_int_frac(p->pio, p->sm, div >> 8, div & 0xff);
+
+    p->bit_ns = ((uint64_t)div * PKTUART_OVERSAMPLE * 1000 * 1000 * 1000) / ((uint64_t)clock_get_hz(clk_sys) * 256);
+}
+
+
+static void pktuart_update_tx(pktuart_t * p, int instance, uint64_t now) {
+    uint32_t mode = PKTUART_TX_REG(PKTUART_MODE, instance);
+
+    if ((p->tx_left == 0) && pio_sm_is_tx_fifo_empty(p->pio, p->sm) && (now >= p->tx_next_frame_us)) {
+        uint32_t count;
+        if (hm2_fifo_pop(&tx_frames[instance], &count)) {
+            p->tx_left = count & 0x7ff;
+            if (p->tx_left > PKTUART_MAX_FRAME_BYTES) {
+                p->tx_left = PKTUART_MAX_FRAME_BYTES;
+            }
+            p->tx_word_bytes = 0;
+        }
+    }
+
+    if (p->tx_left > 0) {
+        while ((p->tx_left > 0) && !pio_sm_is_tx_fifo_full(p->pio, p->sm)) {
+            if (p->tx_word_bytes == 0) {
+                if (!hm2_fifo_pop(&tx_data[instance], &p->tx_word)) {
+                    // The host said to send more than it wrote.
+                    p->tx_left = 0;
+                    break;
+                }
+                p->tx_word_bytes = 4;
+            }
+            pio_sm_put(p->pio, p->sm, p->tx_word & 0xff);
+            p->tx_word >>= 8;
+            --p->tx_word_bytes;
+            --p->tx_left;
+        }
+
+        if (p->tx_left == 0) {
+            // The next frame waits for the bytes still in the state
+            // machine (10 bits each, plus the one it's sending) and
+            // the inter-frame delay.
+            uint32_t bits = ((pio_sm_get_tx_fifo_level(p->pio, p->sm) + 1) * 10) + ((mode >> 8) & 0xff);
+            p->tx_next_frame_us = now + pktuart_bits_us(p, bits);
+        }
+    }
+
+    p->tx_active = (p->tx_left > 0) || (now < p->tx_next_frame_us);
+}
+
+
+static void pktuart_end_rx_frame(pktuart_t * p, int instance) {
+    if ((p->rx_bytes % 4) != 0) {
+        if (!hm2_fifo_push(&rx_data[instance], p->rx_word)) {
+            p->rx_errors |= PKTUART_MODE_FIFO_ERROR;
+        }
+    }
+    if (!hm2_fifo_push(&rx_frames[instance], p->rx_frame_errors | p->rx_bytes)) {
+        p->rx_errors |= PKTUART_MODE_FIFO_ERROR;
+    }
+    p->rx_bytes = 0;
+    p->rx_word = 0;
+    p->rx_frame_errors = 0;
+}
+
+
+static void pktuart_update_rx(pktuart_t * p, int instance, uint64_t now) {
+    uint32_t * ring = pktuart_rx_ring[instance];
+    uint32_t mode = PKTUART_RX_REG(PKTUART_MODE, instance);
+
+    if (p->rx_clear_seq != p->rx_cleared_seq) {
+        p->rx_cleared_seq = p->rx_clear_seq;
+        p->rx_errors = 0;
+    }
+
+    uint32_t events = hm2_dma_stream_transfers(p->dma_chan);
+    uint32_t num_new = (events - p->rx_events) & HM2_DMA_STREAM_MASK;
+    if (num_new > PKTUART_RX_RING_WORDS) {
+        p->rx_errors |= PKTUART_MODE_FIFO_ERROR;
+        num_new = PKTUART_RX_RING_WORDS;
+    }
+    p->rx_events = events;
+
+    for (uint32_t i = num_new; i > 0; --i) {
+        uint32_t event = ring[(events - i) % PKTUART_RX_RING_WORDS];
+        if (!(mode & PKTUART_MODE_RX_ENABLE)) {
+            continue;
+        }
+
+        if (!(event & (1u << 31))) {
+            p->rx_frame_errors |= PKTUART_FRAME_OVERRUN;
+            p->rx_errors |= PKTUART_MODE_OVERRUN;
+        }
+
+        p->rx_word |= ((event >> 23) & 0xff) << (8 * (p->rx_bytes % 4));
+        ++p->rx_bytes;
+        if ((p->rx_bytes % 4) == 0) {
+            if (!hm2_fifo_push(&rx_data[instance], p->rx_word)) {
+                p->rx_errors |= PKTUART_MODE_FIFO_ERROR;
+            }
+            p->rx_word = 0;
+        }
+        p->rx_last_byte_us = now;
+
+        // The frame count only has room for 1023.
+        if (p->rx_bytes == (PKTUART_MAX_FRAME_BYTES - 1)) {
+            pktuart_end_rx_frame(p, instance);
+        }
+    }
+
+    if ((p->rx_bytes > 0) && ((now - p->rx_last_byte_us) >= pktuart_bits_us(p, (mode >> 8) & 0xff))) {
+        pktuart_end_rx_frame(p, instance);
+    }
+}
+
+
+static void pktuart_update(void) {
+    uint64_t now = time_us_64();
+
+    for (int i = 0; i < hm2_pktuart_tx_instances; ++i) {
+        pktuart_t * p = &pktuart[i];
+
+        uint32_t bitrate = PKTUART_TX_REG(PKTUART_BITRATE, i);
+        if (bitrate != p->bitrate) {
+            pktuart_set_bitrate(p, bitrate);
+        }
+
+        pktuart_update_tx(p, i, now);
+        pktuart_update_rx(p, i, now);
+    }
+}
+
+
+static int pktuart_tx_write(uint16_t addr, uint32_t const * buf, size_t num_uint32) {
+    for (size_t i = 0; i < num_uint32; ++i) {
+        uint16_t reg = (addr >> 8);
+        uint16_t instance = (addr & 0xff) / 4;
+
+        if (instance < hm2_pktuart_tx_instances) {
+            pktuart_t * p = &pktuart[instance];
+            switch (reg) {
+                case PKTUART_DATA:
+                    if (!hm2_fifo_push(&tx_data[instance], buf[i])) {
+                        p->tx_fifo_error = true;
+                    }
+                    break;
+
+                case PKTUART_FRAME_COUNT:
+                    if (!hm2_fifo_push(&tx_frames[instance], buf[i])) {
+                        p->tx_fifo_error = true;
+                    }
+                    break;
+
+                case PKTUART_MODE:
+                    p->tx_fifo_error = false;
+                    PKTUART_TX_REG(reg, instance) = buf[i] & PKTUART_MODE_CONFIG_MASK;
+                    break;
+
+                default:
+                    PKTUART_TX_REG(reg, instance) = buf[i];
+                    break;
+            }
+        }
+
+        addr += 4;
+    }
+    return 0;
+}
+
+
+static int pktuart_tx_read(uint16_t addr, uint32_t * buf, size_t num_uint32) {
+    for (size_t i = 0; i < num_uint32; ++i) {
+        uint16_t reg = (addr >> 8);
+        uint16_t instance = (addr & 0xff) / 4;
+
+        buf[i] = 0;
+        if (instance < hm2_pktuart_tx_instances) {
+            pktuart_t const * p = &pktuart[instance];
+            switch (reg) {
+                case PKTUART_DATA:
+                    break;
+
+                case PKTUART_FRAME_COUNT:
+                    buf[i] = hm2_fifo_level(&tx_frames[instance]);
+                    break;
+
+                case PKTUART_MODE:
+                    buf[i] = PKTUART_TX_REG(reg, instance)
+                        | pktuart_mode_status(&tx_data[instance], &tx_frames[instance])
+                        | (p->tx_active ? PKTUART_MODE_TX_ACTIVE : 0)
+                        | (p->tx_fifo_error ? PKTUART_MODE_FIFO_ERROR : 0);
+                    break;
+
+                default:
+                    buf[i] = PKTUART_TX_REG(reg, instance);
+                    break;
+            }
+        }
+
+        addr += 4;
+    }
+    return 0;
+}
+
+
+static int pktuart_rx_write(uint16_t addr, uint32_t const * buf, size_t num_uint32) {
+    for (size_t i = 0; i < num_uint32; ++i) {
+        uint16_t reg = (addr >> 8);
+        uint16_t instance = (addr & 0xff) / 4;
+
+        if (instance < hm2_pktuart_rx_instances) {
+            if (reg == PKTUART_MODE) {
+                PKTUART_RX_REG(reg, instance) = buf[i] & PKTUART_MODE_CONFIG_MASK;
+                ++pktuart[instance].rx_clear_seq;
+            } else if (reg == PKTUART_BITRATE) {
+                PKTUART_RX_REG(reg, instance) = buf[i];
+            }
+        }
+
+        addr += 4;
+    }
+    return 0;
+}
+
+
+static int pktuart_rx_read(uint16_t addr, uint32_t * buf, size_t num_uint32) {
+    for (size_t i = 0; i < num_uint32; ++i) {
+        uint16_t reg = (addr >> 8);
+        uint16_t instance = (addr & 0xff) / 4;
+
+        buf[i] = 0;
+        if (instance < hm2_pktuart_rx_instances) {
+            switch (reg) {
+                case PKTUART_DATA:
+                    hm2_fifo_pop(&rx_data[instance], &buf[i]);
+                    break;
+
+                case PKTUART_FRAME_COUNT:
+                    hm2_fifo_pop(&rx_frames[instance], &buf[i]);
+                    break;
+
+                case PKTUART_MODE:
+                    buf[i] = PKTUART_RX_REG(reg, instance)
+                        | pktuart_mode_status(&rx_data[instance], &rx_frames[instance])
+                        | pktuart[instance].rx_errors;
+                    break;
+
+                default:
+                    buf[i] = PKTUART_RX_REG(reg, instance);
+                    break;
+            }
+        }
+
+        addr += 4;
+    }
+    return 0;
+}
+
+
+// Put the program in whichever PIO has room for it and a free state
+// machine.
+static int pktuart_claim_pio(pktuart_t * p) {
+    PIO const pios[] = { pio0, pio1 };
+    static int offsets[] = { -1, -1 };
+
+    for (size_t i = 0; i < sizeof(pios) / sizeof(pios[0]); ++i) {
+        if ((offsets[i] < 0) && !pio_can_add_program(pios[i], &pktuart_program)) {
+            continue;
+        }
+
+        int sm = pio_claim_unused_sm(pios[i], false);
+        if (sm < 0) {
+            continue;
+        }
+
+        if (offsets[i] < 0) {
+            offsets[i] = pio_add_program(pios[i], &pktuart_program);
+        }
+        p->pio = pios[i];
+        p->sm = sm;
+        p->offset = offsets[i];
+        return 0;
+    }
+
+    return -1;
+}
+
+
+static int pktuart_init(void) {
+    if (hm2_pktuart_tx_instances != hm2_pktuart_rx_instances) {
+        printf("pktuart: %d transmitters but %d receivers, they come in pairs\n", hm2_pktuart_tx_instances, hm2_pktuart_rx_instances);
+        return -1;
+    }
+    if (hm2_pktuart_tx_instances > PKTUART_MAX_INSTANCES) {
+        printf("pktuart: %d instances requested, max is %d\n", hm2_pktuart_tx_instances, PKTUART_MAX_INSTANCES);
+        return -1;
+    }
+
+    for (int i = 0; i < hm2_pktuart_tx_instances; ++i) {
+        pktuart_t * p = &pktuart[i];
+
+        int tx_pin = hm2_fw_find_pin(HM2_GTAG_PKTUART_TX, i, HM2_PKTUART_TX_DATA);
+        int de_pin = hm2_fw_find_pin(HM2_GTAG_PKTUART_TX, i, HM2_PKTUART_TX_ENABLE);
+        int rx_pin = hm2_fw_find_pin(HM2_GTAG_PKTUART_RX, i, HM2_PKTUART_RX_DATA);
+        if ((tx_pin < 0) || (rx_pin < 0)) {
+            printf("pktuart %d: no TX and RX data pins in the pin map\n", i);
+            return -1;
+        }
+
+        if (pktuart_claim_pio(p) < 0) {
+            printf("pktuart %d: no PIO with room for the program and a free state machine\n", i);
+            return -1;
+        }
+
+        hm2_fifo_t const tx_data_init = HM2_FIFO_INIT(tx_data_storage[i]);
+        hm2_fifo_t const tx_frames_init = HM2_FIFO_INIT(tx_frames_storage[i]);
+        hm2_fifo_t const rx_data_init = HM2_FIFO_INIT(rx_data_storage[i]);
+        hm2_fifo_t const rx_frames_init = HM2_FIFO_INIT(rx_frames_storage[i]);
+        tx_data[i] = tx_data_init;
+        tx_frames[i] = tx_frames_init;
+        rx_data[i] = rx_data_init;
+        rx_frames[i] = rx_frames_init;
+
+        p->tx_left = 0;
+        p->tx_word_bytes = 0;
+        p->tx_next_frame_us = 0;
+        p->tx_active = false;
+        p->tx_fifo_error = false;
+        p->rx_events = 0;
+        p->rx_bytes = 0;
+        p->rx_word = 0;
+        p->rx_frame_errors = 0;
+        p->rx_errors = 0;
+        p->rx_clear_seq = 0;
+        p->rx_cleared_seq = 0;
+
+        // An idle RX line is high, even with nothing connected.
+        gpio_pull_up(rx_pin);
+
+        pktuart_program_init(p->pio, p->sm, p->offset, tx_pin, rx_pin, de_pin);
+        pktuart_set_bitrate(p, PKTUART_TX_REG(PKTUART_BITRATE, i));
+
+        // The pins stay with the ioport until the host sets their
+        // AltSource bits.
+        uint8_t function = (p->pio == pio0) ? GPIO_FUNC_PIO0 : GPIO_FUNC_PIO1;
+        hm2_pin_alt_function[tx_pin] = function;
+        hm2_pin_alt_function[rx_pin] = function;
+        if (de_pin >= 0) {
+            hm2_pin_alt_function[de_pin] = function;
+        }
+
+        p->dma_chan = dma_claim_unused_channel(true);
+        dma_channel_config c = dma_channel_get_default_config(p->dma_chan);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+        channel_config_set_read_increment(&c, false);
+        channel_config_set_write_increment(&c, true);
+        channel_config_set_ring(&c, true, PKTUART_RX_RING_BITS);
+        channel_config_set_dreq(&c, pio_get_dreq(p->pio, p->sm, false));
+        if (hm2_dma_stream_init(p->dma_chan, &c) < 0) {
+            return -1;
+        }
+        hm2_dma_stream_start(p->dma_chan, pktuart_rx_ring[i], &p->pio->rxf[p->sm]);
+
+        pio_sm_set_enabled(p->pio, p->sm, true);
+    }
+
+    return 0;
+}
+
+
+hm2_region_t const hm2_pktuart_tx_region = {
+    .name = "uart_tx",
+    .addr = HM2_PKTUART_TX_ADDR,
+    .size = HM2_PKTUART_TX_SIZE,
+    .init = pktuart_init,
+    .update = pktuart_update,
+    .period_us = PKTUART_UPDATE_PERIOD_US,
+    .write = pktuart_tx_write,
+    .read = pktuart_tx_read,
+};
+
+
+hm2_region_t const hm2_pktuart_rx_region = {
+    .name = "uart_rx",
+    .addr = HM2_PKTUART_RX_ADDR,
+    .size = HM2_PKTUART_RX_SIZE,
+    .write = pktuart_rx_write,
+    .read = pktuart_rx_read,
+};
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+
+#include "hm2-fw.h"
+
+
+// Per-region handler profiling.
+//
+// This is not a hostmot2 Module, it's a read-only block of registers
+// for humans (and scripts) to dump with elbpcom or mesaflash while the
+// firmware is running, to see how long each region's handlers take.
+//
+// All times are in CPU clock cycles.  The "mean" registers are the
+// total cycles divided by the number of calls, computed when read.
+//
+// 0xf000  Number of regions
+// 0xf004  CPU clock frequency in Hz
+// 0xf008..0xf03c  Reserved
+//
+// 0xf040  Region 0:
+//     +0x00  Name, characters 0-3
+//     +0x04  Name, characters 4-7
+//     +0x08  update() period in us
+//     +0x0c  update() deadline misses
+//     +0x10  update() and sample() calls
+//     +0x14  update() and sample() min cycles
+//     +0x18  update() and sample() max cycles
+//     +0x1c  update() and sample() mean cycles
+//     +0x20  write() calls
+//     +0x24  write() min cycles
+//     +0x28  write() max cycles
+//     +0x2c  write() mean cycles
+//     +0x30  read() calls
+//     +0x34  read() min cycles
+//     +0x38  read() max cycles
+//     +0x3c  read() mean cycles
+//
+// 0xf080  Region 1, etc.
+//
+// Writes are ignored.
+
+
+#define PROFILE_REGION_BASE  0x40
+#define PROFILE_REGION_SIZE  0x40
+
+
+static uint32_t profile_stat(hm2_profile_t const * profile, size_t index) {
+    switch (index) {
+        case 0:
+            return profile->calls;
+        case 1:
+            return profile->min_cycles;
+        case 2:
+            return profile->max_cycles;
+        default:
+            if (profile->calls == 0) {
+                return 0;
+            }
+            return profile->total_cycles / profile->calls;
+    }
+}
+
+
+static uint32_t profile_region_word(hm2_region_t const * region, hm2_region_state_t const * state, size_t word) {
+    switch (word) {
+        case 0:
+        case 1: {
+            char name[8] = { 0 };
+            for (size_t c = 0; (c < sizeof(name)) && (region->name[c] != '\0'); ++c) {
+                name[c] = region->name[c];
+            }
+            uint32_t val;
+            memcpy(&val, &name[word * 4], 4);
+            return val;
+        }
+        case 2:
+            return region->period_us;
+        case 3:
+            return state->deadline_misses;
+        default:
+            break;
+    }
+
+    word -= 4;
+    switch (word / 4) {
+        case 0:
+            return profile_stat(&state->update_profile, word % 4);
+        case 1:
+            return profile_stat(&state->write_profile, word % 4);
+        default:
+            return profile_stat(&state->read_profile, word % 4);
+    }
+}
+
+
+static uint32_t profile_word(uint16_t addr) {
+    if (addr < PROFILE_REGION_BASE) {
+        switch (addr / 4) {
+            case 0:
+                return hm2_num_regions;
+            case 1:
+                return clock_get_hz(clk_sys);
+            default:
+                return 0;
+        }
+    }
+
+    size_t i = (addr - PROFILE_REGION_BASE) / PROFILE_REGION_SIZE;
+    if (i >= hm2_num_regions) {
+        return 0;
+    }
+    return profile_region_word(hm2_region[i], &hm2_region_state[i], (addr % PROFILE_REGION_SIZE) / 4);
+}
+
+
+static int profile_write(uint16_t addr, uint32_t const * buf, size_t num_uint32) {
+    return 0;
+}
+
+
+static int profile_read(uint16_t addr, uint32_t * buf, size_t num_uint32) {
+    for (size_t i = 0; i < num_uint32; ++i) {
+        buf[i] = profile_word(addr + (i * 4));
+    }
+    return 0;
+}
+
+
+hm2_region_t const hm2_profile_region = {
+    .name = "profile",
+    .addr = HM2_PROFILE_ADDR,
+    .size = HM2_PROFILE_SIZE,
+    .write = profile_write,
+    .read = profile_read,
+};
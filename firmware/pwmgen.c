@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/gpio.h"
+#include "hardware/pwm.h"
+
+#include "hm2-fw.h"
+
+
+// 0x4000  PWM value, one per instance (stride 4)
+//
+//     Bits 30:16 are the duty cycle, 0 to 2^width - 1 (PWM) or 0 to
+//     4095 (PDM).  Bit 31 is the direction, 1 = negative.
+//
+// 0x4100  PWM mode, one per instance
+//
+//     Bits 1:0:  PWM width, 0 = 9 bits, 1 = 10, 2 = 11, 3 = 12
+//     Bit 2:     1 = symmetrical (up/down counting) PWM
+//     Bits 4:3:  Output mode:
+//                    0 = PWM on Out0, Dir on Out1
+//                    1 = Dir on Out0, PWM on Out1
+//                    2 = Up on Out0, Down on Out1
+//                    3 = PDM on Out0, Dir on Out1
+//     Bit 5:     Double buffered (ignored, always double buffered)
+//
+// 0x4200  PWM master rate
+//
+//     The PWM clock is ClockHigh * rate / 65536, the PWM frequency is
+//     the PWM clock / 2^width (half that for symmetrical PWM).
+//
+// 0x4300  PDM master rate
+//
+//     The PDM clock is ClockHigh * rate / 65536.
+//
+// 0x4400  Enable
+//
+//     Bit N enables instance N.  Disabled instances drive both outputs
+//     low.
+//
+//
+// Each instance is one RP2040 PWM slice, with Out0 and Out1 on its two
+// channels.  The slices' counter compare and TOP registers are double
+// buffered by the hardware, new values take effect when the counter
+// wraps, so duty cycle changes never glitch.
+//
+// The slices can't do PDM by themselves, so in PDM mode the slice
+// counts to 16 at the PDM clock and a DMA channel, paced by the slice's
+// wrap, feeds it a new compare value every period from a ring of 256.
+// The ring spreads the 12-bit value over the 256 periods like a
+// first-order sigma-delta modulator would, so the average is exact and
+// most of the ripple is at the PDM clock / 16.
+//
+// Each instance has two rings.  The DMA channel plays one, 256 words
+// at a time, and chains to a control channel that reloads its read
+// address from `pdm_next` and starts it again.  A new value goes in the
+// ring that isn't playing, and `pdm_next` then points the DMA at it, so
+// the slice switches over at the end of a ring and never plays one
+// that's half rewritten.  Only once the DMA has moved on to the new
+// ring is the other one free for the next value: until then a change
+// waits for a later update.
+
+
+#define PWMGEN_UPDATE_PERIOD_US 100
+
+// Two channels per slice, and a slice per instance.
+#define PWMGEN_MAX_INSTANCES NUM_PWM_SLICES
+
+#define PWMGEN_PDM_TOP        15
+#define PWMGEN_PDM_RING_WORDS 256
+
+_Static_assert(((PWMGEN_PDM_TOP + 1) * PWMGEN_PDM_RING_WORDS) == 4096, "pwmgen PDM must have 12 bits of resolution");
+
+#define PWMGEN_REG(reg, instance) (hm2_register_file32[((HM2_PWMGEN_ADDR + ((reg) * 0x100)) / 4) + (instance)])
+
+#define PWMGEN_VALUE      0
+#define PWMGEN_MODE       1
+#define PWMGEN_PWM_RATE   2
+#define PWMGEN_PDM_RATE   3
+#define PWMGEN_ENABLE     4
+
+#define PWMGEN_MODE_WIDTH       0x03
+#define PWMGEN_MODE_SYMMETRICAL (1 << 2)
+#define PWMGEN_MODE_OUTPUT(m)   (((m) >> 3) & 0x3)
+#define PWMGEN_MODE_MASK        0x1f
+
+#define PWMGEN_OUTPUT_PWM_DIR   0
+#define PWMGEN_OUTPUT_DIR_PWM   1
+#define PWMGEN_OUTPUT_UP_DOWN   2
+#define PWMGEN_OUTPUT_PDM_DIR   3
+
+
+typedef struct {
+    uint slice;
+    uint dma_chan;
+    uint ctrl_chan;
+
+    // The slice channel of each output, or -1 if the output isn't in
+    // the pin map.
+    int out_chan[2];
+
+    // The settings the slice was last programmed with, so it's only
+    // touched when they change.
+    bool enabled;
+    uint32_t value;
+    uint32_t mode;
+    uint32_t rate;
+    bool pdm_running;
+
+    // The ring `pdm_next` points at.
+    int next_ring;
+} pwmgen_t;
+
+
+static pwmgen_t pwmgen[PWMGEN_MAX_INSTANCES];
+
+// The word after each ring is never played, it keeps a ring's end
+// address (where the DMA's read address is left after the ring's last
+// word) out of the other ring.
+static uint32_t pdm_ring[PWMGEN_MAX_INSTANCES][2][PWMGEN_PDM_RING_WORDS + 1];
+
+// The ring each DMA channel plays next, read by its control channel.
+static uint32_t const * volatile pdm_next[PWMGEN_MAX_INSTANCES];
+
+extern uint8_t const hm2_pwmgen_instances;
+
+
+// The slice's clock divider for a hostmot2 master rate, in the slice's
+// 8.4 fixed point.  The PWM clock is clk_sys * rate / 65536, so the
+// divider is 65536 / rate.
+static uint32_t pwmgen_div_8_4(uint32_t rate) {
+    uint32_t div = (1u << 20) / rate;
+    if (div < (1 << 4)) {
+        div = 1 << 4;
+    }
+    if (div > 0xfff) {
+        div = 0xfff;
+    }
+    return div;
+}
+
+
+// Compare values for Out0 and Out1 (in that order) given the duty
+// cycle, the direction, and "full on" for the Dir outputs.
+static void pwmgen_levels(uint32_t output, uint32_t duty, bool negative, uint32_t full, uint32_t level[2]) {
+    switch (output) {
+        case PWMGEN_OUTPUT_DIR_PWM:
+            level[0] = negative ? full : 0;
+            level[1] = duty;
+            break;
+
+        case PWMGEN_OUTPUT_UP_DOWN:
+            level[0] = negative ? 0 : duty;
+            level[1] = negative ? duty : 0;
+            break;
+
+        default:
+            level[0] = duty;
+            level[1] = negative ? full : 0;
+            break;
+    }
+}
+
+
+// The slice's CC register value that puts level[0] on Out0 and
+// level[1] on Out1.
+static uint32_t pwmgen_cc(pwmgen_t const * p, uint32_t const level[2]) {
+    uint32_t cc = 0;
+    for (int out = 0; out < 2; ++out) {
+        if (p->out_chan[out] == PWM_CHAN_B) {
+            cc |= level[out] << 16;
+        } else if (p->out_chan[out] == PWM_CHAN_A) {
+            cc |= level[out];
+        }
+    }
+    return cc;
+}
+
+
+static void pwmgen_start_pdm(pwmgen_t * p) {
+    // Chained again, pwmgen_stop_pdm() unchained it.
+    hw_write_masked(&dma_hw->ch[p->dma_chan].al1_ctrl, p->ctrl_chan << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB, DMA_CH0_CTRL_TRIG_CHAIN_TO_BITS);
+    dma_channel_start(p->ctrl_chan);
+    p->pdm_running = true;
+}
+
+
+static void pwmgen_stop_pdm(pwmgen_t * p) {
+    if (p->pdm_running) {
+        // Unchain it first: on the RP2040, aborting a channel can
+        // trigger the channel it chains to (erratum RP2040-E13).
+        hw_write_masked(&dma_hw->ch[p->dma_chan].al1_ctrl, p->dma_chan << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB, DMA_CH0_CTRL_TRIG_CHAIN_TO_BITS);
+
+        // The control channel may be starting it again right now.
+        while (dma_channel_is_busy(p->ctrl_chan)) {
+            tight_loop_contents();
+        }
+
+        dma_channel_abort(p->dma_chan);
+        p->pdm_running = false;
+    }
+}
+
+
+// The ring that's free to fill with a new value, or -1 if the DMA is
+// yet to start on the ring `pdm_next` points at.
+static int pwmgen_idle_pdm_ring(pwmgen_t const * p, int instance) {
+    if (!p->pdm_running) {
+        return !p->next_ring;
+    }
+    uintptr_t next = (uintptr_t)pdm_ring[instance][p->next_ring];
+    uintptr_t read_addr = dma_channel_hw_addr(p->dma_chan)->read_addr;
+    if ((read_addr - next) <= (PWMGEN_PDM_RING_WORDS * 4)) {
+        return !p->next_ring;
+    }
+    return -1;
+}
+
+
+// Spread the 12-bit PDM duty cycle over the ring: period k is on for
+// floor((k+1) * duty / 256) - floor(k * duty / 256) of its 16 counts.
+static void pwmgen_fill_pdm_ring(pwmgen_t const * p, uint32_t * ring, uint32_t duty, bool negative) {
+    for (uint32_t k = 0; k < PWMGEN_PDM_RING_WORDS; ++k) {
+        uint32_t level[2];
+        uint32_t on = (((k + 1) * duty) >> 8) - ((k * duty) >> 8);
+        pwmgen_levels(PWMGEN_OUTPUT_PDM_DIR, on, negative, PWMGEN_PDM_TOP + 1, level);
+        ring[k] = pwmgen_cc(p, level);
+    }
+}
+
+
+static void pwmgen_update_instance(pwmgen_t * p, int instance, uint32_t pwm_rate, uint32_t pdm_rate, uint32_t enable) {
+    uint32_t value = PWMGEN_REG(PWMGEN_VALUE, instance);
+    uint32_t mode = PWMGEN_REG(PWMGEN_MODE, instance) & PWMGEN_MODE_MASK;
+    uint32_t output = PWMGEN_MODE_OUTPUT(mode);
+    uint32_t rate = (output == PWMGEN_OUTPUT_PDM_DIR) ? pdm_rate : pwm_rate;
+    bool enabled = ((enable >> instance) & 0x1) && (rate != 0);
+
+    if ((enabled == p->enabled) && (value == p->value) && (mode == p->mode) && (rate == p->rate)) {
+        return;
+    }
+
+    // Neither ring is free yet, try again next update.
+    int idle_ring = pwmgen_idle_pdm_ring(p, instance);
+    if (enabled && (output == PWMGEN_OUTPUT_PDM_DIR) && (idle_ring < 0)) {
+        return;
+    }
+    p->enabled = enabled;
+    p->value = value;
+    p->mode = mode;
+    p->rate = rate;
+
+    if (!enabled) {
+        pwmgen_stop_pdm(p);
+        pwm_hw->slice[p->slice].cc = 0;
+        return;
+    }
+
+    bool negative = (value >> 31) & 0x1;
+    uint32_t duty = (value >> 16) & 0x7fff;
+    uint32_t div = pwmgen_div_8_4(rate);
+    pwm_set_clkdiv_int_frac(p->slice, div >> 4, div & 0xf);
+
+    if (output == PWMGEN_OUTPUT_PDM_DIR) {
+        if (duty > 0xfff) {
+            duty = 0xfff;
+        }
+        pwm_set_phase_correct(p->slice, false);
+        pwm_set_wrap(p->slice, PWMGEN_PDM_TOP);
+        pwmgen_fill_pdm_ring(p, pdm_ring[instance][idle_ring], duty, negative);
+        pdm_next[instance] = pdm_ring[instance][idle_ring];
+        p->next_ring = idle_ring;
+        if (!p->pdm_running) {
+            pwmgen_start_pdm(p);
+        }
+        return;
+    }
+
+    pwmgen_stop_pdm(p);
+
+    uint32_t top = (1u << (9 + (mode & PWMGEN_MODE_WIDTH))) - 1;
+    if (duty > top) {
+        duty = top;
+    }
+    uint32_t level[2];
+    pwmgen_levels(output, duty, negative, top + 1, level);
+
+    pwm_set_phase_correct(p->slice, mode & PWMGEN_MODE_SYMMETRICAL);
+    pwm_set_wrap(p->slice, top);
+    pwm_hw->slice[p->slice].cc = pwmgen_cc(p, level);
+}
+
+
+static void pwmgen_update(void) {
+    uint32_t pwm_rate = PWMGEN_REG(PWMGEN_PWM_RATE, 0);
+    uint32_t pdm_rate = PWMGEN_REG(PWMGEN_PDM_RATE, 0);
+    uint32_t enable = PWMGEN_REG(PWMGEN_ENABLE, 0);
+
+    for (int i = 0; i < hm2_pwmgen_instances; ++i) {
+        pwmgen_update_instance(&pwmgen[i], i, pwm_rate, pdm_rate, enable);
+    }
+}
+
+
+// The watchdog bit.  The ioport has already taken the pins back, this
+// disables the pwmgens (core 1 turns them off at its next update) so
+// they don't come back on when the host gives the pins back.
+static void pwmgen_safe(void) {
+    PWMGEN_REG(PWMGEN_ENABLE, 0) = 0;
+}
+
+
+static int pwmgen_init(void) {
+    if (hm2_pwmgen_instances > PWMGEN_MAX_INSTANCES) {
+        printf("pwmgen: %d instances requested, max is %d\n", hm2_pwmgen_instances, PWMGEN_MAX_INSTANCES);
+        return -1;
+    }
+
+    uint32_t slices_used = 0;
+
+    for (int i = 0; i < hm2_pwmgen_instances; ++i) {
+        pwmgen_t * p = &pwmgen[i];
+
+        int pin[2] = {
+            hm2_fw_find_pin(HM2_GTAG_PWMGEN, i, HM2_PWMGEN_OUT0),
+            hm2_fw_find_pin(HM2_GTAG_PWMGEN, i, HM2_PWMGEN_OUT1),
+        };
+        if (pin[0] < 0) {
+            printf("pwmgen %d: no Out0 pin in the pin map\n", i);
+            return -1;
+        }
+
+        p->slice = pwm_gpio_to_slice_num(pin[0]);
+        if ((pin[1] >= 0) && (pwm_gpio_to_slice_num(pin[1]) != p->slice)) {
+            printf("pwmgen %d: Out0 and Out1 must be on the same PWM slice\n", i);
+            return -1;
+        }
+        if (slices_used & (1u << p->slice)) {
+            printf("pwmgen %d: PWM slice %d is already used\n", i, p->slice);
+            return -1;
+        }
+        slices_used |= 1u << p->slice;
+
+        for (int out = 0; out < 2; ++out) {
+            p->out_chan[out] = -1;
+            if (pin[out] >= 0) {
+                p->out_chan[out] = pwm_gpio_to_channel(pin[out]);
+
+                // The pins stay with the ioport until the host sets
+                // their AltSource bits.
+                hm2_pin_alt_function[pin[out]] = GPIO_FUNC_PWM;
+            }
+        }
+
+        p->enabled = false;
+        p->value = 0;
+        p->mode = 0;
+        p->rate = 0;
+        p->pdm_running = false;
+        p->next_ring = 0;
+        pdm_next[i] = pdm_ring[i][0];
+
+        pwm_config c = pwm_get_default_config();
+        pwm_init(p->slice, &c, false);
+        pwm_hw->slice[p->slice].cc = 0;
+        pwm_set_enabled(p->slice, true);
+
+        // A ring's worth of compare values each time the control
+        // channel starts it, then the control channel again.
+        p->dma_chan = dma_claim_unused_channel(true);
+        p->ctrl_chan = dma_claim_unused_channel(true);
+        dma_channel_config dc = dma_channel_get_default_config(p->dma_chan);
+        channel_config_set_transfer_data_size(&dc, DMA_SIZE_32);
+        channel_config_set_read_increment(&dc, true);
+        channel_config_set_write_increment(&dc, false);
+        channel_config_set_dreq(&dc, DREQ_PWM_WRAP0 + p->slice);
+        channel_config_set_chain_to(&dc, p->ctrl_chan);
+        dma_channel_configure(p->dma_chan, &dc, &pwm_hw->slice[p->slice].cc, pdm_next[i], PWMGEN_PDM_RING_WORDS, false);
+
+        // One word, the next ring's address, into the DMA channel's
+        // read address trigger.
+        dma_channel_config cc = dma_channel_get_default_config(p->ctrl_chan);
+        channel_config_set_transfer_data_size(&cc, DMA_SIZE_32);
+        channel_config_set_read_increment(&cc, false);
+        channel_config_set_write_increment(&cc, false);
+        dma_channel_configure(p->ctrl_chan, &cc, &dma_hw->ch[p->dma_chan].al3_read_addr_trig, &pdm_next[i], 1, false);
+    }
+
+    return 0;
+}
+
+
+hm2_region_t const hm2_pwmgen_region = {
+    .name = "pwmgen",
+    .addr = HM2_PWMGEN_ADDR,
+    .size = HM2_PWMGEN_SIZE,
+    .init = pwmgen_init,
+    .update = pwmgen_update,
+    .period_us = PWMGEN_UPDATE_PERIOD_US,
+    .safe = pwmgen_safe,
+};
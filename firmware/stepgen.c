@@ -0,0 +1,414 @@
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/gpio.h"
+#include "hardware/pio.h"
+
+#include "hm2-fw.h"
+#include "hm2-dma.h"
+#include "stepgen.pio.h"
+
+
+// 0x2000  Rate, one per instance (stride 4)
+//
+//     Signed.  Added to the 48-bit position accumulator every ClockLow
+//     cycle, one step is 2^32.
+//
+// 0x2100  Accumulator, one per instance
+//
+//     Bits 47:16 of the position accumulator, so 16.16 fixed point
+//     steps.  Read only.
+//
+// 0x2200  Mode, one per instance
+//
+//     Bits 1:0 are the step type: 0 = step/dir, 1 = up/down,
+//     2 = quadrature, 3 = table.  Only step/dir is implemented, a
+//     stepgen in any other mode doesn't move.
+//
+// 0x2300  DirSetupTime, one per instance
+// 0x2400  DirHoldTime, one per instance
+// 0x2500  PulseWidth, one per instance
+// 0x2600  PulseIdleWidth, one per instance
+//
+//     14 bits, in ClockLow cycles.
+//
+// 0x2700  TableData, one per instance
+// 0x2800  TableLength, one per instance
+// 0x2900  Master DDS
+//
+//     Accepted but ignored (there's no table mode, and the stepgens
+//     always run at the full ClockLow rate).
+//
+//
+// Each stepgen is a PIO state machine (see stepgen.pio) fed by an
+// endless DMA stream (see hm2-dma.h) from a ring buffer of commands.
+// The ring is divided into slots, each holding STEPGEN_SLOT_CMDS
+// commands that together take exactly one update period to run, so the
+// state machine plays one slot per update period.
+//
+// Every update period, core 1 runs the DDA for one period for each
+// stepgen, and writes the resulting steps as commands into the slot
+// that the DMA will read two slots from now.  Step timing is exact to
+// the clock cycle (as long as the rate is steady) and doesn't depend on
+// when core 1 gets around to running the update.
+//
+// If core 1 misses updates, the state machine plays idle slots instead
+// of stale commands (every update clears all the slots the DMA has
+// finished reading, so there are STEPGEN_SLOTS - 3 idle slots after the
+// newest one written), and the missed time is simply not added to the
+// DDA, so the accumulator always matches the steps actually made.  Only
+// if core 1 misses more than that in a row does the ring come round to
+// old commands.
+//
+// The accumulator reported to the host is the position at the end of
+// the slot the state machine is running, so it leads the STEP pin by
+// less than one update period.
+
+
+#define STEPGEN_UPDATE_PERIOD_US 100
+
+// PIO0 has 4 state machines, one per stepgen.
+#define STEPGEN_MAX_INSTANCES 4
+
+#define STEPGEN_SLOTS        8
+#define STEPGEN_SLOT_CMDS    4
+#define STEPGEN_SLOT_WORDS   (STEPGEN_SLOT_CMDS * 2)
+#define STEPGEN_RING_WORDS   (STEPGEN_SLOTS * STEPGEN_SLOT_WORDS)
+#define STEPGEN_RING_BITS    8    // log2 of the ring size in bytes
+
+_Static_assert((STEPGEN_RING_WORDS * 4) == (1 << STEPGEN_RING_BITS), "stepgen ring size must be a power of 2");
+
+// Minimum low time between steps, in cycles.  This covers the commands
+// between the last step of one slot and the first step of the next, so
+// slot boundaries never make the steps fall behind.
+#define STEPGEN_MIN_LOW 32
+
+#define STEPGEN_REG(reg, instance) (hm2_register_file32[((HM2_STEPGEN_ADDR + ((reg) * 0x100)) / 4) + (instance)])
+
+#define STEPGEN_RATE          0
+#define STEPGEN_ACCUMULATOR   1
+#define STEPGEN_MODE          2
+#define STEPGEN_DIR_SETUP     3
+#define STEPGEN_DIR_HOLD      4
+#define STEPGEN_PULSE_WIDTH   5
+#define STEPGEN_PULSE_IDLE    6
+
+
+typedef struct {
+    uint sm;
+    uint dma_chan;
+
+    // Position accumulator, 32.32 fixed point steps.
+    uint64_t position;
+
+    // Accumulator register value at the end of each slot.
+    uint32_t slot_accumulator[STEPGEN_SLOTS];
+
+    // Accumulator register value for the slot the state machine is
+    // running.
+    uint32_t accumulator;
+
+    // The slot most recently written.
+    int last_slot;
+
+    // How many cycles past its end the last slot written runs.
+    int32_t carry;
+
+    // When the last step pulse ended, relative to the start of the next
+    // slot to be written.
+    int32_t last_fall;
+
+    bool dir;
+} stepgen_t;
+
+
+static stepgen_t stepgen[STEPGEN_MAX_INSTANCES];
+
+static uint32_t stepgen_ring[STEPGEN_MAX_INSTANCES][STEPGEN_RING_WORDS] __attribute__((aligned(STEPGEN_RING_WORDS * 4)));
+
+// Number of cycles in one update period (and one slot).
+static int32_t slot_cycles;
+
+extern uint8_t const hm2_stepgen_instances;
+
+
+static inline void stepgen_cmd(uint32_t * cmd, bool dir, uint32_t steps, uint32_t wait, uint32_t high, uint32_t low) {
+    cmd[0] = dir | (steps << 1) | (wait << 16);
+    cmd[1] = low | (high << 16);
+}
+
+
+static inline int32_t max_int32(int32_t a, int32_t b) {
+    return (a > b) ? a : b;
+}
+
+
+// Fill a slot with delays that add up to one update period.
+static void stepgen_idle_slot(stepgen_t * s, uint32_t * ring, int slot) {
+    uint32_t * cmd = &ring[slot * STEPGEN_SLOT_WORDS];
+    int32_t wait = (slot_cycles / STEPGEN_SLOT_CMDS) - 8;
+
+    for (int i = 0; i < STEPGEN_SLOT_CMDS; ++i) {
+        stepgen_cmd(&cmd[i * 2], s->dir, 0, wait, 0, 0);
+    }
+    cmd[1 * 2] += (slot_cycles % STEPGEN_SLOT_CMDS) << 16;
+}
+
+
+// Run the DDA for one update period and write the steps into `cmd`.
+static void stepgen_fill_slot(stepgen_t * s, int instance, uint32_t * cmd) {
+    uint32_t rate = STEPGEN_REG(STEPGEN_RATE, instance);
+    uint32_t mode = STEPGEN_REG(STEPGEN_MODE, instance) & 0x3;
+    int32_t dir_setup = STEPGEN_REG(STEPGEN_DIR_SETUP, instance) & 0x3fff;
+    int32_t dir_hold = STEPGEN_REG(STEPGEN_DIR_HOLD, instance) & 0x3fff;
+    int32_t pulse_width = STEPGEN_REG(STEPGEN_PULSE_WIDTH, instance) & 0x3fff;
+    int32_t pulse_idle = STEPGEN_REG(STEPGEN_PULSE_IDLE, instance) & 0x3fff;
+
+    // PIO cycle counts, see stepgen.pio.
+    int32_t high = max_int32(pulse_width - 2, 0);
+    int32_t low_min = max_int32(pulse_idle - 3, STEPGEN_MIN_LOW);
+    uint32_t min_period = high + 5 + low_min;
+
+    bool dir = ((int32_t)rate < 0);
+    uint32_t speed = dir ? -rate : rate;
+    uint32_t max_speed = (1ull << 32) / min_period;
+    if (speed > max_speed) {
+        speed = max_speed;
+    }
+    if (mode != 0) {
+        speed = 0;
+    }
+
+    uint32_t steps = 0;
+    int32_t first = 0;
+    uint32_t period = 0;
+    uint32_t period_rem = 0;
+
+    if (speed != 0) {
+        uint64_t delta = (uint64_t)speed * slot_cycles;
+        uint32_t whole = s->position >> 32;
+        uint32_t frac = (uint32_t)s->position;
+
+        if (dir) {
+            s->position -= delta;
+            steps = whole - (uint32_t)(s->position >> 32);
+            first = (frac / speed) + 1;
+        } else {
+            s->position += delta;
+            steps = (uint32_t)(s->position >> 32) - whole;
+            first = ((1ull << 32) - frac + speed - 1) / speed;
+        }
+
+        period = (1ull << 32) / speed;
+        period_rem = (1ull << 32) % speed;
+    }
+
+    int32_t c = s->carry;
+
+    // Command 0: a delay in the old direction, long enough to meet the
+    // dir hold time if we're about to reverse.
+    bool reversing = (steps > 0) && (dir != s->dir);
+    int32_t wait = 0;
+    if (reversing) {
+        wait = max_int32(s->last_fall + dir_hold - 1 - c - 8, 0);
+    }
+    stepgen_cmd(&cmd[0], s->dir, 0, wait, 0, 0);
+    c += wait + 8;
+
+    // Commands 1 and 2: the steps.  The step period is a fraction of a
+    // cycle more than `period`, so the first batch of steps is spaced
+    // `period` cycles apart and the rest `period + 1`.
+    if (steps > 0) {
+        int32_t earliest = c + 8;
+        if (reversing) {
+            earliest = max_int32(earliest, c + 1 + dir_setup);
+        }
+        // The DDA's steps are shifted later by the length of the two
+        // commands ahead of the first step, so a step right at the start
+        // of the slot isn't late.
+        int32_t edge = max_int32(first + 16, earliest);
+
+        uint32_t slow = (((uint64_t)(steps - 1) * period_rem) + (speed / 2)) / speed;
+        uint32_t fast = steps - slow;
+        uint32_t low = period - high - 5;
+        if (low > 0xfffe) {
+            low = 0xfffe;
+        }
+
+        stepgen_cmd(&cmd[2], dir, fast, edge - c - 8, high, low);
+        edge += (fast - 1) * period;
+        c = edge + high + 3;
+
+        if (slow > 0) {
+            stepgen_cmd(&cmd[4], dir, slow, period - high - 10, high, low + 1);
+            edge += period + 1;
+            edge += (slow - 1) * (period + 1);
+            c = edge + high + 3;
+        } else {
+            stepgen_cmd(&cmd[4], dir, 0, 0, 0, 0);
+            c += 8;
+        }
+
+        s->last_fall = edge + high + 2;
+        s->dir = dir;
+
+    } else {
+        stepgen_cmd(&cmd[2], s->dir, 0, 0, 0, 0);
+        stepgen_cmd(&cmd[4], s->dir, 0, 0, 0, 0);
+        c += 16;
+    }
+
+    // Command 3: wait out the rest of the update period.
+    wait = max_int32(slot_cycles - c - 8, 0);
+    stepgen_cmd(&cmd[6], s->dir, 0, wait, 0, 0);
+    c += wait + 8;
+
+    s->carry = c - slot_cycles;
+    s->last_fall = max_int32(s->last_fall - slot_cycles, -(1 << 30));
+}
+
+
+static void stepgen_update_instance(stepgen_t * s, int instance) {
+    uint32_t * ring = stepgen_ring[instance];
+
+    uint32_t dma_word = (dma_channel_hw_addr(s->dma_chan)->read_addr - (uintptr_t)ring) / 4;
+    int dma_slot = dma_word / STEPGEN_SLOT_WORDS;
+    int slot = (dma_slot + 2) % STEPGEN_SLOTS;
+    int running = (dma_slot + STEPGEN_SLOTS - 1) % STEPGEN_SLOTS;
+
+    if (slot != s->last_slot) {
+        // Slots between the last one we wrote and this one played idle.
+        int missed = (slot - s->last_slot - 1 + STEPGEN_SLOTS) % STEPGEN_SLOTS;
+        s->last_fall = max_int32(s->last_fall - (missed * slot_cycles), -(1 << 30));
+
+        // The state machine is still running a slot that the DMA has
+        // finished reading, so that one's accumulator goes out before
+        // it's cleared.
+        s->accumulator = s->slot_accumulator[running];
+
+        // Make sure the DMA never replays old commands.  If updates were
+        // missed, the slot it reads next wasn't written either.
+        int next = (dma_slot + 1) % STEPGEN_SLOTS;
+        if (s->last_slot != next) {
+            stepgen_idle_slot(s, ring, next);
+            s->slot_accumulator[next] = s->slot_accumulator[s->last_slot];
+        }
+
+        stepgen_fill_slot(s, instance, &ring[slot * STEPGEN_SLOT_WORDS]);
+        s->slot_accumulator[slot] = s->position >> 16;
+
+        // And every slot it has finished reading, up to the one it's
+        // reading now, goes idle.
+        for (int idle = (slot + 1) % STEPGEN_SLOTS; idle != dma_slot; idle = (idle + 1) % STEPGEN_SLOTS) {
+            stepgen_idle_slot(s, ring, idle);
+            s->slot_accumulator[idle] = s->slot_accumulator[slot];
+        }
+
+        s->last_slot = slot;
+    }
+
+    STEPGEN_REG(STEPGEN_ACCUMULATOR, instance) = s->accumulator;
+}
+
+
+static void stepgen_update(void) {
+    hm2_fw_publish_begin(HM2_STEPGEN_ADDR);
+    for (int i = 0; i < hm2_stepgen_instances; ++i) {
+        stepgen_update_instance(&stepgen[i], i);
+    }
+    hm2_fw_publish_end(HM2_STEPGEN_ADDR);
+}
+
+
+// The watchdog bit.  The ioport has already taken the pins back, this
+// stops the steps so they don't start again when the host gives the
+// pins back to the stepgens.
+static void stepgen_safe(void) {
+    for (int i = 0; i < hm2_stepgen_instances; ++i) {
+        STEPGEN_REG(STEPGEN_RATE, i) = 0;
+    }
+}
+
+
+static int stepgen_init(void) {
+    if (hm2_stepgen_instances > STEPGEN_MAX_INSTANCES) {
+        printf("stepgen: %d instances requested, max is %d\n", hm2_stepgen_instances, STEPGEN_MAX_INSTANCES);
+        return -1;
+    }
+
+    slot_cycles = ((uint64_t)clock_get_hz(clk_sys) * STEPGEN_UPDATE_PERIOD_US) / (1000 * 1000);
+    if (slot_cycles > 0xffff) {
+        printf("stepgen: update period too long for the clock\n");
+        return -1;
+    }
+
+    if (!pio_can_add_program(pio0, &stepgen_program)) {
+        printf("stepgen: no room for the PIO program\n");
+        return -1;
+    }
+    uint offset = pio_add_program(pio0, &stepgen_program);
+
+    for (int i = 0; i < hm2_stepgen_instances; ++i) {
+        stepgen_t * s = &stepgen[i];
+
+        int step_pin = hm2_fw_find_pin(HM2_GTAG_STEPGEN, i, HM2_STEPGEN_STEP);
+        int dir_pin = hm2_fw_find_pin(HM2_GTAG_STEPGEN, i, HM2_STEPGEN_DIR);
+        if ((step_pin < 0) || (dir_pin < 0)) {
+            printf("stepgen %d: no step and dir pins in the pin map\n", i);
+            return -1;
+        }
+
+        int sm = pio_claim_unused_sm(pio0, false);
+        if (sm < 0) {
+            printf("stepgen %d: no free PIO state machine\n", i);
+            return -1;
+        }
+        s->sm = sm;
+
+        s->position = 0;
+        s->accumulator = 0;
+        s->last_slot = 0;
+        s->carry = 0;
+        s->last_fall = -(1 << 30);
+        s->dir = false;
+        for (int slot = 0; slot < STEPGEN_SLOTS; ++slot) {
+            stepgen_idle_slot(s, stepgen_ring[i], slot);
+            s->slot_accumulator[slot] = 0;
+        }
+
+        stepgen_program_init(pio0, s->sm, offset, step_pin, dir_pin);
+
+        // The pins stay with the ioport until the host sets their
+        // AltSource bits.
+        hm2_pin_alt_function[step_pin] = GPIO_FUNC_PIO0;
+        hm2_pin_alt_function[dir_pin] = GPIO_FUNC_PIO0;
+
+        s->dma_chan = dma_claim_unused_channel(true);
+        dma_channel_config c = dma_channel_get_default_config(s->dma_chan);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+        channel_config_set_read_increment(&c, true);
+        channel_config_set_write_increment(&c, false);
+        channel_config_set_ring(&c, false, STEPGEN_RING_BITS);
+        channel_config_set_dreq(&c, pio_get_dreq(pio0, s->sm, true));
+        if (hm2_dma_stream_init(s->dma_chan, &c) < 0) {
+            return -1;
+        }
+        hm2_dma_stream_start(s->dma_chan, &pio0->txf[s->sm], stepgen_ring[i]);
+
+        pio_sm_set_enabled(pio0, s->sm, true);
+    }
+
+    return 0;
+}
+
+
+hm2_region_t const hm2_stepgen_region = {
+    .name = "stepgen",
+    .addr = HM2_STEPGEN_ADDR,
+    .size = HM2_STEPGEN_SIZE,
+    .init = stepgen_init,
+    .update = stepgen_update,
+    .period_us = STEPGEN_UPDATE_PERIOD_US,
+    .safe = stepgen_safe,
+};
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/irq.h"
+#include "hardware/timer.h"
+#include "hardware/watchdog.h"
+
+#include "hm2-fw.h"
+
+
+// 0x0C00  Timer
+//
+//     The timeout, in ClockLow ticks.  Writing it restarts the timer.
+//     0 disables the watchdog.
+//
+// 0x0D00  Status
+//
+//     Bit 0:   The watchdog has bitten.  The host writes 0 to clear it.
+//     Bit 8:   The board was reset because core 0 stalled (read only)
+//     Bit 9:   The board was reset because core 1 stalled (read only)
+//
+// 0x0E00  Reset
+//
+//     Any write restarts the timer (hostmot2 drivers write 0x5a).
+//
+//
+// The timeout runs on one of the RP2040's hardware timer alarms, so
+// nothing polls it: every write to the Timer or Reset register moves
+// the alarm.  Its interrupt has the highest priority, above the
+// transports' (like the W5500's GPIO interrupt), so a packet being
+// handled can't hold off the bite.  When it fires, the alarm interrupt
+// calls each region's safe() function, which puts that module's outputs
+// in their safe state right away (the ioport turns every pin back into
+// a plain input, which also disconnects the stepgens and pwmgens from
+// their pins).  Writes to those modules are dropped until the host
+// clears the bitten bit, so that a packet the bite interrupted can't
+// set them going again, and then the host sets them up again.
+//
+// Separately, the RP2040's own watchdog resets the board if either core
+// stops running.  Core 1 feeds it from the module scheduler, but only
+// while core 0's main loop keeps going around: it calls
+// hm2_watchdog_core0_poll() between packets, so a core 0 that's stuck
+// in an interrupt handler (or anywhere else) stops the feeding, even if
+// timer interrupts still run.  A repeating timer on core 0 wakes its
+// main loop when there are no packets, and checks on core 1.
+// Whichever core notices the other has stopped leaves a note in
+// a watchdog scratch register, which survives the reset, so the Status
+// register can report which core stalled.
+
+
+#define WATCHDOG_TIMER   0
+#define WATCHDOG_STATUS  1
+#define WATCHDOG_RESET   2
+
+#define WATCHDOG_REG(reg) (hm2_register_file32[(HM2_WATCHDOG_ADDR + ((reg) * 0x100)) / 4])
+
+#define WATCHDOG_STATUS_BITTEN        (1 << 0)
+#define WATCHDOG_STATUS_CORE_0_STALL  (1 << 8)
+#define WATCHDOG_STATUS_CORE_1_STALL  (1 << 9)
+
+// The RP2040 watchdog's timeout, and how long a core's heartbeat can
+// stand still before the other core gives up on it.
+#define WATCHDOG_HW_TIMEOUT_MS  200
+#define WATCHDOG_STALL_US       (100 * 1000)
+#define WATCHDOG_HEARTBEAT_MS   10
+
+// Scratch register 0 says which core stalled.  The SDK uses 4-7.
+#define WATCHDOG_SCRATCH        0
+#define WATCHDOG_SCRATCH_MAGIC  0x68320000   // "h2"
+#define WATCHDOG_SCRATCH_CORE_0 (WATCHDOG_SCRATCH_MAGIC | 0)
+#define WATCHDOG_SCRATCH_CORE_1 (WATCHDOG_SCRATCH_MAGIC | 1)
+
+
+static int alarm_num = -1;
+static uint64_t timeout_us;
+
+// The read-only Status bits, from the last reset.
+static uint32_t reset_cause;
+
+// When each core last showed signs of life, the low 32 bits of the us
+// timer.  Each is written on one core and read on the other, and the
+// M0+ can't load 64 bits in one go: a 64-bit time read while the low
+// word wraps would look like a stall.  Unsigned differences of these
+// are right across the wrap, every 71.6 minutes.
+static uint32_t volatile core_0_heartbeat;
+static uint32_t volatile core_1_heartbeat;
+
+static bool volatile stall_detection_running;
+static bool volatile core_1_running;
+static repeating_timer_t heartbeat_timer;
+
+
+static void watchdog_bite(void) {
+    WATCHDOG_REG(WATCHDOG_STATUS) |= WATCHDOG_STATUS_BITTEN;
+    hm2_fw_safe();
+}
+
+
+static void watchdog_alarm_callback(uint alarm) {
+    watchdog_bite();
+}
+
+
+// Restart the timeout.
+static void watchdog_pet(void) {
+    if (timeout_us == 0) {
+        hardware_alarm_cancel(alarm_num);
+        return;
+    }
+    if (hardware_alarm_set_target(alarm_num, from_us_since_boot(time_us_64() + timeout_us))) {
+        // The timeout is so short it's already over.
+        watchdog_bite();
+    }
+}
+
+
+// Its interrupt wakes core 0's main loop, so that it calls
+// hm2_watchdog_core0_poll() even when no packets arrive.
+static bool watchdog_heartbeat_callback(repeating_timer_t * rt) {
+    uint32_t now = time_us_32();
+
+    if (core_1_running && ((uint32_t)(now - core_1_heartbeat) > WATCHDOG_STALL_US)) {
+        // Core 1 isn't feeding the RP2040 watchdog, it'll reset us.
+        watchdog_hw->scratch[WATCHDOG_SCRATCH] = WATCHDOG_SCRATCH_CORE_1;
+    }
+
+    return true;
+}
+
+
+void hm2_watchdog_core0_poll(void) {
+    core_0_heartbeat = time_us_32();
+}
+
+
+void hm2_watchdog_core1_poll(void) {
+    if (!stall_detection_running) {
+        return;
+    }
+
+    uint32_t now = time_us_32();
+    core_1_heartbeat = now;
+
+    if (!core_1_running) {
+        // The other modules' init() can take a while (the LED blinks),
+        // so the RP2040 watchdog starts when core 1 does.
+        watchdog_enable(WATCHDOG_HW_TIMEOUT_MS, true);
+        core_1_running = true;
+    }
+
+    if ((uint32_t)(now - core_0_heartbeat) > WATCHDOG_STALL_US) {
+        // Core 0's main loop stopped.  Stop feeding the RP2040 watchdog
+        // and let it reset us.
+        watchdog_hw->scratch[WATCHDOG_SCRATCH] = WATCHDOG_SCRATCH_CORE_0;
+        return;
+    }
+
+    watchdog_update();
+}
+
+
+static int watchdog_write(uint16_t addr, uint32_t const * buf, size_t num_uint32) {
+    for (size_t i = 0; i < num_uint32; ++i) {
+        if ((addr & 0xff) == 0) {
+            switch (addr >> 8) {
+                case WATCHDOG_TIMER:
+                    WATCHDOG_REG(WATCHDOG_TIMER) = buf[i];
+                    timeout_us = ((uint64_t)buf[i] * 1000 * 1000) / clock_get_hz(clk_sys);
+                    watchdog_pet();
+                    break;
+
+                case WATCHDOG_STATUS:
+                    WATCHDOG_REG(WATCHDOG_STATUS) = (buf[i] & WATCHDOG_STATUS_BITTEN) | reset_cause;
+                    if (!(buf[i] & WATCHDOG_STATUS_BITTEN)) {
+                        hm2_fw_resume();
+                    }
+                    break;
+
+                default:
+                    watchdog_pet();
+                    break;
+            }
+        }
+        addr += 4;
+    }
+    return 0;
+}
+
+
+static int watchdog_init(void) {
+    if (watchdog_caused_reboot()) {
+        uint32_t scratch = watchdog_hw->scratch[WATCHDOG_SCRATCH];
+        if (scratch == WATCHDOG_SCRATCH_CORE_0) {
+            reset_cause = WATCHDOG_STATUS_CORE_0_STALL;
+            printf("watchdog: reset because core 0 stalled\n");
+        } else if (scratch == WATCHDOG_SCRATCH_CORE_1) {
+            reset_cause = WATCHDOG_STATUS_CORE_1_STALL;
+            printf("watchdog: reset because core 1 stalled\n");
+        } else {
+            printf("watchdog: reset by the RP2040 watchdog\n");
+        }
+    }
+    watchdog_hw->scratch[WATCHDOG_SCRATCH] = 0;
+
+    WATCHDOG_REG(WATCHDOG_TIMER) = 0;
+    WATCHDOG_REG(WATCHDOG_STATUS) = reset_cause;
+    timeout_us = 0;
+
+    // The alarm interrupt is enabled on the core that sets the callback,
+    // which is this one (core 0).
+    alarm_num = hardware_alarm_claim_unused(true);
+    hardware_alarm_set_callback(alarm_num, watchdog_alarm_callback);
+
+    // Core 0 handles packets in the GPIO interrupt, and a packet can
+    // busy-wait there for tens of ms (memory space 4's WaituS and
+    // WaitForHM2).  The bite has to preempt that, not wait for it.
+    irq_set_priority(TIMER_IRQ_0 + alarm_num, PICO_HIGHEST_IRQ_PRIORITY);
+
+    core_0_heartbeat = time_us_32();
+    if (!add_repeating_timer_ms(WATCHDOG_HEARTBEAT_MS, watchdog_heartbeat_callback, NULL, &heartbeat_timer)) {
+        printf("watchdog: no repeating timer for the core 0 heartbeat\n");
+        return -1;
+    }
+
+    stall_detection_running = true;
+
+    return 0;
+}
+
+
+hm2_region_t const hm2_watchdog_region = {
+    .name = "watchdog",
+    .addr = HM2_WATCHDOG_ADDR,
+    .size = HM2_WATCHDOG_SIZE,
+    .init = watchdog_init,
+    .write = watchdog_write,
+};
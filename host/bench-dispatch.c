@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "pico/stdlib.h"
+
+#include "hm2-fw.h"
+
+
+//
+// Benchmark of the cost of a one-word hm2_fw_read() as a function of
+// which region it lands in and of how many regions the firmware has,
+// next to the cost of just the linear scan of the region table that
+// dispatch used to do.
+//
+// It's built once for each region count in host/CMakeLists.txt, as
+// bench-dispatch-<BENCH_NUM_REGIONS>, up to the 12 regions below.  The
+// regions are spread across the hm2 address space like real modules,
+// and each has a trivial read() handler.  The firmware library is
+// built with the handler profiling off (HM2_FW_PROFILE=0), so the time
+// measured is dispatch alone.  It should be flat across regions and
+// region counts, while the linear scan grows with the region's index;
+// the scan's mean can still be as low or lower.
+//
+
+#ifndef BENCH_NUM_REGIONS
+#define BENCH_NUM_REGIONS 12
+#endif
+
+#define HM2_R0_ADDR  0x0200
+#define HM2_R1_ADDR  0x0c00
+#define HM2_R2_ADDR  0x1000
+#define HM2_R3_ADDR  0x2000
+#define HM2_R4_ADDR  0x3000
+#define HM2_R5_ADDR  0x4000
+#define HM2_R6_ADDR  0x5000
+#define HM2_R7_ADDR  0x6000
+#define HM2_R8_ADDR  0x7000
+#define HM2_R9_ADDR  0x8000
+#define HM2_R10_ADDR 0xa000
+#define HM2_R11_ADDR 0xf000
+
+#define HM2_R0_SIZE  0x0004
+#define HM2_R1_SIZE  0x0300
+#define HM2_R2_SIZE  0x0500
+#define HM2_R3_SIZE  0x0a00
+#define HM2_R4_SIZE  0x0500
+#define HM2_R5_SIZE  0x0500
+#define HM2_R6_SIZE  0x0300
+#define HM2_R7_SIZE  0x0100
+#define HM2_R8_SIZE  0x0700
+#define HM2_R9_SIZE  0x0400
+#define HM2_R10_SIZE 0x0200
+#define HM2_R11_SIZE 0x0240
+
+// None of them are hostmot2 Modules.
+#define HM2_R0_MD(M, instances)
+#define HM2_R1_MD(M, instances)
+#define HM2_R2_MD(M, instances)
+#define HM2_R3_MD(M, instances)
+#define HM2_R4_MD(M, instances)
+#define HM2_R5_MD(M, instances)
+#define HM2_R6_MD(M, instances)
+#define HM2_R7_MD(M, instances)
+#define HM2_R8_MD(M, instances)
+#define HM2_R9_MD(M, instances)
+#define HM2_R10_MD(M, instances)
+#define HM2_R11_MD(M, instances)
+
+#define HM2_SYS_CLOCK_HZ (125 * 1000 * 1000)
+
+// The first n regions.
+#define BENCH_REGIONS_1(X)  X(r0, R0, 1)
+#define BENCH_REGIONS_2(X)  BENCH_REGIONS_1(X) X(r1, R1, 1)
+#define BENCH_REGIONS_3(X)  BENCH_REGIONS_2(X) X(r2, R2, 1)
+#define BENCH_REGIONS_4(X)  BENCH_REGIONS_3(X) X(r3, R3, 1)
+#define BENCH_REGIONS_5(X)  BENCH_REGIONS_4(X) X(r4, R4, 1)
+#define BENCH_REGIONS_6(X)  BENCH_REGIONS_5(X) X(r5, R5, 1)
+#define BENCH_REGIONS_7(X)  BENCH_REGIONS_6(X) X(r6, R6, 1)
+#define BENCH_REGIONS_8(X)  BENCH_REGIONS_7(X) X(r7, R7, 1)
+#define BENCH_REGIONS_9(X)  BENCH_REGIONS_8(X) X(r8, R8, 1)
+#define BENCH_REGIONS_10(X) BENCH_REGIONS_9(X) X(r9, R9, 1)
+#define BENCH_REGIONS_11(X) BENCH_REGIONS_10(X) X(r10, R10, 1)
+#define BENCH_REGIONS_12(X) BENCH_REGIONS_11(X) X(r11, R11, 1)
+
+#define BENCH_CONCAT(a, b) a##b
+#define BENCH_REGIONS(n) BENCH_CONCAT(BENCH_REGIONS_, n)
+
+#define HM2_MODULES(X) BENCH_REGIONS(BENCH_NUM_REGIONS)(X)
+
+#include "hm2-registry.h"
+
+
+static int bench_read(uint16_t addr, uint32_t * buf, size_t num_uint32) {
+    buf[0] = addr;
+    return 0;
+}
+
+
+#define BENCH_REGION(n, N, instances) \
+    hm2_region_t const hm2_##n##_region = { \
+        .name = #n, \
+        .addr = HM2_##N##_ADDR, \
+        .size = HM2_##N##_SIZE, \
+        .read = bench_read, \
+    };
+
+HM2_MODULES(BENCH_REGION)
+
+
+// The old dispatch, for comparison.
+__attribute__((noinline))
+static int linear_read(uint16_t addr, uint32_t * buf, size_t num_uint32) {
+    for (size_t i = 0; i < hm2_num_regions; ++i) {
+        hm2_region_t const * region = hm2_region[i];
+        if ((addr >= region->addr) && ((addr + (num_uint32 * 4)) <= (region->addr + region->size))) {
+            return region->read(addr - region->addr, buf, num_uint32);
+        }
+    }
+    return -1;
+}
+
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1e9) + ts.tv_nsec;
+}
+
+
+#define ITERATIONS (10 * 1000 * 1000)
+
+
+int main(void) {
+    volatile uint32_t sink;
+
+    double page_total = 0;
+    double linear_total = 0;
+
+    printf("%zu regions\n", hm2_num_regions);
+    printf("region  addr    hm2_fw_read ns/cmd  linear-scan ns/cmd\n");
+
+    for (size_t i = 0; i < hm2_num_regions; ++i) {
+        uint16_t addr = hm2_region[i]->addr;
+        uint32_t val;
+
+        double start = now_ns();
+        for (int n = 0; n < ITERATIONS; ++n) {
+            hm2_fw_read(addr, &val, 1);
+            sink = val;
+        }
+        double page_ns = (now_ns() - start) / ITERATIONS;
+
+        start = now_ns();
+        for (int n = 0; n < ITERATIONS; ++n) {
+            linear_read(addr, &val, 1);
+            sink = val;
+        }
+        double linear_ns = (now_ns() - start) / ITERATIONS;
+
+        printf("%6zu  0x%04x  %18.2f  %18.2f\n", i, addr, page_ns, linear_ns);
+        page_total += page_ns;
+        linear_total += linear_ns;
+    }
+
+    printf("  mean          %18.2f  %18.2f\n", page_total / hm2_num_regions, linear_total / hm2_num_regions);
+
+    (void)sink;
+    return 0;
+}
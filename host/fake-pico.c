@@ -0,0 +1,695 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "pico/multicore.h"
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/flash.h"
+#include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "hardware/pio.h"
+#include "hardware/pwm.h"
+#include "hardware/structs/systick.h"
+#include "hardware/timer.h"
+#include "hardware/watchdog.h"
+
+#include "fake-pico.h"
+
+
+//
+// Just enough of the RP2040 and the Pico SDK to run the hostmot2
+// firmware library on the build host.
+//
+
+fake_gpio_t fake_gpio;
+uint64_t fake_time_us;
+fake_watchdog_t fake_watchdog;
+uint8_t fake_irq_priority[FAKE_NUM_IRQS];
+
+static watchdog_hw_t fake_watchdog_hw;
+watchdog_hw_t * const watchdog_hw = &fake_watchdog_hw;
+
+#define FAKE_NUM_ALARMS 4
+
+static struct {
+    bool claimed;
+    bool armed;
+    uint64_t target;
+    hardware_alarm_callback_t callback;
+} fake_alarm[FAKE_NUM_ALARMS];
+
+#define FAKE_NUM_REPEATING_TIMERS 4
+
+static repeating_timer_t * fake_repeating_timer[FAKE_NUM_REPEATING_TIMERS];
+
+static systick_hw_t fake_systick;
+systick_hw_t * const systick_hw = &fake_systick;
+
+static dma_hw_t fake_dma_hw;
+dma_hw_t * const dma_hw = &fake_dma_hw;
+
+static struct {
+    bool claimed;
+    bool busy;
+    dma_channel_config config;
+
+    // What the transfer count is reloaded with when it's triggered.
+    uint32_t trans_count;
+} fake_dma[NUM_DMA_CHANNELS];
+
+uint8_t fake_flash[PICO_FLASH_SIZE_BYTES];
+
+// The linker script's end of the image, which flash-update.c copies up
+// to.  Here it's the start of the flash, an empty image.
+char __flash_binary_end;
+
+static pio_hw_t fake_pio_hw[2];
+pio_hw_t * const pio0_hw = &fake_pio_hw[0];
+pio_hw_t * const pio1_hw = &fake_pio_hw[1];
+
+static struct {
+    uint instructions_used;
+    uint32_t sm_claimed;
+} fake_pio[2];
+
+fake_pio_fifo_t fake_pio_tx_fifo[2][NUM_PIO_STATE_MACHINES];
+
+static pwm_hw_t fake_pwm_hw;
+pwm_hw_t * const pwm_hw = &fake_pwm_hw;
+
+
+void fake_pico_reset(void) {
+    memset(&fake_gpio, 0, sizeof(fake_gpio));
+    for (size_t i = 0; i < FAKE_NUM_GPIOS; ++i) {
+        fake_gpio.function[i] = GPIO_FUNC_NULL;
+    }
+    memset(&fake_systick, 0, sizeof(fake_systick));
+    fake_time_us = 0;
+    memset(&fake_watchdog, 0, sizeof(fake_watchdog));
+    memset(&fake_watchdog_hw, 0, sizeof(fake_watchdog_hw));
+    memset(fake_alarm, 0, sizeof(fake_alarm));
+    memset(fake_repeating_timer, 0, sizeof(fake_repeating_timer));
+    memset(fake_irq_priority, PICO_DEFAULT_IRQ_PRIORITY, sizeof(fake_irq_priority));
+    memset(&fake_dma_hw, 0, sizeof(fake_dma_hw));
+    memset(fake_dma, 0, sizeof(fake_dma));
+    memset(fake_pio_hw, 0, sizeof(fake_pio_hw));
+    memset(fake_pio, 0, sizeof(fake_pio));
+    memset(fake_pio_tx_fifo, 0, sizeof(fake_pio_tx_fifo));
+    memset(&fake_pwm_hw, 0, sizeof(fake_pwm_hw));
+    memset(fake_flash, 0xff, sizeof(fake_flash));
+}
+
+
+bool stdio_init_all(void) {
+    return true;
+}
+
+
+void sleep_ms(uint32_t ms) {
+}
+
+
+void sleep_us(uint64_t us) {
+}
+
+
+uint32_t clock_get_hz(enum clock_index clk_index) {
+    return 125 * 1000 * 1000;
+}
+
+
+//
+// Timer
+//
+
+uint64_t time_us_64(void) {
+    if (fake_time_us != 0) {
+        return fake_time_us;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 * 1000) + (ts.tv_nsec / 1000);
+}
+
+
+void busy_wait_us_32(uint32_t delay_us) {
+    busy_wait_until(time_us_64() + delay_us);
+}
+
+
+void busy_wait_until(absolute_time_t t) {
+    if (fake_time_us != 0) {
+        if (fake_time_us < t) {
+            fake_time_us = t;
+        }
+        return;
+    }
+
+    while (time_us_64() < t) {
+    }
+}
+
+
+int hardware_alarm_claim_unused(bool required) {
+    for (int i = 0; i < FAKE_NUM_ALARMS; ++i) {
+        if (!fake_alarm[i].claimed) {
+            fake_alarm[i].claimed = true;
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+void hardware_alarm_set_callback(unsigned int alarm_num, hardware_alarm_callback_t callback) {
+    fake_alarm[alarm_num].callback = callback;
+}
+
+
+bool hardware_alarm_set_target(unsigned int alarm_num, uint64_t target) {
+    if (time_us_64() >= target) {
+        fake_alarm[alarm_num].armed = false;
+        return true;
+    }
+    fake_alarm[alarm_num].armed = true;
+    fake_alarm[alarm_num].target = target;
+    return false;
+}
+
+
+void hardware_alarm_cancel(unsigned int alarm_num) {
+    fake_alarm[alarm_num].armed = false;
+}
+
+
+void irq_set_priority(unsigned int num, uint8_t hardware_priority) {
+    fake_irq_priority[num] = hardware_priority;
+}
+
+
+void irq_set_enabled(unsigned int num, bool enabled) {
+}
+
+
+void fake_pico_run_alarms(void) {
+    for (unsigned int i = 0; i < FAKE_NUM_ALARMS; ++i) {
+        if (fake_alarm[i].armed && (time_us_64() >= fake_alarm[i].target)) {
+            fake_alarm[i].armed = false;
+            if (fake_alarm[i].callback != NULL) {
+                fake_alarm[i].callback(i);
+            }
+        }
+    }
+}
+
+
+bool add_repeating_timer_ms(int32_t delay_ms, repeating_timer_callback_t callback, void * user_data, repeating_timer_t * out) {
+    for (int i = 0; i < FAKE_NUM_REPEATING_TIMERS; ++i) {
+        if (fake_repeating_timer[i] == NULL) {
+            out->delay_us = (int64_t)delay_ms * 1000;
+            out->callback = callback;
+            out->user_data = user_data;
+            fake_repeating_timer[i] = out;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void fake_pico_run_repeating_timers(void) {
+    for (int i = 0; i < FAKE_NUM_REPEATING_TIMERS; ++i) {
+        repeating_timer_t * rt = fake_repeating_timer[i];
+        if ((rt != NULL) && !rt->callback(rt)) {
+            fake_repeating_timer[i] = NULL;
+        }
+    }
+}
+
+
+//
+// Watchdog
+//
+
+void watchdog_enable(uint32_t delay_ms, bool pause_on_debug) {
+    fake_watchdog.enabled = true;
+}
+
+
+void watchdog_update(void) {
+    ++fake_watchdog.updates;
+}
+
+
+bool watchdog_caused_reboot(void) {
+    return fake_watchdog.caused_reboot;
+}
+
+
+void watchdog_reboot(uint32_t pc, uint32_t sp, uint32_t delay_ms) {
+    fake_watchdog.rebooted = true;
+}
+
+
+//
+// Multicore
+//
+
+void multicore_reset_core1(void) {
+}
+
+
+//
+// Flash
+//
+
+void flash_range_erase(uint32_t flash_offs, size_t count) {
+    memset(&fake_flash[flash_offs], 0xff, count);
+}
+
+
+void flash_range_program(uint32_t flash_offs, uint8_t const * data, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        fake_flash[flash_offs + i] &= data[i];
+    }
+}
+
+
+void flash_do_cmd(uint8_t const * txbuf, uint8_t * rxbuf, size_t count) {
+    static uint8_t const jedec_id[] = { 0xef, 0x40, 0x15 };
+
+    memset(rxbuf, 0, count);
+    if (txbuf[0] == 0x9f) {
+        for (size_t i = 1; (i < count) && (i <= sizeof(jedec_id)); ++i) {
+            rxbuf[i] = jedec_id[i - 1];
+        }
+    }
+}
+
+
+//
+// GPIO
+//
+
+void gpio_init(uint gpio) {
+    gpio_set_dir(gpio, GPIO_IN);
+    gpio_put(gpio, 0);
+    gpio_set_function(gpio, GPIO_FUNC_SIO);
+}
+
+
+void gpio_set_function(uint gpio, enum gpio_function fn) {
+    fake_gpio.function[gpio] = fn;
+}
+
+
+enum gpio_function gpio_get_function(uint gpio) {
+    return fake_gpio.function[gpio];
+}
+
+
+void gpio_set_outover(uint gpio, uint value) {
+    fake_gpio.outover[gpio] = value;
+}
+
+
+void gpio_set_pulls(uint gpio, bool up, bool down) {
+    fake_gpio.pull_up[gpio] = up;
+    fake_gpio.pull_down[gpio] = down;
+}
+
+
+void gpio_pull_up(uint gpio) {
+    gpio_set_pulls(gpio, true, false);
+}
+
+
+void gpio_pull_down(uint gpio) {
+    gpio_set_pulls(gpio, false, true);
+}
+
+
+void gpio_disable_pulls(uint gpio) {
+    gpio_set_pulls(gpio, false, false);
+}
+
+
+void gpio_set_dir(uint gpio, bool out) {
+    gpio_set_dir_masked(1u << gpio, out ? (1u << gpio) : 0);
+}
+
+
+void gpio_set_dir_masked(uint32_t mask, uint32_t value) {
+    fake_gpio.oe = (fake_gpio.oe & ~mask) | (value & mask);
+}
+
+
+void gpio_set_dir_out_masked(uint32_t mask) {
+    fake_gpio.oe |= mask;
+}
+
+
+void gpio_set_dir_in_masked(uint32_t mask) {
+    fake_gpio.oe &= ~mask;
+}
+
+
+void gpio_put(uint gpio, bool value) {
+    gpio_put_masked(1u << gpio, value ? (1u << gpio) : 0);
+}
+
+
+void gpio_put_masked(uint32_t mask, uint32_t value) {
+    fake_gpio.out = (fake_gpio.out & ~mask) | (value & mask);
+}
+
+
+void gpio_put_all(uint32_t value) {
+    fake_gpio.out = value;
+}
+
+
+void gpio_set_mask(uint32_t mask) {
+    fake_gpio.out |= mask;
+}
+
+
+void gpio_clr_mask(uint32_t mask) {
+    fake_gpio.out &= ~mask;
+}
+
+
+void gpio_xor_mask(uint32_t mask) {
+    fake_gpio.out ^= mask;
+}
+
+
+bool gpio_get(uint gpio) {
+    return (gpio_get_all() >> gpio) & 0x1;
+}
+
+
+uint32_t gpio_get_all(void) {
+    return (fake_gpio.in & ~fake_gpio.oe) | (fake_gpio.out & fake_gpio.oe);
+}
+
+
+//
+// DMA
+//
+
+int dma_claim_unused_channel(bool required) {
+    for (int i = 0; i < NUM_DMA_CHANNELS; ++i) {
+        if (!fake_dma[i].claimed) {
+            fake_dma[i].claimed = true;
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+dma_channel_config dma_channel_get_default_config(uint channel) {
+    dma_channel_config c = {
+        .size = DMA_SIZE_32,
+        .read_increment = true,
+        .write_increment = false,
+        .ring_write = false,
+        .ring_size_bits = 0,
+        .dreq = DREQ_FORCE,
+        .chain_to = channel,
+    };
+    return c;
+}
+
+
+void channel_config_set_transfer_data_size(dma_channel_config * c, enum dma_channel_transfer_size size) {
+    c->size = size;
+}
+
+
+void channel_config_set_read_increment(dma_channel_config * c, bool incr) {
+    c->read_increment = incr;
+}
+
+
+void channel_config_set_write_increment(dma_channel_config * c, bool incr) {
+    c->write_increment = incr;
+}
+
+
+void channel_config_set_ring(dma_channel_config * c, bool write, uint size_bits) {
+    c->ring_write = write;
+    c->ring_size_bits = size_bits;
+}
+
+
+void channel_config_set_dreq(dma_channel_config * c, uint dreq) {
+    c->dreq = dreq;
+}
+
+
+void channel_config_set_chain_to(dma_channel_config * c, uint chain_to) {
+    c->chain_to = chain_to;
+}
+
+
+static void fake_dma_trigger(uint channel) {
+    if (fake_dma[channel].busy) {
+        return;
+    }
+    fake_dma[channel].busy = true;
+    dma_hw->ch[channel].transfer_count = fake_dma[channel].trans_count;
+    if (fake_dma[channel].config.dreq == DREQ_FORCE) {
+        fake_dma_transfer(channel, UINT32_MAX);
+    }
+}
+
+
+void dma_channel_set_config(uint channel, dma_channel_config const * config, bool trigger) {
+    fake_dma[channel].config = *config;
+    hw_write_masked(&dma_hw->ch[channel].al1_ctrl, config->chain_to << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB, DMA_CH0_CTRL_TRIG_CHAIN_TO_BITS);
+    if (trigger) {
+        fake_dma_trigger(channel);
+    }
+}
+
+
+void dma_channel_set_read_addr(uint channel, void const volatile * read_addr, bool trigger) {
+    dma_hw->ch[channel].read_addr = (uintptr_t)read_addr;
+    if (trigger) {
+        fake_dma_trigger(channel);
+    }
+}
+
+
+void dma_channel_set_write_addr(uint channel, void volatile * write_addr, bool trigger) {
+    dma_hw->ch[channel].write_addr = (uintptr_t)write_addr;
+    if (trigger) {
+        fake_dma_trigger(channel);
+    }
+}
+
+
+void dma_channel_set_trans_count(uint channel, uint32_t trans_count, bool trigger) {
+    fake_dma[channel].trans_count = trans_count;
+    if (trigger) {
+        fake_dma_trigger(channel);
+    }
+}
+
+
+void dma_channel_configure(uint channel, dma_channel_config const * config, void volatile * write_addr, void const volatile * read_addr, uint transfer_count, bool trigger) {
+    dma_channel_set_config(channel, config, false);
+    dma_channel_set_write_addr(channel, write_addr, false);
+    dma_channel_set_read_addr(channel, read_addr, false);
+    dma_channel_set_trans_count(channel, transfer_count, trigger);
+}
+
+
+void dma_start_channel_mask(uint32_t chan_mask) {
+    for (uint i = 0; i < NUM_DMA_CHANNELS; ++i) {
+        if (chan_mask & (1u << i)) {
+            fake_dma_trigger(i);
+        }
+    }
+}
+
+
+void dma_channel_abort(uint channel) {
+    fake_dma[channel].busy = false;
+}
+
+
+bool dma_channel_is_busy(uint channel) {
+    return fake_dma[channel].busy;
+}
+
+
+// The next address after `addr`, wrapping in the ring if `ring_bits`
+// is non-zero.
+static uintptr_t fake_dma_next_addr(uintptr_t addr, uint size, uint ring_bits) {
+    uintptr_t next = addr + size;
+    if (ring_bits > 0) {
+        uintptr_t mask = ((uintptr_t)1 << ring_bits) - 1;
+        next = (addr & ~mask) | (next & mask);
+    }
+    return next;
+}
+
+
+// The channel whose AL3_READ_ADDR_TRIG is at `addr`, or -1.
+static int fake_dma_read_addr_trig(uintptr_t addr) {
+    for (int i = 0; i < NUM_DMA_CHANNELS; ++i) {
+        if (addr == (uintptr_t)&dma_hw->ch[i].al3_read_addr_trig) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+void fake_dma_transfer(unsigned int channel, uint32_t count) {
+    dma_channel_hw_t * hw = &dma_hw->ch[channel];
+
+    while ((count > 0) && fake_dma[channel].busy) {
+        dma_channel_config const * c = &fake_dma[channel].config;
+        uint size = 1u << c->size;
+
+        uint32_t data = 0;
+        memcpy(&data, (void const *)hw->read_addr, size);
+        int read_addr_trig = fake_dma_read_addr_trig(hw->write_addr);
+        if (hw->write_addr == (uintptr_t)&dma_hw->multi_channel_trigger) {
+            dma_start_channel_mask(data);
+        } else if (read_addr_trig >= 0) {
+            dma_channel_set_read_addr(read_addr_trig, *(void const * const *)hw->read_addr, true);
+        } else {
+            memcpy((void *)hw->write_addr, &data, size);
+        }
+
+        if (c->read_increment) {
+            hw->read_addr = fake_dma_next_addr(hw->read_addr, size, c->ring_write ? 0 : c->ring_size_bits);
+        }
+        if (c->write_increment) {
+            hw->write_addr = fake_dma_next_addr(hw->write_addr, size, c->ring_write ? c->ring_size_bits : 0);
+        }
+
+        --count;
+        if (--hw->transfer_count == 0) {
+            fake_dma[channel].busy = false;
+            uint chain_to = (hw->al1_ctrl & DMA_CH0_CTRL_TRIG_CHAIN_TO_BITS) >> DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB;
+            if (chain_to != channel) {
+                fake_dma_trigger(chain_to);
+            }
+        }
+    }
+}
+
+
+//
+// PIO
+//
+
+static uint fake_pio_index(PIO pio) {
+    return (pio == pio0) ? 0 : 1;
+}
+
+
+bool pio_can_add_program(PIO pio, pio_program_t const * program) {
+    return (fake_pio[fake_pio_index(pio)].instructions_used + program->length) <= PIO_INSTRUCTION_COUNT;
+}
+
+
+uint pio_add_program(PIO pio, pio_program_t const * program) {
+    uint offset = fake_pio[fake_pio_index(pio)].instructions_used;
+    fake_pio[fake_pio_index(pio)].instructions_used += program->length;
+    return offset;
+}
+
+
+bool pio_can_add_program_at_offset(PIO pio, pio_program_t const * program, uint offset) {
+    return fake_pio[fake_pio_index(pio)].instructions_used <= offset;
+}
+
+
+void pio_add_program_at_offset(PIO pio, pio_program_t const * program, uint offset) {
+    fake_pio[fake_pio_index(pio)].instructions_used = offset + program->length;
+}
+
+
+int pio_claim_unused_sm(PIO pio, bool required) {
+    for (int sm = 0; sm < NUM_PIO_STATE_MACHINES; ++sm) {
+        if (!(fake_pio[fake_pio_index(pio)].sm_claimed & (1u << sm))) {
+            fake_pio[fake_pio_index(pio)].sm_claimed |= 1u << sm;
+            return sm;
+        }
+    }
+    return -1;
+}
+
+
+void pio_sm_set_enabled(PIO pio, uint sm, bool enabled) {
+    if (enabled) {
+        pio->ctrl |= 1u << sm;
+    } else {
+        pio->ctrl &= ~(1u << sm);
+    }
+}
+
+
+void pio_enable_sm_mask_in_sync(PIO pio, uint32_t mask) {
+    pio->ctrl |= mask;
+}
+
+
+void pio_sm_set_clkdiv_int_frac(PIO pio, uint sm, uint16_t div_int, uint8_t div_frac) {
+    pio->sm[sm].clkdiv = ((uint32_t)div_int << PIO_SM0_CLKDIV_INT_LSB) | ((uint32_t)div_frac << PIO_SM0_CLKDIV_FRAC_LSB);
+}
+
+
+void pio_sm_clear_fifos(PIO pio, uint sm) {
+    fake_pio_tx_fifo[pio_get_index(pio)][sm].level = 0;
+    pio->rxf[sm] = 0;
+}
+
+
+void pio_sm_restart(PIO pio, uint sm) {
+}
+
+
+uint pio_sm_get_tx_fifo_level(PIO pio, uint sm) {
+    return fake_pio_tx_fifo[pio_get_index(pio)][sm].level;
+}
+
+
+bool pio_sm_is_tx_fifo_full(PIO pio, uint sm) {
+    return pio_sm_get_tx_fifo_level(pio, sm) == FAKE_PIO_TX_FIFO_DEPTH;
+}
+
+
+bool pio_sm_is_tx_fifo_empty(PIO pio, uint sm) {
+    return pio_sm_get_tx_fifo_level(pio, sm) == 0;
+}
+
+
+// Like the real one, a word put in a full FIFO is lost.
+void pio_sm_put(PIO pio, uint sm, uint32_t data) {
+    fake_pio_fifo_t * f = &fake_pio_tx_fifo[pio_get_index(pio)][sm];
+    if (f->level < FAKE_PIO_TX_FIFO_DEPTH) {
+        f->word[f->level++] = data;
+    }
+}
+
+
+bool fake_pio_tx_pop(unsigned int pio_index, unsigned int sm, uint32_t * word) {
+    fake_pio_fifo_t * f = &fake_pio_tx_fifo[pio_index][sm];
+    if (f->level == 0) {
+        return false;
+    }
+    *word = f->word[0];
+    memmove(&f->word[0], &f->word[1], --f->level * sizeof(f->word[0]));
+    return true;
+}
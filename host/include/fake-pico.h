@@ -0,0 +1,97 @@
+#ifndef FAKE_PICO_H
+#define FAKE_PICO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+//
+// State of the fake RP2040 peripherals used by the host build, so tests
+// can poke inputs and inspect outputs.
+//
+
+#define FAKE_NUM_GPIOS 30
+
+typedef struct {
+    // The function selected for each pin, see `enum gpio_function`.
+    uint8_t function[FAKE_NUM_GPIOS];
+
+    // The output override of each pin, see `enum gpio_override`.
+    uint8_t outover[FAKE_NUM_GPIOS];
+
+    // Pull-up/pull-down state of each pin.
+    bool pull_up[FAKE_NUM_GPIOS];
+    bool pull_down[FAKE_NUM_GPIOS];
+
+    // Bitmaps of the SIO output-enable and output-value registers.
+    uint32_t oe;
+    uint32_t out;
+
+    // Bitmap of the levels driven onto the pins from outside the chip.
+    // Pins that are outputs read back their output value instead.
+    uint32_t in;
+} fake_gpio_t;
+
+extern fake_gpio_t fake_gpio;
+
+// While this is non-zero, time_us_64() returns it instead of the
+// host's clock, so tests can step time.
+extern uint64_t fake_time_us;
+
+
+// The RP2040 watchdog.
+typedef struct {
+    bool enabled;
+    uint32_t updates;
+
+    // What watchdog_caused_reboot() says.
+    bool caused_reboot;
+
+    // Whether watchdog_reboot() was called.
+    bool rebooted;
+} fake_watchdog_t;
+
+extern fake_watchdog_t fake_watchdog;
+
+
+// The NVIC priority of each interrupt, 0 is the highest.
+#define FAKE_NUM_IRQS 32
+
+extern uint8_t fake_irq_priority[FAKE_NUM_IRQS];
+
+
+// Make DMA channel `channel` do up to `count` transfers, as its DREQ
+// would, or fewer if it stops.  When it runs out it triggers the
+// channel it's chained to.  Channels paced by DREQ_FORCE don't need
+// this, they run to the end as soon as they're triggered.
+void fake_dma_transfer(unsigned int channel, uint32_t count);
+
+
+// The words pio_sm_put() has put in each PIO state machine's TX FIFO,
+// oldest first, by pio_get_index() and state machine.  Tests take them
+// out with fake_pio_tx_pop(), as the state machine would.
+#define FAKE_PIO_TX_FIFO_DEPTH 4
+
+typedef struct {
+    uint32_t word[FAKE_PIO_TX_FIFO_DEPTH];
+    unsigned int level;
+} fake_pio_fifo_t;
+
+extern fake_pio_fifo_t fake_pio_tx_fifo[2][4];
+
+// Take the oldest word out of a TX FIFO, false if it's empty.
+bool fake_pio_tx_pop(unsigned int pio_index, unsigned int sm, uint32_t * word);
+
+
+// Reset all the fake peripherals to their power-on state.
+void fake_pico_reset(void);
+
+// Run the callbacks of the hardware alarms whose target time has come,
+// and disarm them.
+void fake_pico_run_alarms(void);
+
+// Run the callbacks of all the repeating timers, once.
+void fake_pico_run_repeating_timers(void);
+
+
+#endif // FAKE_PICO_H
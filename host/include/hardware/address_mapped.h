@@ -0,0 +1,24 @@
+#ifndef _HARDWARE_ADDRESS_MAPPED_H
+#define _HARDWARE_ADDRESS_MAPPED_H
+
+// Host build stand-in for the Pico SDK's hardware/address_mapped.h.
+// The RP2040's atomic set, clear and XOR register aliases are plain
+// read-modify-writes here.
+
+#include <stdint.h>
+
+
+static inline void hw_set_bits(uint32_t volatile * addr, uint32_t mask) {
+    *addr |= mask;
+}
+
+static inline void hw_clear_bits(uint32_t volatile * addr, uint32_t mask) {
+    *addr &= ~mask;
+}
+
+static inline void hw_write_masked(uint32_t volatile * addr, uint32_t values, uint32_t write_mask) {
+    *addr = (*addr & ~write_mask) | (values & write_mask);
+}
+
+
+#endif // _HARDWARE_ADDRESS_MAPPED_H
@@ -0,0 +1,90 @@
+#ifndef _HARDWARE_DMA_H
+#define _HARDWARE_DMA_H
+
+// Host build stand-in for the Pico SDK's hardware/dma.h.  Nothing moves
+// on its own: tests call fake_dma_transfer() (see fake-pico.h) to make
+// a channel do transfers.  The address registers are full host
+// pointers, so a DMA write to a channel's AL3_READ_ADDR_TRIG moves a
+// whole pointer, whatever the transfer size.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hardware/address_mapped.h"
+#include "hardware/gpio.h"
+
+
+#define NUM_DMA_CHANNELS 12
+
+#define DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB  11
+#define DMA_CH0_CTRL_TRIG_CHAIN_TO_BITS 0x00007800
+
+#define DREQ_PIO0_TX0    0
+#define DREQ_PIO0_RX0    4
+#define DREQ_PIO1_TX0    8
+#define DREQ_PIO1_RX0   12
+#define DREQ_PWM_WRAP0  24
+#define DREQ_FORCE      63
+
+enum dma_channel_transfer_size {
+    DMA_SIZE_8 = 0,
+    DMA_SIZE_16 = 1,
+    DMA_SIZE_32 = 2,
+};
+
+typedef struct {
+    uintptr_t volatile read_addr;
+    uintptr_t volatile write_addr;
+    uint32_t volatile transfer_count;
+    uint32_t volatile al1_ctrl;
+    uintptr_t volatile al3_read_addr_trig;
+} dma_channel_hw_t;
+
+typedef struct {
+    dma_channel_hw_t ch[NUM_DMA_CHANNELS];
+    uint32_t volatile multi_channel_trigger;
+} dma_hw_t;
+
+extern dma_hw_t * const dma_hw;
+
+typedef struct {
+    enum dma_channel_transfer_size size;
+    bool read_increment;
+    bool write_increment;
+    bool ring_write;
+    uint ring_size_bits;
+    uint dreq;
+    uint chain_to;
+} dma_channel_config;
+
+
+int dma_claim_unused_channel(bool required);
+
+dma_channel_config dma_channel_get_default_config(uint channel);
+void channel_config_set_transfer_data_size(dma_channel_config * c, enum dma_channel_transfer_size size);
+void channel_config_set_read_increment(dma_channel_config * c, bool incr);
+void channel_config_set_write_increment(dma_channel_config * c, bool incr);
+void channel_config_set_ring(dma_channel_config * c, bool write, uint size_bits);
+void channel_config_set_dreq(dma_channel_config * c, uint dreq);
+void channel_config_set_chain_to(dma_channel_config * c, uint chain_to);
+
+void dma_channel_set_config(uint channel, dma_channel_config const * config, bool trigger);
+void dma_channel_set_read_addr(uint channel, void const volatile * read_addr, bool trigger);
+void dma_channel_set_write_addr(uint channel, void volatile * write_addr, bool trigger);
+void dma_channel_set_trans_count(uint channel, uint32_t trans_count, bool trigger);
+void dma_channel_configure(uint channel, dma_channel_config const * config, void volatile * write_addr, void const volatile * read_addr, uint transfer_count, bool trigger);
+void dma_start_channel_mask(uint32_t chan_mask);
+void dma_channel_abort(uint channel);
+bool dma_channel_is_busy(uint channel);
+
+static inline dma_channel_hw_t * dma_channel_hw_addr(uint channel) {
+    return &dma_hw->ch[channel];
+}
+
+
+static inline void dma_channel_start(uint channel) {
+    dma_start_channel_mask(1u << channel);
+}
+
+
+#endif // _HARDWARE_DMA_H
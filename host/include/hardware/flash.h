@@ -0,0 +1,32 @@
+#ifndef _HARDWARE_FLASH_H
+#define _HARDWARE_FLASH_H
+
+// Host build stand-in for the Pico SDK's hardware/flash.h.  The flash
+// is `fake_flash`, which is also what XIP_BASE maps.  Erasing sets
+// bytes to 0xff and programming can only clear bits, as on the chip.
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#ifndef PICO_FLASH_SIZE_BYTES
+#define PICO_FLASH_SIZE_BYTES (2 * 1024 * 1024)
+#endif
+
+#define FLASH_PAGE_SIZE   (1u << 8)
+#define FLASH_SECTOR_SIZE (1u << 12)
+#define FLASH_BLOCK_SIZE  (1u << 16)
+
+extern uint8_t fake_flash[PICO_FLASH_SIZE_BYTES];
+
+#define XIP_BASE ((uintptr_t)fake_flash)
+
+void flash_range_erase(uint32_t flash_offs, size_t count);
+void flash_range_program(uint32_t flash_offs, uint8_t const * data, size_t count);
+
+// Only knows the JEDEC ID command (0x9f), which reads 0xef, 0x40, 0x15:
+// the 16 Mbit chip on the W5500-EVB-Pico.
+void flash_do_cmd(uint8_t const * txbuf, uint8_t * rxbuf, size_t count);
+
+
+#endif // _HARDWARE_FLASH_H
@@ -0,0 +1,66 @@
+#ifndef _HARDWARE_GPIO_H
+#define _HARDWARE_GPIO_H
+
+// Host build stand-in for the Pico SDK's hardware/gpio.h, backed by
+// the memory in `fake_gpio`.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fake-pico.h"
+
+
+typedef unsigned int uint;
+
+enum gpio_function {
+    GPIO_FUNC_XIP = 0,
+    GPIO_FUNC_SPI = 1,
+    GPIO_FUNC_UART = 2,
+    GPIO_FUNC_I2C = 3,
+    GPIO_FUNC_PWM = 4,
+    GPIO_FUNC_SIO = 5,
+    GPIO_FUNC_PIO0 = 6,
+    GPIO_FUNC_PIO1 = 7,
+    GPIO_FUNC_GPCK = 8,
+    GPIO_FUNC_USB = 9,
+    GPIO_FUNC_NULL = 0x1f,
+};
+
+enum gpio_override {
+    GPIO_OVERRIDE_NORMAL = 0,
+    GPIO_OVERRIDE_INVERT = 1,
+    GPIO_OVERRIDE_LOW = 2,
+    GPIO_OVERRIDE_HIGH = 3,
+};
+
+#define GPIO_OUT 1
+#define GPIO_IN 0
+
+
+void gpio_init(uint gpio);
+void gpio_set_function(uint gpio, enum gpio_function fn);
+enum gpio_function gpio_get_function(uint gpio);
+void gpio_set_outover(uint gpio, uint value);
+
+void gpio_set_pulls(uint gpio, bool up, bool down);
+void gpio_pull_up(uint gpio);
+void gpio_pull_down(uint gpio);
+void gpio_disable_pulls(uint gpio);
+
+void gpio_set_dir(uint gpio, bool out);
+void gpio_set_dir_masked(uint32_t mask, uint32_t value);
+void gpio_set_dir_out_masked(uint32_t mask);
+void gpio_set_dir_in_masked(uint32_t mask);
+
+void gpio_put(uint gpio, bool value);
+void gpio_put_masked(uint32_t mask, uint32_t value);
+void gpio_put_all(uint32_t value);
+void gpio_set_mask(uint32_t mask);
+void gpio_clr_mask(uint32_t mask);
+void gpio_xor_mask(uint32_t mask);
+
+bool gpio_get(uint gpio);
+uint32_t gpio_get_all(void);
+
+
+#endif // _HARDWARE_GPIO_H
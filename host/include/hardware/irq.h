@@ -0,0 +1,26 @@
+#ifndef _HARDWARE_IRQ_H
+#define _HARDWARE_IRQ_H
+
+// Host build stand-in for the Pico SDK's hardware/irq.h.  Nothing
+// interrupts anything, the priorities are just recorded in
+// fake_irq_priority[] (see fake-pico.h) for tests to check.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+#define TIMER_IRQ_0   0
+#define TIMER_IRQ_1   1
+#define TIMER_IRQ_2   2
+#define TIMER_IRQ_3   3
+#define IO_IRQ_BANK0 13
+
+#define PICO_HIGHEST_IRQ_PRIORITY 0x00
+#define PICO_DEFAULT_IRQ_PRIORITY 0x80
+#define PICO_LOWEST_IRQ_PRIORITY  0xff
+
+void irq_set_priority(unsigned int num, uint8_t hardware_priority);
+void irq_set_enabled(unsigned int num, bool enabled);
+
+
+#endif // _HARDWARE_IRQ_H
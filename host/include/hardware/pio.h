@@ -0,0 +1,77 @@
+#ifndef _HARDWARE_PIO_H
+#define _HARDWARE_PIO_H
+
+// Host build stand-in for the Pico SDK's hardware/pio.h.  The state
+// machines run nothing, their FIFO registers are plain memory for the
+// DMA (see fake_dma_transfer() in fake-pico.h) and the tests.  What
+// pio_sm_put() writes goes in `fake_pio_tx_fifo` instead.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hardware/dma.h"
+#include "hardware/gpio.h"
+
+
+#define NUM_PIO_STATE_MACHINES 4
+#define PIO_INSTRUCTION_COUNT  32
+
+#define PIO_FDEBUG_RXSTALL_LSB 0
+
+#define PIO_SM0_CLKDIV_INT_LSB  16
+#define PIO_SM0_CLKDIV_FRAC_LSB 8
+
+typedef struct {
+    uint32_t volatile clkdiv;
+} pio_sm_hw_t;
+
+typedef struct {
+    uint32_t volatile ctrl;
+    uint32_t volatile fdebug;
+    uint32_t volatile txf[NUM_PIO_STATE_MACHINES];
+    uint32_t volatile rxf[NUM_PIO_STATE_MACHINES];
+    pio_sm_hw_t sm[NUM_PIO_STATE_MACHINES];
+} pio_hw_t;
+
+typedef pio_hw_t * PIO;
+
+extern pio_hw_t * const pio0_hw;
+extern pio_hw_t * const pio1_hw;
+
+#define pio0 pio0_hw
+#define pio1 pio1_hw
+
+typedef struct {
+    uint16_t const * instructions;
+    uint8_t length;
+    int8_t origin;
+} pio_program_t;
+
+
+bool pio_can_add_program(PIO pio, pio_program_t const * program);
+uint pio_add_program(PIO pio, pio_program_t const * program);
+bool pio_can_add_program_at_offset(PIO pio, pio_program_t const * program, uint offset);
+void pio_add_program_at_offset(PIO pio, pio_program_t const * program, uint offset);
+
+int pio_claim_unused_sm(PIO pio, bool required);
+void pio_sm_set_enabled(PIO pio, uint sm, bool enabled);
+void pio_enable_sm_mask_in_sync(PIO pio, uint32_t mask);
+void pio_sm_set_clkdiv_int_frac(PIO pio, uint sm, uint16_t div_int, uint8_t div_frac);
+void pio_sm_clear_fifos(PIO pio, uint sm);
+void pio_sm_restart(PIO pio, uint sm);
+
+uint pio_sm_get_tx_fifo_level(PIO pio, uint sm);
+bool pio_sm_is_tx_fifo_full(PIO pio, uint sm);
+bool pio_sm_is_tx_fifo_empty(PIO pio, uint sm);
+void pio_sm_put(PIO pio, uint sm, uint32_t data);
+
+static inline uint pio_get_index(PIO pio) {
+    return (pio == pio0) ? 0 : 1;
+}
+
+static inline uint pio_get_dreq(PIO pio, uint sm, bool is_tx) {
+    return ((pio == pio0) ? DREQ_PIO0_TX0 : DREQ_PIO1_TX0) + (is_tx ? 0 : NUM_PIO_STATE_MACHINES) + sm;
+}
+
+
+#endif // _HARDWARE_PIO_H
@@ -0,0 +1,97 @@
+#ifndef _HARDWARE_PWM_H
+#define _HARDWARE_PWM_H
+
+// Host build stand-in for the Pico SDK's hardware/pwm.h.  The slices'
+// registers are plain memory, nothing counts: tests check what the
+// firmware programmed, and the DMA writes the CC registers when a test
+// calls fake_dma_transfer().
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hardware/gpio.h"
+
+
+#define NUM_PWM_SLICES 8
+
+#define PWM_CH0_CSR_EN_BITS         0x00000001
+#define PWM_CH0_CSR_PH_CORRECT_BITS 0x00000002
+#define PWM_CH0_DIV_INT_LSB         4
+
+enum pwm_chan {
+    PWM_CHAN_A = 0,
+    PWM_CHAN_B = 1,
+};
+
+typedef struct {
+    uint32_t volatile csr;
+    uint32_t volatile div;
+    uint32_t volatile ctr;
+    uint32_t volatile cc;
+    uint32_t volatile top;
+} pwm_slice_hw_t;
+
+typedef struct {
+    pwm_slice_hw_t slice[NUM_PWM_SLICES];
+} pwm_hw_t;
+
+extern pwm_hw_t * const pwm_hw;
+
+typedef struct {
+    uint32_t csr;
+    uint32_t div;
+    uint32_t top;
+} pwm_config;
+
+
+static inline uint pwm_gpio_to_slice_num(uint gpio) {
+    return (gpio >> 1) & 0x7;
+}
+
+
+static inline uint pwm_gpio_to_channel(uint gpio) {
+    return gpio & 0x1;
+}
+
+
+static inline pwm_config pwm_get_default_config(void) {
+    pwm_config c = {
+        .csr = 0,
+        .div = 1 << PWM_CH0_DIV_INT_LSB,
+        .top = 0xffff,
+    };
+    return c;
+}
+
+
+static inline void pwm_init(uint slice_num, pwm_config * c, bool start) {
+    pwm_hw->slice[slice_num].csr = 0;
+    pwm_hw->slice[slice_num].ctr = 0;
+    pwm_hw->slice[slice_num].cc = 0;
+    pwm_hw->slice[slice_num].top = c->top;
+    pwm_hw->slice[slice_num].div = c->div;
+    pwm_hw->slice[slice_num].csr = c->csr | (start ? PWM_CH0_CSR_EN_BITS : 0);
+}
+
+
+static inline void pwm_set_enabled(uint slice_num, bool enabled) {
+    pwm_hw->slice[slice_num].csr = (pwm_hw->slice[slice_num].csr & ~PWM_CH0_CSR_EN_BITS) | (enabled ? PWM_CH0_CSR_EN_BITS : 0);
+}
+
+
+static inline void pwm_set_phase_correct(uint slice_num, bool phase_correct) {
+    pwm_hw->slice[slice_num].csr = (pwm_hw->slice[slice_num].csr & ~PWM_CH0_CSR_PH_CORRECT_BITS) | (phase_correct ? PWM_CH0_CSR_PH_CORRECT_BITS : 0);
+}
+
+
+static inline void pwm_set_clkdiv_int_frac(uint slice_num, uint8_t integer, uint8_t fract) {
+    pwm_hw->slice[slice_num].div = (((uint32_t)integer) << PWM_CH0_DIV_INT_LSB) | (fract & 0xf);
+}
+
+
+static inline void pwm_set_wrap(uint slice_num, uint16_t wrap) {
+    pwm_hw->slice[slice_num].top = wrap;
+}
+
+
+#endif // _HARDWARE_PWM_H
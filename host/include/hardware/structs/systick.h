@@ -0,0 +1,23 @@
+#ifndef _HARDWARE_STRUCTS_SYSTICK_H
+#define _HARDWARE_STRUCTS_SYSTICK_H
+
+// Host build stand-in for the Pico SDK's hardware/structs/systick.h.
+// The fake SysTick doesn't count, so all profiled times are 0.
+
+#include <stdint.h>
+
+
+typedef struct {
+    volatile uint32_t csr;
+    volatile uint32_t rvr;
+    volatile uint32_t cvr;
+    volatile uint32_t calib;
+} systick_hw_t;
+
+extern systick_hw_t * const systick_hw;
+
+#define M0PLUS_SYST_CSR_ENABLE_BITS    0x00000001u
+#define M0PLUS_SYST_CSR_CLKSOURCE_BITS 0x00000004u
+
+
+#endif // _HARDWARE_STRUCTS_SYSTICK_H
@@ -0,0 +1,30 @@
+#ifndef _HARDWARE_SYNC_H
+#define _HARDWARE_SYNC_H
+
+// Host build stand-in for the Pico SDK's hardware/sync.h.
+
+#include <stdint.h>
+
+
+static inline void __dmb(void) {
+    __sync_synchronize();
+}
+
+static inline void __sev(void) {
+}
+
+static inline void __wfe(void) {
+}
+
+static inline void __wfi(void) {
+}
+
+static inline uint32_t save_and_disable_interrupts(void) {
+    return 0;
+}
+
+static inline void restore_interrupts(uint32_t status) {
+}
+
+
+#endif // _HARDWARE_SYNC_H
@@ -0,0 +1,29 @@
+#ifndef _HARDWARE_TIMER_H
+#define _HARDWARE_TIMER_H
+
+// Host build stand-in for the Pico SDK's hardware/timer.h.  The
+// microsecond timer is the host's monotonic clock (or fake_time_us).
+// Alarms only fire when tests call fake_pico_run_alarms().
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+typedef void (*hardware_alarm_callback_t)(unsigned int alarm_num);
+
+uint64_t time_us_64(void);
+
+static inline uint32_t time_us_32(void) {
+    return (uint32_t)time_us_64();
+}
+
+// While fake_time_us is set, this moves it on instead of waiting.
+void busy_wait_us_32(uint32_t delay_us);
+
+int hardware_alarm_claim_unused(bool required);
+void hardware_alarm_set_callback(unsigned int alarm_num, hardware_alarm_callback_t callback);
+bool hardware_alarm_set_target(unsigned int alarm_num, uint64_t target);
+void hardware_alarm_cancel(unsigned int alarm_num);
+
+
+#endif // _HARDWARE_TIMER_H
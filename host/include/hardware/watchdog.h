@@ -0,0 +1,33 @@
+#ifndef _HARDWARE_WATCHDOG_H
+#define _HARDWARE_WATCHDOG_H
+
+// Host build stand-in for the Pico SDK's hardware/watchdog.h.  It never
+// resets anything, see fake_watchdog in fake-pico.h.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hardware/address_mapped.h"
+
+
+typedef struct {
+    uint32_t volatile ctrl;
+    uint32_t volatile load;
+    uint32_t volatile reason;
+    uint32_t volatile scratch[8];
+} watchdog_hw_t;
+
+#define WATCHDOG_CTRL_ENABLE_BITS 0x40000000
+
+extern watchdog_hw_t * const watchdog_hw;
+
+void watchdog_enable(uint32_t delay_ms, bool pause_on_debug);
+void watchdog_update(void);
+bool watchdog_caused_reboot(void);
+
+// Sets fake_watchdog.rebooted, and returns (the firmware never expects
+// it to).
+void watchdog_reboot(uint32_t pc, uint32_t sp, uint32_t delay_ms);
+
+
+#endif // _HARDWARE_WATCHDOG_H
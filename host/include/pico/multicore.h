@@ -0,0 +1,11 @@
+#ifndef _PICO_MULTICORE_H
+#define _PICO_MULTICORE_H
+
+// Host build stand-in for the Pico SDK's pico/multicore.h.  There is
+// no core 1, tests run its side themselves.
+
+
+void multicore_reset_core1(void);
+
+
+#endif // _PICO_MULTICORE_H
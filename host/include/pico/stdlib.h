@@ -0,0 +1,70 @@
+#ifndef _PICO_STDLIB_H
+#define _PICO_STDLIB_H
+
+// Host build stand-in for the Pico SDK's pico/stdlib.h.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hardware/gpio.h"
+#include "hardware/timer.h"
+
+
+#ifndef PICO_DEFAULT_LED_PIN
+#define PICO_DEFAULT_LED_PIN 25
+#endif
+
+#ifndef MIN
+#define MIN(a, b) (((b) < (a)) ? (b) : (a))
+#endif
+#ifndef MAX
+#define MAX(a, b) (((a) < (b)) ? (b) : (a))
+#endif
+
+#define __not_in_flash_func(func_name) func_name
+#define __time_critical_func(func_name) func_name
+
+
+typedef uint64_t absolute_time_t;
+
+static inline absolute_time_t from_us_since_boot(uint64_t us) {
+    return us;
+}
+
+static inline uint64_t to_us_since_boot(absolute_time_t t) {
+    return t;
+}
+
+static inline absolute_time_t get_absolute_time(void) {
+    return time_us_64();
+}
+
+// While fake_time_us is set, busy waits move it on instead of waiting.
+void busy_wait_until(absolute_time_t t);
+
+static inline void tight_loop_contents(void) {
+}
+
+typedef struct repeating_timer repeating_timer_t;
+typedef bool (*repeating_timer_callback_t)(repeating_timer_t * rt);
+
+struct repeating_timer {
+    int64_t delay_us;
+    repeating_timer_callback_t callback;
+    void * user_data;
+};
+
+// Repeating timers never fire on their own in the host build, tests
+// call fake_pico_run_repeating_timers().
+bool add_repeating_timer_ms(int32_t delay_ms, repeating_timer_callback_t callback, void * user_data, repeating_timer_t * out);
+
+// The host build doesn't really sleep, tests don't want to wait for
+// LEDs to blink.
+void sleep_ms(uint32_t ms);
+void sleep_us(uint64_t us);
+
+bool stdio_init_all(void);
+
+
+#endif // _PICO_STDLIB_H
@@ -0,0 +1,22 @@
+#ifndef _STEPGEN_PIO_H
+#define _STEPGEN_PIO_H
+
+// Host build stand-in for the header pioasm generates from stepgen.pio.
+// The program takes up room in the fake PIO, and does nothing.
+
+#include <stddef.h>
+
+#include "hardware/pio.h"
+
+
+static pio_program_t const stepgen_program = {
+    .instructions = NULL,
+    .length = 13,
+    .origin = -1,
+};
+
+static inline void stepgen_program_init(PIO pio, uint sm, uint offset, uint step_pin, uint dir_pin) {
+}
+
+
+#endif // _STEPGEN_PIO_H
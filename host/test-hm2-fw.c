@@ -0,0 +1,1605 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/flash.h"
+#include "hardware/irq.h"
+#include "hardware/pio.h"
+#include "hardware/pwm.h"
+#include "hardware/watchdog.h"
+
+#include "fake-pico.h"
+#include "hm2-fw.h"
+#include "hm2-fifo.h"
+#include "flash-update.h"
+#include "lbp16.h"
+
+
+// What fake-pico's clock_get_hz() says.
+#define HM2_SYS_CLOCK_HZ (125 * 1000 * 1000)
+
+// The fake time when the firmware starts, so the encoder's state
+// machines start at a known time.
+#define START_US (1000 * 1000)
+
+// The modules under test.
+#define HM2_MODULES(X) \
+    X(ioport,     IOPORT,     2) \
+    X(dpll,       DPLL,       1) \
+    X(watchdog,   WATCHDOG,   1) \
+    X(led,        LED,        1) \
+    X(profile,    PROFILE,    1) \
+    X(stepgen,    STEPGEN,    1) \
+    X(encoder,    ENCODER,    1) \
+    X(pwmgen,     PWMGEN,     1) \
+    X(capture,    CAPTURE,    1) \
+    X(pktuart_tx, PKTUART_TX, 1) \
+    X(pktuart_rx, PKTUART_RX, 1) \
+    X(testfifo,   TESTFIFO,   1) \
+    X(slow,       SLOW,       1) \
+    X(fast,       FAST,       1)
+
+#define HM2_PINS(P)                            \
+    P(0,  STEPGEN,    0, HM2_STEPGEN_STEP)     \
+    P(1,  STEPGEN,    0, HM2_STEPGEN_DIR)      \
+    P(2,  ENCODER,    0, HM2_ENCODER_A)        \
+    P(3,  ENCODER,    0, HM2_ENCODER_B)        \
+    P(4,  ENCODER,    0, HM2_ENCODER_INDEX)    \
+    P(6,  PWMGEN,     0, HM2_PWMGEN_OUT0)      \
+    P(7,  PWMGEN,     0, HM2_PWMGEN_OUT1)      \
+    P(10, PKTUART_TX, 0, HM2_PKTUART_TX_DATA)  \
+    P(11, PKTUART_RX, 0, HM2_PKTUART_RX_DATA)
+
+// A region of the tests' own, in space no real Module uses, with a
+// FIFO register at its start.
+#define HM2_TESTFIFO_ADDR 0x8000
+#define HM2_TESTFIFO_SIZE 0x0100
+#define HM2_TESTFIFO_MD(M, instances)
+
+// Two more, for the scheduler, which note when their update()s run.
+// The slow one comes first in the region table.
+#define HM2_SLOW_ADDR 0x8100
+#define HM2_SLOW_SIZE 0x0100
+#define HM2_SLOW_MD(M, instances)
+
+#define HM2_FAST_ADDR 0x8200
+#define HM2_FAST_SIZE 0x0100
+#define HM2_FAST_MD(M, instances)
+
+#include "hm2-registry.h"
+
+
+static int failures;
+
+
+static uint32_t testfifo_storage[4];
+static hm2_fifo_t testfifo = HM2_FIFO_INIT(testfifo_storage);
+
+
+// Writes push, reads pop (and read 0 when it's empty).
+static int testfifo_write(uint16_t addr, uint32_t const * buf, size_t num_uint32) {
+    for (size_t i = 0; i < num_uint32; ++i) {
+        hm2_fifo_push(&testfifo, buf[i]);
+    }
+    return 0;
+}
+
+
+static int testfifo_read(uint16_t addr, uint32_t * buf, size_t num_uint32) {
+    for (size_t i = 0; i < num_uint32; ++i) {
+        if (!hm2_fifo_pop(&testfifo, &buf[i])) {
+            buf[i] = 0;
+        }
+    }
+    return 0;
+}
+
+
+hm2_region_t const hm2_testfifo_region = {
+    .name = "testfifo",
+    .addr = HM2_TESTFIFO_ADDR,
+    .size = HM2_TESTFIFO_SIZE,
+    .write = testfifo_write,
+    .read = testfifo_read,
+};
+
+
+// The order the test regions' update()s ran in, 'S' for slow and 'F'
+// for fast.
+static char updates[16];
+static size_t num_updates;
+
+
+static void slow_update(void) {
+    if (num_updates < sizeof(updates) - 1) {
+        updates[num_updates++] = 'S';
+    }
+}
+
+
+static void fast_update(void) {
+    if (num_updates < sizeof(updates) - 1) {
+        updates[num_updates++] = 'F';
+    }
+}
+
+
+hm2_region_t const hm2_slow_region = {
+    .name = "slow",
+    .addr = HM2_SLOW_ADDR,
+    .size = HM2_SLOW_SIZE,
+    .update = slow_update,
+    .period_us = 1000,
+};
+
+
+hm2_region_t const hm2_fast_region = {
+    .name = "fast",
+    .addr = HM2_FAST_ADDR,
+    .size = HM2_FAST_SIZE,
+    .update = fast_update,
+    .period_us = 50,
+};
+
+#define CHECK(expr) \
+    do { \
+        if (!(expr)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+            ++failures; \
+        } \
+    } while (0)
+
+
+static uint32_t read_reg(uint16_t addr) {
+    uint32_t val;
+    hm2_fw_read(addr, &val, 1);
+    return val;
+}
+
+
+static void write_reg(uint16_t addr, uint32_t val) {
+    hm2_fw_write(addr, &val, 1);
+}
+
+
+static void test_page_table(void) {
+    CHECK(hm2_num_regions == 14);
+    CHECK(hm2_page_region[HM2_IOPORT_ADDR >> HM2_PAGE_SHIFT] == HM2_REGION_INDEX_IOPORT + 1);
+    CHECK(hm2_page_region[(HM2_IOPORT_ADDR + HM2_IOPORT_SIZE - 1) >> HM2_PAGE_SHIFT] == HM2_REGION_INDEX_IOPORT + 1);
+    CHECK(hm2_page_region[(HM2_IOPORT_ADDR + HM2_IOPORT_SIZE) >> HM2_PAGE_SHIFT] == 0);
+    CHECK(hm2_page_region[HM2_LED_ADDR >> HM2_PAGE_SHIFT] == HM2_REGION_INDEX_LED + 1);
+    CHECK(hm2_page_region[0x00] == 0);
+}
+
+
+static void test_idrom(void) {
+    char name[9] = { 0 };
+
+    CHECK(read_reg(0x0100) == 0x55aacafe);
+    hm2_fw_read(0x0104, (uint32_t *)name, 2);
+    CHECK(strcmp(name, "HOSTMOT2") == 0);
+    CHECK(read_reg(0x010c) == 0x0400);
+
+    // The IDROM is the image built from the module list.
+    CHECK(memcmp(&hm2_register_file[0x0400], &hm2_idrom, sizeof(hm2_idrom)) == 0);
+    CHECK(read_reg(0x0428) == clock_get_hz(clk_sys));
+
+    // Two ioports of 24 pins cover all the GPIOs.
+    CHECK(read_reg(0x041c) == 2);
+    CHECK(read_reg(0x0420) == 48);
+    CHECK(read_reg(0x0424) == 24);
+
+    // Only the ioport, dpll, watchdog, stepgen, encoder, pwmgen and
+    // pktuart regions are hostmot2 Modules.
+    CHECK(read_reg(0x0440) == (HM2_GTAG_IOPORT | (HM2_CLOCK_LOW_TAG << 16) | (2 << 24)));
+    CHECK(read_reg(0x0444) == (HM2_IOPORT_ADDR | (5 << 16)));
+    CHECK(read_reg(0x0448) == 0x1f);
+    CHECK(read_reg(0x044c) == (HM2_GTAG_HM2DPLL | (HM2_CLOCK_LOW_TAG << 16) | (1 << 24)));
+    CHECK(read_reg(0x0450) == (HM2_DPLL_ADDR | (7 << 16)));
+    CHECK(read_reg(0x0454) == 0x00);
+    CHECK(read_reg(0x0458) == (HM2_GTAG_WATCHDOG | (HM2_CLOCK_LOW_TAG << 16) | (1 << 24)));
+    CHECK(read_reg(0x045c) == (HM2_WATCHDOG_ADDR | (3 << 16)));
+    CHECK(read_reg(0x0464) == (HM2_GTAG_STEPGEN | (2 << 8) | (HM2_CLOCK_LOW_TAG << 16) | (1 << 24)));
+    CHECK(read_reg(0x0468) == (HM2_STEPGEN_ADDR | (10 << 16)));
+    CHECK(read_reg(0x046c) == 0x1ff);
+    CHECK(read_reg(0x0470) == (HM2_GTAG_ENCODER | (2 << 8) | (HM2_CLOCK_LOW_TAG << 16) | (1 << 24)));
+    CHECK(read_reg(0x0474) == (HM2_ENCODER_ADDR | (5 << 16)));
+    CHECK(read_reg(0x0478) == 0x03);
+    CHECK(read_reg(0x047c) == (HM2_GTAG_PWMGEN | (HM2_CLOCK_HIGH_TAG << 16) | (1 << 24)));
+    CHECK(read_reg(0x0480) == (HM2_PWMGEN_ADDR | (5 << 16)));
+    CHECK(read_reg(0x0484) == 0x03);
+    CHECK(read_reg(0x0488) == (HM2_GTAG_PKTUART_TX | (HM2_CLOCK_LOW_TAG << 16) | (1 << 24)));
+    CHECK(read_reg(0x048c) == (HM2_PKTUART_TX_ADDR | (4 << 16)));
+    CHECK(read_reg(0x0490) == 0x0f);
+    CHECK(read_reg(0x0494) == (HM2_GTAG_PKTUART_RX | (HM2_CLOCK_LOW_TAG << 16) | (1 << 24)));
+    CHECK(read_reg(0x0498) == (HM2_PKTUART_RX_ADDR | (4 << 16)));
+    CHECK(read_reg(0x049c) == 0x0f);
+    CHECK(hm2_register_file[0x04a0] == HM2_GTAG_END);
+
+    // Pin descriptors come from the pin map.
+    CHECK(read_reg(0x0600) == ((HM2_GTAG_IOPORT << 24) | (HM2_GTAG_STEPGEN << 8) | HM2_STEPGEN_STEP));
+    CHECK(read_reg(0x0604) == ((HM2_GTAG_IOPORT << 24) | (HM2_GTAG_STEPGEN << 8) | HM2_STEPGEN_DIR));
+    CHECK(read_reg(0x0608) == ((HM2_GTAG_IOPORT << 24) | (HM2_GTAG_ENCODER << 8) | HM2_ENCODER_A));
+    CHECK(read_reg(0x0614) == (HM2_GTAG_IOPORT << 24));
+    CHECK(read_reg(0x061c) == ((HM2_GTAG_IOPORT << 24) | (HM2_GTAG_PWMGEN << 8) | HM2_PWMGEN_OUT1));
+    CHECK(read_reg(0x062c) == ((HM2_GTAG_IOPORT << 24) | (HM2_GTAG_PKTUART_RX << 8) | HM2_PKTUART_RX_DATA));
+    CHECK(read_reg(0x0600 + (47 * 4)) == (HM2_GTAG_IOPORT << 24));
+
+    CHECK(hm2_fw_find_pin(HM2_GTAG_STEPGEN, 0, HM2_STEPGEN_DIR) == 1);
+    CHECK(hm2_fw_find_pin(HM2_GTAG_STEPGEN, 1, HM2_STEPGEN_DIR) == -1);
+}
+
+
+static void test_ioport(void) {
+    // Make GPIOs 0-3 outputs.
+    write_reg(0x1100, 0x0000000f);
+    CHECK((fake_gpio.oe & 0xff) == 0x0f);
+    CHECK(read_reg(0x1100) == 0x0000000f);
+
+    // GPIO16 isn't available on this board, it must stay an input.
+    write_reg(0x1100, 0x0001000f);
+    CHECK((fake_gpio.oe & (1 << 16)) == 0);
+
+    write_reg(0x1000, 0x00000005);
+    CHECK((fake_gpio.out & 0x0f) == 0x05);
+
+    // Inputs read the pins, unavailable pins read as 0.
+    fake_gpio.in = (1 << 8) | (1 << 16) | (1 << 26);
+    uint32_t in[2];
+    hm2_fw_read(0x1000, in, 2);
+    CHECK(in[0] == ((1 << 8) | 0x05));
+    CHECK(in[1] == (1 << 2));
+
+    write_reg(0x1100, 0x00000000);
+    CHECK((fake_gpio.oe & 0xff) == 0x00);
+
+    // AltSource hands pins with an alternate function (stepgen 0 has
+    // GPIOs 0 and 1) to their Module, pins without one stay with the
+    // ioport.
+    write_reg(0x1200, 0x00000021);
+    CHECK(read_reg(0x1200) == 0x00000021);
+    CHECK(fake_gpio.function[0] == GPIO_FUNC_PIO0);
+    CHECK(fake_gpio.function[5] == GPIO_FUNC_SIO);
+
+    // OutputInvert inverts a Module's output with the output override.
+    write_reg(0x1400, 0x00000001);
+    CHECK(fake_gpio.outover[0] == GPIO_OVERRIDE_INVERT);
+
+    write_reg(0x1200, 0x00000000);
+    CHECK(fake_gpio.function[0] == GPIO_FUNC_SIO);
+    CHECK(fake_gpio.outover[0] == GPIO_OVERRIDE_NORMAL);
+
+    // And the ioport's own outputs in software.
+    write_reg(0x1100, 0x00000003);
+    write_reg(0x1000, 0x00000000);
+    CHECK((fake_gpio.out & 0x03) == 0x01);
+    write_reg(0x1400, 0x00000000);
+    CHECK((fake_gpio.out & 0x03) == 0x00);
+
+    // Open drain outputs drive a 0 and float a 1, whatever the DDR says.
+    write_reg(0x1300, 0x00000002);
+    write_reg(0x1000, 0x00000000);
+    CHECK((fake_gpio.oe & 0x02) == 0x02);
+    CHECK((fake_gpio.out & 0x02) == 0x00);
+    write_reg(0x1000, 0x00000002);
+    CHECK((fake_gpio.oe & 0x02) == 0x00);
+    CHECK((fake_gpio.out & 0x02) == 0x00);
+    write_reg(0x1300, 0x00000000);
+    CHECK((fake_gpio.oe & 0x03) == 0x03);
+    CHECK((fake_gpio.out & 0x03) == 0x02);
+
+    // The second port is GPIOs 24-29 (the LED is on GPIO 25, it's not
+    // an I/O pin).
+    uint32_t ddr[2] = { 0x00000000, 0x00000004 };
+    hm2_fw_write(0x1100, ddr, 2);
+    CHECK((fake_gpio.oe & 0x1c40ffff) == (1 << 26));
+    write_reg(0x1004, 0x00000004);
+    CHECK((fake_gpio.out & (1 << 26)) == (1 << 26));
+    CHECK(read_reg(0x1104) == 0x00000004);
+    write_reg(0x1104, 0x00000000);
+    write_reg(0x1004, 0x00000000);
+}
+
+
+static void test_led(void) {
+    write_reg(HM2_LED_ADDR, 0x80000000);
+    hm2_led_region.update();
+    CHECK(fake_gpio.out & (1 << PICO_DEFAULT_LED_PIN));
+
+    write_reg(HM2_LED_ADDR, 0x00000000);
+    hm2_led_region.update();
+    CHECK(!(fake_gpio.out & (1 << PICO_DEFAULT_LED_PIN)));
+}
+
+
+static void test_spanning_access(void) {
+    // One access covering unclaimed space, the LED region, and more
+    // unclaimed space, ending exactly at the end of a page.
+    uint32_t out[4] = { 0x11111111, 0x80000000, 0x33333333, 0x44444444 };
+    uint32_t in[4];
+
+    hm2_fw_write(HM2_LED_ADDR - 4, out, 4);
+    hm2_fw_read(HM2_LED_ADDR - 4, in, 4);
+    CHECK(memcmp(in, out, sizeof(in)) == 0);
+    CHECK(*(uint32_t *)&hm2_register_file[HM2_LED_ADDR] == 0x80000000);
+
+    // An access that ends exactly at the end of the address space.
+    write_reg(0xfffc, 0x12345678);
+    CHECK(read_reg(0xfffc) == 0x12345678);
+
+    // Unaligned accesses, and accesses that would run past the end of
+    // the address space, are refused.
+    CHECK(hm2_fw_write(HM2_LED_ADDR - 2, out, 1) == -1);
+    CHECK(*(uint32_t *)&hm2_register_file[HM2_LED_ADDR] == 0x80000000);
+    CHECK(hm2_fw_read(0xfffe, in, 1) == -1);
+    CHECK(in[0] == 0);
+    CHECK(hm2_fw_write(0xfffc, out, 2) == -1);
+    CHECK(read_reg(0xfffc) == 0x12345678);
+    CHECK(hm2_fw_read(0xfff8, in, 2) == 0);
+}
+
+
+static void test_fifo(void) {
+    static uint32_t storage[4];
+    hm2_fifo_t fifo = HM2_FIFO_INIT(storage);
+    uint32_t val;
+
+    CHECK(fifo.size == 4);
+    CHECK(!hm2_fifo_pop(&fifo, &val));
+
+    // Fill it, past the end of the storage a few times.
+    for (uint32_t round = 0; round < 3; ++round) {
+        for (uint32_t i = 0; i < 4; ++i) {
+            CHECK(hm2_fifo_push(&fifo, (round << 8) | i));
+        }
+        CHECK(!hm2_fifo_push(&fifo, 0xdead));
+        CHECK(hm2_fifo_level(&fifo) == 4);
+
+        for (uint32_t i = 0; i < 4; ++i) {
+            CHECK(hm2_fifo_pop(&fifo, &val));
+            CHECK(val == ((round << 8) | i));
+        }
+        CHECK(!hm2_fifo_pop(&fifo, &val));
+        CHECK(hm2_fifo_level(&fifo) == 0);
+    }
+
+    CHECK(hm2_fifo_push(&fifo, 1));
+    hm2_fifo_flush(&fifo);
+    CHECK(hm2_fifo_level(&fifo) == 0);
+
+    // Non-incrementing accesses all go to the one register, one entry
+    // each.
+    uint32_t out[3] = { 1, 2, 3 };
+    uint32_t in[3];
+    hm2_fw_write_fifo(HM2_TESTFIFO_ADDR, out, 3);
+    CHECK(hm2_fifo_level(&testfifo) == 3);
+    hm2_fw_read_fifo(HM2_TESTFIFO_ADDR, in, 3);
+    CHECK((in[0] == 1) && (in[1] == 2) && (in[2] == 3));
+    CHECK(hm2_fifo_level(&testfifo) == 0);
+
+    // The IDROM is where it was.
+    CHECK(read_reg(0x0100) == 0x55aacafe);
+}
+
+
+static void test_profile(void) {
+    char name[9] = { 0 };
+
+    CHECK(read_reg(HM2_PROFILE_ADDR) == hm2_num_regions);
+    hm2_fw_read(HM2_PROFILE_ADDR + 0x40 + (HM2_REGION_INDEX_IOPORT * 0x40), (uint32_t *)name, 2);
+    CHECK(strcmp(name, "ioport") == 0);
+
+    // ioport has handled lots of writes by now.
+    CHECK(read_reg(HM2_PROFILE_ADDR + 0x40 + (HM2_REGION_INDEX_IOPORT * 0x40) + 0x20) > 0);
+
+    // The profile registers are read-only.
+    write_reg(HM2_PROFILE_ADDR, 0);
+    CHECK(read_reg(HM2_PROFILE_ADDR) == hm2_num_regions);
+}
+
+
+static void test_dpll(void) {
+    // 1 kHz nominal, from the fake 125 MHz ClockLow, but the host's
+    // servo thread really runs at 1000.5 us with up to 30 us of network
+    // jitter.  Timer 1 fires 100 us before the reference.
+    uint32_t rate = (uint32_t)((1000.0 * 4294967296.0) / 125e6 + 0.5);
+    write_reg(HM2_DPLL_ADDR + 0x000, rate);
+    write_reg(HM2_DPLL_ADDR + 0x200, 0);
+    write_reg(HM2_DPLL_ADDR + 0x300, 0x400000);
+    write_reg(HM2_DPLL_ADDR + 0x400, (uint16_t)-6554);
+
+    CHECK(!hm2_dpll_locked());
+    CHECK(hm2_dpll_timer_us(1, 0) == UINT64_MAX);
+
+    uint64_t t = 1000 * 1000;
+    uint32_t lcg = 1;
+    for (int i = 0; i < 3000; ++i) {
+        t += 1000;
+        lcg = (lcg * 1103515245) + 12345;
+        fake_time_us = t + (i / 2) + ((lcg >> 16) % 30);
+        write_reg(HM2_DPLL_ADDR + 0x600, 0);
+    }
+    uint64_t last = fake_time_us;
+
+    CHECK(hm2_dpll_locked());
+    CHECK(read_reg(HM2_DPLL_ADDR + 0x300) == (0x80000000 | 0x400000));
+    int32_t phase_error = read_reg(HM2_DPLL_ADDR + 0x100);
+    CHECK((phase_error > -(1 << 28)) && (phase_error < (1 << 28)));
+    CHECK(read_reg(HM2_DPLL_ADDR + 0x700) == (uint32_t)last);
+
+    // The next reference is due at about t + 1000.5 + 15, timer 1 at
+    // 100 us before that.
+    uint64_t timer_1 = hm2_dpll_timer_us(1, last);
+    uint64_t expected = t + 1000 + 1500 + 15 - 100;
+    CHECK((timer_1 > expected - 10) && (timer_1 < expected + 10));
+
+    // The same reference and timer 1, asked from between them.
+    uint64_t ref = hm2_dpll_next_us(0, last + 500);
+    CHECK((ref > expected + 100 - 10) && (ref < expected + 100 + 10));
+    CHECK(hm2_dpll_next_us(1, last + 500) == timer_1);
+
+    // The ioport reads the inputs sampled at timer 1 while locked.
+    fake_gpio.in = (1 << 3);
+    hm2_ioport_region.sample();
+    fake_gpio.in = (1 << 4);
+    CHECK(read_reg(HM2_IOPORT_ADDR) == (1 << 3));
+
+    // When the host stops, the DPLL soon lets go, and the ioport reads
+    // the live inputs again.
+    fake_time_us += 10 * 1000;
+    CHECK(!hm2_dpll_locked());
+    CHECK(hm2_dpll_timer_us(1, fake_time_us) == UINT64_MAX);
+    CHECK(read_reg(HM2_IOPORT_ADDR) == (1 << 4));
+
+    // A 10 Hz reference, and one that comes 40 ms (0.4 periods) late.
+    // (The rate rounds to a period of 99.88 ms, hence the tolerance.)
+    rate = (uint32_t)((10.0 * 4294967296.0) / 125e6 + 0.5);
+    write_reg(HM2_DPLL_ADDR + 0x000, rate);
+    fake_time_us = 2000 * 1000;
+    write_reg(HM2_DPLL_ADDR + 0x600, 0);
+    fake_time_us += (100 + 40) * 1000;
+    write_reg(HM2_DPLL_ADDR + 0x600, 0);
+    phase_error = read_reg(HM2_DPLL_ADDR + 0x100);
+    int32_t expected_error = (int32_t)(0.4 * 4294967296.0);
+    CHECK((phase_error > expected_error - (1 << 23)) && (phase_error < expected_error + (1 << 23)));
+
+    write_reg(HM2_DPLL_ADDR + 0x000, 0);
+    fake_gpio.in = 0;
+    fake_time_us = 0;
+}
+
+
+// The DMA channel feeding stepgen 0's state machine.
+static uint stepgen_dma_chan(void) {
+    for (uint chan = 0; chan < NUM_DMA_CHANNELS; ++chan) {
+        if (dma_hw->ch[chan].write_addr == (uintptr_t)&pio0->txf[0]) {
+            return chan;
+        }
+    }
+    return 0;
+}
+
+
+// Let the DMA feed `slots` slots of commands to the state machine, and
+// return how many steps they make.
+static uint32_t stepgen_play(uint chan, int slots) {
+    uint32_t steps = 0;
+    for (int word = 0; word < slots * 8; ++word) {
+        uint32_t cmd = *(uint32_t const *)dma_hw->ch[chan].read_addr;
+        if (((dma_hw->ch[chan].read_addr / 4) % 2) == 0) {
+            steps += (cmd >> 1) & 0x7fff;
+        }
+        fake_dma_transfer(chan, 1);
+    }
+    return steps;
+}
+
+
+static void test_stepgen(void) {
+    uint chan = stepgen_dma_chan();
+    CHECK(dma_channel_is_busy(chan));
+
+    // About 10 steps per 100 us update period.
+    write_reg(HM2_STEPGEN_ADDR, (uint32_t)((10.0 * 4294967296.0) / 12500));
+
+    // In step with the DMA, the accumulator matches the steps made so
+    // far.
+    uint32_t steps = 0;
+    for (int i = 0; i < 20; ++i) {
+        hm2_stepgen_region.update();
+        CHECK((read_reg(HM2_STEPGEN_ADDR + 0x100) >> 16) == steps);
+        steps += stepgen_play(chan, 1);
+    }
+    CHECK(steps > 100);
+
+    // Core 1 misses several updates in a row: the state machine plays
+    // the two slots already written, then idle slots, not the commands
+    // left from the last time round the ring.
+    uint32_t late = stepgen_play(chan, 6);
+    CHECK((late > 0) && (late <= 2 * 11));
+    steps += late;
+    for (int i = 0; i < 10; ++i) {
+        hm2_stepgen_region.update();
+        CHECK((read_reg(HM2_STEPGEN_ADDR + 0x100) >> 16) == steps);
+        steps += stepgen_play(chan, 1);
+    }
+
+    // The DMA stream carries on from where it was when its transfer
+    // count runs out.
+    dma_hw->ch[chan].transfer_count = 3;
+    for (int i = 0; i < 10; ++i) {
+        hm2_stepgen_region.update();
+        CHECK((read_reg(HM2_STEPGEN_ADDR + 0x100) >> 16) == steps);
+        steps += stepgen_play(chan, 1);
+    }
+    CHECK(dma_channel_is_busy(chan));
+    CHECK(dma_hw->ch[chan].transfer_count > (1u << 30));
+
+    write_reg(HM2_STEPGEN_ADDR, 0);
+    hm2_stepgen_region.update();
+}
+
+
+// The DMA channel emptying encoder 0's state machine's RX FIFO.
+static uint encoder_dma_chan(void) {
+    for (uint chan = 0; chan < NUM_DMA_CHANNELS; ++chan) {
+        if (dma_hw->ch[chan].read_addr == (uintptr_t)&pio1->rxf[0]) {
+            return chan;
+        }
+    }
+    return 0;
+}
+
+
+// Push what the state machine would when the count changes to `count`
+// on PIO loop pass `pass`, and let the DMA move it to the ring.
+static void encoder_push(uint chan, uint64_t pass, uint16_t count) {
+    pio1->rxf[0] = ((-pass & 0x1fff) << 16) | count;
+    fake_dma_transfer(chan, 1);
+}
+
+
+// The PIO loop pass at fake time `us`.
+static uint64_t encoder_pass(uint64_t us) {
+    return ((us - START_US) * (HM2_SYS_CLOCK_HZ / (1000 * 1000))) / 15;
+}
+
+
+static void test_encoder(void) {
+    uint chan = encoder_dma_chan();
+    CHECK(dma_channel_is_busy(chan));
+
+    // Timestamps at ClockLow / 2, filter clock ClockLow / 5.
+    write_reg(HM2_ENCODER_ADDR + 0x200, 0);
+    write_reg(HM2_ENCODER_ADDR + 0x400, 3);
+
+    // Without the Filter bit a count has to last 3 filter clocks, 15
+    // cycles, it shows at once.
+    fake_time_us = START_US + 1000;
+    uint64_t pass = encoder_pass(fake_time_us);
+    encoder_push(chan, pass - 10, 1);
+    hm2_encoder_region.update();
+    uint32_t count = read_reg(HM2_ENCODER_ADDR);
+    CHECK((count & 0xffff) == 1);
+    CHECK((count >> 16) == (uint16_t)(((pass - 10) * 15) / 2));
+
+    // With it, 15 filter clocks (5 passes): a glitch never shows, and
+    // leaves the timestamp alone.
+    write_reg(HM2_ENCODER_ADDR + 0x100, 1 << 11);
+    encoder_push(chan, pass - 3, 2);
+    encoder_push(chan, pass - 2, 1);
+    hm2_encoder_region.update();
+    CHECK(read_reg(HM2_ENCODER_ADDR) == count);
+    fake_time_us += 10;
+    hm2_encoder_region.update();
+    CHECK(read_reg(HM2_ENCODER_ADDR) == count);
+
+    // A real change shows once it's lasted that long.
+    pass = encoder_pass(fake_time_us);
+    encoder_push(chan, pass - 2, 2);
+    hm2_encoder_region.update();
+    CHECK(read_reg(HM2_ENCODER_ADDR) == count);
+    fake_time_us += 1;
+    hm2_encoder_region.update();
+    CHECK(read_reg(HM2_ENCODER_ADDR) == (((uint16_t)(((pass - 2) * 15) / 2) << 16) | 2));
+
+    // The timestamp clock is right however long the firmware has run.
+    uint64_t run_us = 48ull * 60 * 60 * 1000 * 1000;
+    fake_time_us = START_US + run_us;
+    hm2_encoder_region.update();
+    CHECK(read_reg(HM2_ENCODER_ADDR + 0x300) == (uint32_t)((run_us * (HM2_SYS_CLOCK_HZ / (1000 * 1000))) / 2));
+
+    write_reg(HM2_ENCODER_ADDR + 0x100, 0);
+    write_reg(HM2_ENCODER_ADDR + 0x400, 0);
+    fake_time_us = 0;
+}
+
+
+// The DMA channel feeding pwmgen 0's slice, GPIOs 6 and 7 are slice 3.
+#define PWMGEN_SLICE 3
+
+static uint pwmgen_dma_chan(void) {
+    for (uint chan = 0; chan < NUM_DMA_CHANNELS; ++chan) {
+        if (dma_hw->ch[chan].write_addr == (uintptr_t)&pwm_hw->slice[PWMGEN_SLICE].cc) {
+            return chan;
+        }
+    }
+    return 0;
+}
+
+
+// Let the DMA feed the slice `periods` PDM periods, and return how many
+// counts Out0 was on for.
+static uint32_t pwmgen_play(uint chan, uint32_t periods) {
+    uint32_t on = 0;
+    for (uint32_t i = 0; i < periods; ++i) {
+        fake_dma_transfer(chan, 1);
+        uint32_t cc = pwm_hw->slice[PWMGEN_SLICE].cc & 0xffff;
+        CHECK(cc <= 16);
+        on += cc;
+    }
+    return on;
+}
+
+
+// Play the rest of the ring the DMA is in, from period `k`, and check
+// each period is what the ring for `duty` says.
+static void pwmgen_check_ring(uint chan, uint32_t k, uint32_t duty) {
+    CHECK(dma_hw->ch[chan].transfer_count == 256 - k);
+    for (; k < 256; ++k) {
+        CHECK(pwmgen_play(chan, 1) == (((k + 1) * duty) >> 8) - ((k * duty) >> 8));
+    }
+}
+
+
+static void test_pwmgen(void) {
+    pwm_slice_hw_t * slice = &pwm_hw->slice[PWMGEN_SLICE];
+
+    // 11 bit symmetrical PWM/Dir at ClockHigh / 2.  Out0 is channel A,
+    // Out1 (Dir, full on for negative) is channel B.
+    write_reg(HM2_PWMGEN_ADDR + 0x200, 0x8000);
+    write_reg(HM2_PWMGEN_ADDR + 0x100, 0x2 | (1 << 2));
+    write_reg(HM2_PWMGEN_ADDR, 0x80000000 | (1000 << 16));
+    write_reg(HM2_PWMGEN_ADDR + 0x400, 1);
+    hm2_pwmgen_region.update();
+    CHECK(slice->top == 2047);
+    CHECK(slice->div == (2 << 4));
+    CHECK(slice->csr & PWM_CH0_CSR_PH_CORRECT_BITS);
+    CHECK(slice->cc == ((2048 << 16) | 1000));
+
+    // The width sets TOP, and the duty cycle is clamped to it.
+    write_reg(HM2_PWMGEN_ADDR + 0x100, 0x0);
+    write_reg(HM2_PWMGEN_ADDR, 1000 << 16);
+    hm2_pwmgen_region.update();
+    CHECK(slice->top == 511);
+    CHECK(!(slice->csr & PWM_CH0_CSR_PH_CORRECT_BITS));
+    CHECK(slice->cc == 511);
+    write_reg(HM2_PWMGEN_ADDR + 0x100, 0x3);
+    hm2_pwmgen_region.update();
+    CHECK(slice->top == 4095);
+    CHECK(slice->cc == 1000);
+
+    // The rate sets the slice's 8.4 divider, 65536 / rate, which only
+    // goes from 1 to 255 15/16.
+    static struct {
+        uint32_t rate;
+        uint32_t div;
+    } const rate_div[] = {
+        { 0x10000, 0x010 },
+        { 0x20000, 0x010 },
+        { 0x01234, 0x0e1 },
+        { 0x00101, 0xff0 },
+        { 0x00003, 0xfff },
+    };
+    for (size_t i = 0; i < sizeof(rate_div) / sizeof(rate_div[0]); ++i) {
+        write_reg(HM2_PWMGEN_ADDR + 0x200, rate_div[i].rate);
+        hm2_pwmgen_region.update();
+        CHECK(slice->div == rate_div[i].div);
+    }
+
+    // A rate of 0 turns it off.
+    write_reg(HM2_PWMGEN_ADDR + 0x200, 0);
+    hm2_pwmgen_region.update();
+    CHECK(slice->cc == 0);
+
+    // PDM/Dir, at ClockHigh, counts to 16 and the DMA spreads the duty
+    // cycle over a ring of 256 periods.
+    write_reg(HM2_PWMGEN_ADDR + 0x300, 0x10000);
+    write_reg(HM2_PWMGEN_ADDR + 0x100, 3 << 3);
+    hm2_pwmgen_region.update();
+    uint chan = pwmgen_dma_chan();
+    CHECK(dma_channel_is_busy(chan));
+    CHECK(slice->top == 15);
+    CHECK(slice->div == 0x010);
+    pwmgen_check_ring(chan, 0, 1000);
+
+    // Whatever the duty cycle, a ring is on for exactly that many
+    // counts.  A new value plays once the DMA is done with the ring it
+    // has already started again.
+    static uint32_t const duties[] = { 0, 1, 255, 2049, 4095 };
+    uint32_t last = 1000;
+    for (size_t i = 0; i < sizeof(duties) / sizeof(duties[0]); ++i) {
+        write_reg(HM2_PWMGEN_ADDR, duties[i] << 16);
+        hm2_pwmgen_region.update();
+        CHECK(pwmgen_play(chan, 256) == last);
+        pwmgen_check_ring(chan, 0, duties[i]);
+        last = duties[i];
+    }
+
+    // A change part way round the ring waits for the end of the ring,
+    // the DMA never plays a ring that's being rewritten.
+    write_reg(HM2_PWMGEN_ADDR, 1000 << 16);
+    hm2_pwmgen_region.update();
+    CHECK(pwmgen_play(chan, 256) == 4095);
+    CHECK(pwmgen_play(chan, 100) == ((100 * 1000) >> 8));
+    write_reg(HM2_PWMGEN_ADDR, 3000 << 16);
+    hm2_pwmgen_region.update();
+    pwmgen_check_ring(chan, 100, 1000);
+    CHECK(pwmgen_play(chan, 256) == 3000);
+
+    // A second change before the DMA has got to the first waits for a
+    // later update.
+    CHECK(pwmgen_play(chan, 10) == ((10 * 3000) >> 8));
+    write_reg(HM2_PWMGEN_ADDR, 2000 << 16);
+    hm2_pwmgen_region.update();
+    write_reg(HM2_PWMGEN_ADDR, 500 << 16);
+    hm2_pwmgen_region.update();
+    pwmgen_check_ring(chan, 10, 3000);
+    CHECK(pwmgen_play(chan, 256) == 2000);
+    hm2_pwmgen_region.update();
+    CHECK(pwmgen_play(chan, 256) == 2000);
+    CHECK(pwmgen_play(chan, 256) == 500);
+
+    // Disabled, the DMA stops and the outputs go low.
+    write_reg(HM2_PWMGEN_ADDR + 0x400, 0);
+    hm2_pwmgen_region.update();
+    CHECK(!dma_channel_is_busy(chan));
+    CHECK(slice->cc == 0);
+
+    write_reg(HM2_PWMGEN_ADDR, 0);
+    write_reg(HM2_PWMGEN_ADDR + 0x100, 0);
+    write_reg(HM2_PWMGEN_ADDR + 0x300, 0);
+    hm2_pwmgen_region.update();
+}
+
+
+// The DMA channel emptying the capture state machine's RX FIFO, its
+// state machine is the one after encoder 0's.
+static uint capture_dma_chan(void) {
+    for (uint chan = 0; chan < NUM_DMA_CHANNELS; ++chan) {
+        if (dma_hw->ch[chan].read_addr == (uintptr_t)&pio1->rxf[1]) {
+            return chan;
+        }
+    }
+    return 0;
+}
+
+
+// Push `count` samples of the GPIOs, as the state machine would one a
+// microsecond, and let the DMA move them to the ring.
+static void capture_push(uint chan, uint32_t gpios, int count) {
+    for (int i = 0; i < count; ++i) {
+        pio1->rxf[1] = gpios;
+        fake_dma_transfer(chan, 1);
+    }
+}
+
+
+#define CAPTURE_PIN 8
+
+static uint32_t capture_reg(uint16_t addr) {
+    return read_reg(HM2_CAPTURE_ADDR + addr);
+}
+
+
+static void test_capture(void) {
+    uint chan = capture_dma_chan();
+    CHECK(dma_channel_is_busy(chan));
+
+    // FDEBUG is write 1 to clear, but here it's plain memory: clear the
+    // stall flag capture_start() cleared.
+    pio1->fdebug = 0;
+
+    // Watch GPIOs 8 and 9, GPIO 9 has to hold a new state for 5 us.
+    // Their states start out as they are, without edges.
+    write_reg(HM2_CAPTURE_ADDR + 0x100, (1 << 8) | (1 << 9));
+    write_reg(HM2_CAPTURE_ADDR + 0x200 + (9 * 4), 5);
+    capture_push(chan, 1 << 8, 10);
+    fake_time_us = START_US + 20;
+    hm2_capture_region.update();
+    CHECK(capture_reg(0x000) == (1 << 8));
+    CHECK(capture_reg(0x004) == START_US + 20);
+    CHECK(capture_reg(0x008) == 0);
+
+    // Edges are timed by their sample, GPIO 9's 3 us glitch is filtered
+    // out.
+    capture_push(chan, 0, 5);
+    capture_push(chan, 1 << 9, 3);
+    capture_push(chan, 0, 10);
+    hm2_capture_region.update();
+    CHECK(capture_reg(0x000) == 0);
+    CHECK(capture_reg(0x008) == 1);
+    CHECK(capture_reg(0x088 + (8 * 4)) == START_US + 10);
+
+    // A change that lasts the filter time is timed from when it began.
+    capture_push(chan, 1 << 9, 6);
+    hm2_capture_region.update();
+    CHECK(capture_reg(0x000) == (1 << 9));
+    CHECK(capture_reg(0x008) == 2);
+    CHECK(capture_reg(0x010 + (9 * 4)) == START_US + 28);
+
+    write_reg(HM2_CAPTURE_ADDR + 0x200 + (9 * 4), 0);
+    capture_push(chan, 0, 1);
+    hm2_capture_region.update();
+    fake_time_us = 0;
+}
+
+
+// Toggles GPIO 8 every sample, an odd number of times in each update
+// of the capture region, as fast as it can until told to stop.  The
+// updates spend most of their time publishing, so the reader often
+// catches one part way through, even on a single CPU.
+#define CAPTURE_TOGGLES 255
+
+static bool volatile capture_stop;
+
+static void * capture_writer(void * arg) {
+    uint chan = capture_dma_chan();
+    uint32_t level = 0;
+    while (!capture_stop) {
+        for (int i = 0; i < CAPTURE_TOGGLES; ++i) {
+            level ^= 1 << CAPTURE_PIN;
+            capture_push(chan, level, 1);
+        }
+        hm2_capture_region.update();
+    }
+    return NULL;
+}
+
+
+static void test_capture_seqlock(void) {
+    // The host's one read of the registers it wants each servo period
+    // is a snapshot of one update: the state, the edge count, and the
+    // edge times always agree.
+    uint32_t edges = capture_reg(0x008);
+    pthread_t writer;
+    capture_stop = false;
+    CHECK(pthread_create(&writer, NULL, capture_writer, NULL) == 0);
+
+    while (capture_reg(0x008) == edges) {
+    }
+
+    int torn = 0;
+    for (int i = 0; i < 1000 * 1000; ++i) {
+        uint32_t regs[64];
+        hm2_fw_read(HM2_CAPTURE_ADDR, regs, 64);
+        bool high = regs[0] & (1 << CAPTURE_PIN);
+        uint32_t rise = regs[(0x010 / 4) + CAPTURE_PIN];
+        uint32_t fall = regs[(0x088 / 4) + CAPTURE_PIN];
+        if ((high != (((regs[2] - edges) & 1) == 1)) || (high != (rise > fall))) {
+            ++torn;
+        }
+    }
+
+    capture_stop = true;
+    pthread_join(writer, NULL);
+    CHECK(torn == 0);
+    CHECK((hm2_region_state[HM2_REGION_INDEX_CAPTURE].seq & 1) == 0);
+
+    // Leave GPIO 8 low.
+    if (capture_reg(0x000) & (1 << CAPTURE_PIN)) {
+        capture_push(capture_dma_chan(), 0, 1);
+        hm2_capture_region.update();
+    }
+    write_reg(HM2_CAPTURE_ADDR + 0x100, 0);
+    hm2_capture_region.update();
+}
+
+
+// The PktUART's state machine is in PIO0, after stepgen 0's.
+#define PKTUART_SM 1
+
+// The DMA channel emptying the PktUART state machine's RX FIFO.
+static uint pktuart_dma_chan(void) {
+    for (uint chan = 0; chan < NUM_DMA_CHANNELS; ++chan) {
+        if (dma_hw->ch[chan].read_addr == (uintptr_t)&pio0->rxf[PKTUART_SM]) {
+            return chan;
+        }
+    }
+    return 0;
+}
+
+
+// Push what the state machine would for a received byte (the 8 data
+// bits then the stop bit, shifted in from the top), and let the DMA
+// move it to the ring.
+static void pktuart_push(uint chan, uint8_t byte, bool stop) {
+    pio0->rxf[PKTUART_SM] = (stop ? (1u << 31) : 0) | ((uint32_t)byte << 23);
+    fake_dma_transfer(chan, 1);
+}
+
+
+// The next byte the state machine would send, or -1 if there's none.
+static int pktuart_pop(void) {
+    uint32_t word;
+    if (!fake_pio_tx_pop(0, PKTUART_SM, &word)) {
+        return -1;
+    }
+    return word;
+}
+
+
+static void pktuart_update(uint64_t now) {
+    fake_time_us = now;
+    hm2_pktuart_tx_region.update();
+}
+
+
+static void test_pktuart(void) {
+    uint64_t now = START_US + (10 * 1000);
+
+    // About 115200 bits/s, ClockLow * rate / 2^20, with 10 bit times
+    // between frames.  The state machine runs 8 clocks a bit.
+    uint32_t rate = 967;
+    uint32_t div = (1u << 25) / rate;
+    write_reg(HM2_PKTUART_TX_ADDR + 0x200, rate);
+    write_reg(HM2_PKTUART_TX_ADDR + 0x300, 10 << 8);
+    pktuart_update(now);
+    CHECK(pio0->sm[PKTUART_SM].clkdiv == (((div >> 8) << 16) | ((div & 0xff) << 8)));
+
+    // Data words queue up bytes LSB first, and a frame count write sends
+    // that many.  The frame count reads the frames waiting, the mode
+    // register has them too, and whether there's data waiting.
+    write_reg(HM2_PKTUART_TX_ADDR, 0x44332211);
+    write_reg(HM2_PKTUART_TX_ADDR, 0x00000055);
+    write_reg(HM2_PKTUART_TX_ADDR + 0x100, 5);
+    CHECK(read_reg(HM2_PKTUART_TX_ADDR + 0x100) == 1);
+    CHECK(read_reg(HM2_PKTUART_TX_ADDR + 0x300) == ((1 << 21) | (1 << 16) | (10 << 8)));
+
+    // The state machine's FIFO takes 4 bytes at a time.
+    pktuart_update(now);
+    CHECK(read_reg(HM2_PKTUART_TX_ADDR + 0x100) == 0);
+    CHECK(read_reg(HM2_PKTUART_TX_ADDR + 0x300) & (1 << 7));
+    for (int i = 0; i < 4; ++i) {
+        CHECK(pktuart_pop() == 0x11 * (i + 1));
+    }
+    CHECK(pktuart_pop() == -1);
+    pktuart_update(now);
+    CHECK(pktuart_pop() == 0x55);
+    CHECK(read_reg(HM2_PKTUART_TX_ADDR + 0x300) == ((1 << 7) | (10 << 8)));
+
+    // The next frame waits for the last byte and the inter-frame delay.
+    write_reg(HM2_PKTUART_TX_ADDR, 0x00000066);
+    write_reg(HM2_PKTUART_TX_ADDR + 0x100, 1);
+    pktuart_update(now + 100);
+    CHECK(read_reg(HM2_PKTUART_TX_ADDR + 0x100) == 1);
+    CHECK(pktuart_pop() == -1);
+    now += 1000;
+    pktuart_update(now);
+    CHECK(read_reg(HM2_PKTUART_TX_ADDR + 0x100) == 0);
+    CHECK(pktuart_pop() == 0x66);
+    now += 1000;
+    pktuart_update(now);
+    CHECK(read_reg(HM2_PKTUART_TX_ADDR + 0x300) == (10 << 8));
+
+    // A frame count FIFO overflow sets the FIFO error bit until the
+    // mode register is written.
+    for (int i = 0; i < 17; ++i) {
+        write_reg(HM2_PKTUART_TX_ADDR + 0x100, 0);
+    }
+    CHECK(read_reg(HM2_PKTUART_TX_ADDR + 0x100) == 16);
+    CHECK(read_reg(HM2_PKTUART_TX_ADDR + 0x300) & (1 << 4));
+    write_reg(HM2_PKTUART_TX_ADDR + 0x300, 10 << 8);
+    CHECK(!(read_reg(HM2_PKTUART_TX_ADDR + 0x300) & (1 << 4)));
+    for (int i = 0; i < 16; ++i) {
+        pktuart_update(now);
+    }
+    CHECK(read_reg(HM2_PKTUART_TX_ADDR + 0x100) == 0);
+
+    // Received bytes make a frame once the line has been quiet for the
+    // inter-frame delay.
+    uint chan = pktuart_dma_chan();
+    CHECK(dma_channel_is_busy(chan));
+    write_reg(HM2_PKTUART_RX_ADDR + 0x300, (10 << 8) | (1 << 3));
+    for (int i = 0; i < 5; ++i) {
+        pktuart_push(chan, 0xa1 + i, true);
+    }
+    pktuart_update(now);
+    CHECK(read_reg(HM2_PKTUART_RX_ADDR + 0x300) == ((1 << 21) | (10 << 8) | (1 << 3)));
+    CHECK(read_reg(HM2_PKTUART_RX_ADDR + 0x100) == 0);
+    now += 1000;
+    pktuart_update(now);
+    CHECK(read_reg(HM2_PKTUART_RX_ADDR + 0x300) == ((1 << 21) | (1 << 16) | (10 << 8) | (1 << 3)));
+
+    // The frame count and data registers pop, and read 0 when they're
+    // empty.
+    CHECK(read_reg(HM2_PKTUART_RX_ADDR + 0x100) == 5);
+    CHECK(read_reg(HM2_PKTUART_RX_ADDR + 0x100) == 0);
+    CHECK(read_reg(HM2_PKTUART_RX_ADDR) == 0xa4a3a2a1);
+    CHECK(read_reg(HM2_PKTUART_RX_ADDR) == 0x000000a5);
+    CHECK(read_reg(HM2_PKTUART_RX_ADDR) == 0);
+    CHECK(read_reg(HM2_PKTUART_RX_ADDR + 0x300) == ((10 << 8) | (1 << 3)));
+
+    // A missing stop bit marks the frame and the mode register, until
+    // the mode register is written.
+    pktuart_push(chan, 0x5a, false);
+    pktuart_update(now);
+    now += 1000;
+    pktuart_update(now);
+    CHECK(read_reg(HM2_PKTUART_RX_ADDR + 0x100) == ((1 << 14) | 1));
+    CHECK(read_reg(HM2_PKTUART_RX_ADDR) == 0x5a);
+    CHECK(read_reg(HM2_PKTUART_RX_ADDR + 0x300) & (1 << 1));
+    write_reg(HM2_PKTUART_RX_ADDR + 0x300, (10 << 8) | (1 << 3));
+    pktuart_update(now);
+    CHECK(!(read_reg(HM2_PKTUART_RX_ADDR + 0x300) & (1 << 1)));
+
+    // Without Receive enable, bytes are dropped.
+    write_reg(HM2_PKTUART_RX_ADDR + 0x300, 10 << 8);
+    pktuart_push(chan, 0x42, true);
+    pktuart_update(now);
+    now += 1000;
+    pktuart_update(now);
+    CHECK(read_reg(HM2_PKTUART_RX_ADDR + 0x100) == 0);
+    CHECK(read_reg(HM2_PKTUART_RX_ADDR) == 0);
+
+    fake_time_us = 0;
+}
+
+
+// Run everything that's due at `now`, and return the order the test
+// regions ran in.
+static char const * run_due(uint64_t now) {
+    fake_time_us = now;
+    num_updates = 0;
+    while (hm2_fw_run_one(now)) {
+    }
+    updates[num_updates] = '\0';
+    return updates;
+}
+
+
+static void test_scheduler(void) {
+    uint64_t start = START_US + (10 * 1000 * 1000);
+    hm2_fw_schedule_init(start);
+
+    // Everything's due at the start, the shortest period goes first.
+    CHECK(strcmp(run_due(start), "FS") == 0);
+    CHECK(strcmp(run_due(start + 49), "") == 0);
+    CHECK(strcmp(run_due(start + 50), "F") == 0);
+
+    // Late updates stay on the time grid, and count the periods they
+    // skipped: the fast one was due at +100, and skips +100 to +950.
+    hm2_region_state_t const * fast = &hm2_region_state[HM2_REGION_INDEX_FAST];
+    CHECK(fast->deadline_misses == 0);
+    CHECK(strcmp(run_due(start + 1000), "FS") == 0);
+    CHECK(fast->deadline_misses == 18);
+    CHECK(fast->deadline == start + 1050);
+    CHECK(strcmp(run_due(start + 1260), "F") == 0);
+    CHECK(fast->deadline_misses == 18 + 4);
+    CHECK(fast->deadline == start + 1300);
+    CHECK(hm2_region_state[HM2_REGION_INDEX_SLOW].deadline_misses == 0);
+    CHECK(hm2_region_state[HM2_REGION_INDEX_SLOW].deadline == start + 2000);
+
+    fake_time_us = 0;
+}
+
+
+#define SEQLOCK_REGS 32
+
+// Publishes the same number to all of the slow region's first
+// SEQLOCK_REGS registers, a new one each time, as fast as it can until
+// told to stop.
+static bool volatile seqlock_stop;
+
+static void * seqlock_writer(void * arg) {
+    uint32_t volatile * regs = &hm2_register_file32[HM2_SLOW_ADDR / 4];
+    for (uint32_t i = 1; !seqlock_stop; ++i) {
+        hm2_fw_publish_begin(HM2_SLOW_ADDR);
+        for (int r = 0; r < SEQLOCK_REGS; ++r) {
+            regs[r] = i;
+        }
+        hm2_fw_publish_end(HM2_SLOW_ADDR);
+    }
+    return NULL;
+}
+
+
+static void test_seqlock(void) {
+    // Core 1 publishing, core 0 reading, never a mix of two updates.
+    pthread_t writer;
+    seqlock_stop = false;
+    CHECK(pthread_create(&writer, NULL, seqlock_writer, NULL) == 0);
+
+    // Until the writer's first update, there's nothing to tear.
+    while (hm2_region_state[HM2_REGION_INDEX_SLOW].seq == 0) {
+    }
+
+    int torn = 0;
+    uint32_t last = 0;
+    for (int i = 0; i < 100 * 1000; ++i) {
+        uint32_t regs[SEQLOCK_REGS];
+        hm2_fw_read(HM2_SLOW_ADDR, regs, SEQLOCK_REGS);
+        for (int r = 1; r < SEQLOCK_REGS; ++r) {
+            if (regs[r] != regs[0]) {
+                ++torn;
+                break;
+            }
+        }
+        last = regs[0];
+    }
+
+    seqlock_stop = true;
+    pthread_join(writer, NULL);
+    CHECK(torn == 0);
+    CHECK(last != 0);
+    CHECK((hm2_region_state[HM2_REGION_INDEX_SLOW].seq & 1) == 0);
+}
+
+
+// Memory spaces 2 and 7 are the board's, as in the transport.
+uint8_t memory_space_2[128] = { 0x00, 0x08, 0xdc, 0x01, 0x02, 0x03 };
+memory_space_7_t memory_space_7 = { .card_name = "TESTCARD" };
+
+// LBP16 command bits.
+#define LBP16_WRITE     0x8000
+#define LBP16_ADDR      0x4000
+#define LBP16_INFO_AREA 0x2000
+#define LBP16_SPACE(n)  ((n) << 10)
+#define LBP16_16BIT     0x0100
+#define LBP16_32BIT     0x0200
+#define LBP16_INC       0x0080
+
+static uint8_t packet[LBP16_MAX_PACKET];
+static size_t packet_size;
+static uint32_t reply_words[LBP16_MAX_PACKET / 4];
+static uint8_t * const reply = (uint8_t *)reply_words;
+
+
+static void put16(uint16_t val) {
+    packet[packet_size++] = val & 0xff;
+    packet[packet_size++] = val >> 8;
+}
+
+
+static void put32(uint32_t val) {
+    put16(val & 0xffff);
+    put16(val >> 16);
+}
+
+
+static uint16_t reply16(size_t offset) {
+    return reply[offset] | (reply[offset + 1] << 8);
+}
+
+
+static uint32_t reply32(size_t offset) {
+    return reply16(offset) | ((uint32_t)reply16(offset + 2) << 16);
+}
+
+
+static int send_packet(bool cache) {
+    memset(reply_words, 0xaa, sizeof(reply_words));
+    return lbp16_handle_packet(packet, packet_size, reply, cache);
+}
+
+
+// One 16-bit access to memory space `space`.
+static int ms_access(int space, bool write, uint16_t addr, uint16_t val) {
+    packet_size = 0;
+    put16((write ? LBP16_WRITE : 0) | LBP16_ADDR | LBP16_SPACE(space) | LBP16_16BIT | 1);
+    put16(addr);
+    if (write) {
+        put16(val);
+    }
+    return send_packet(false);
+}
+
+
+// The servo thread's packet: write two registers at `addr`, read them
+// back, and read the one after them without an address.
+static void build_servo_packet(uint16_t addr, uint32_t a, uint32_t b) {
+    packet_size = 0;
+    put16(LBP16_WRITE | LBP16_ADDR | LBP16_32BIT | LBP16_INC | 2);
+    put16(addr);
+    put32(a);
+    put32(b);
+    put16(LBP16_ADDR | LBP16_32BIT | LBP16_INC | 2);
+    put16(addr);
+    put16(LBP16_32BIT | LBP16_INC | 1);
+}
+
+
+static void test_lbp16(void) {
+    write_reg(0x5008, 0x0000abcd);
+    write_reg(0x5018, 0x0000dcba);
+
+    // The first time parses it, and caches its plan.
+    build_servo_packet(0x5000, 0x11, 0x22);
+    CHECK(send_packet(true) == 12);
+    CHECK((reply32(0) == 0x11) && (reply32(4) == 0x22) && (reply32(8) == 0xabcd));
+    CHECK(eth_info_area[0].address_pointer == 0x500c);
+
+    // The plan runs with the new data, and leaves the address pointer
+    // where the packet does.
+    build_servo_packet(0x5000, 0x33, 0x44);
+    eth_info_area[0].address_pointer = 0x1234;
+    CHECK(send_packet(true) == 12);
+    CHECK((read_reg(0x5000) == 0x33) && (read_reg(0x5004) == 0x44));
+    CHECK((reply32(0) == 0x33) && (reply32(4) == 0x44) && (reply32(8) == 0xabcd));
+    CHECK(eth_info_area[0].address_pointer == 0x500c);
+
+    // The same layout at other addresses isn't the same plan.
+    build_servo_packet(0x5010, 0x55, 0x66);
+    CHECK(send_packet(true) == 12);
+    CHECK((reply32(0) == 0x55) && (reply32(4) == 0x66) && (reply32(8) == 0xdcba));
+    CHECK(read_reg(0x5000) == 0x33);
+
+    // Nor does the management socket run or make plans.
+    build_servo_packet(0x5000, 0x77, 0x88);
+    CHECK(send_packet(false) == 12);
+    CHECK((reply32(0) == 0x77) && (reply32(4) == 0x88) && (reply32(8) == 0xabcd));
+
+    // A command without an address, and without an earlier one setting
+    // the address pointer, uses wherever the last packet left it.
+    packet_size = 0;
+    put16(LBP16_32BIT | LBP16_INC | 1);
+    for (int i = 0; i < 2; ++i) {
+        eth_info_area[0].address_pointer = 0x5008;
+        CHECK(send_packet(true) == 4);
+        CHECK(reply32(0) == 0xabcd);
+        eth_info_area[0].address_pointer = 0x5018;
+        CHECK(send_packet(true) == 4);
+        CHECK(reply32(0) == 0xdcba);
+    }
+
+    // The info area has the address pointer, and it's the only thing
+    // there that can be written.
+    packet_size = 0;
+    put16(LBP16_INFO_AREA | LBP16_ADDR | LBP16_16BIT | LBP16_INC | 4);
+    put16(0);
+    CHECK(lbp16_is_management(packet, packet_size));
+    CHECK(send_packet(true) == 8);
+    CHECK((reply16(0) == 0x5a00) && (reply16(6) == 0x5018 + 4));
+    uint16_t write_errors = memory_space_6[MS6_LBP_WRITE_ERRORS];
+    packet_size = 0;
+    put16(LBP16_WRITE | LBP16_INFO_AREA | LBP16_ADDR | LBP16_16BIT | 1);
+    put16(6);
+    put16(0x5000);
+    put16(LBP16_WRITE | LBP16_INFO_AREA | LBP16_ADDR | LBP16_16BIT | 1);
+    put16(0);
+    put16(0xdead);
+    put16(LBP16_32BIT | LBP16_INC | 1);
+    CHECK(send_packet(true) == 4);
+    CHECK(reply32(0) == 0x77);
+    CHECK(eth_info_area[0].cookie == 0x5a00);
+    CHECK(memory_space_6[MS6_LBP_WRITE_ERRORS] == write_errors + 1);
+
+    // Register data that isn't word-aligned in the packet or the reply,
+    // behind a 16-bit memory space 6 access.
+    for (int i = 0; i < 2; ++i) {
+        packet_size = 0;
+        put16(LBP16_WRITE | LBP16_ADDR | LBP16_SPACE(6) | LBP16_16BIT | 1);
+        put16(MS6_SCRATCH * 2);
+        put16(0x1234);
+        put16(LBP16_WRITE | LBP16_ADDR | LBP16_32BIT | LBP16_INC | 1);
+        put16(0x5020);
+        put32(0xcafe0000 + i);
+        put16(LBP16_ADDR | LBP16_SPACE(6) | LBP16_16BIT | 1);
+        put16(MS6_SCRATCH * 2);
+        put16(LBP16_ADDR | LBP16_32BIT | LBP16_INC | 1);
+        put16(0x5020);
+        CHECK(send_packet(true) == 6);
+        CHECK(reply16(0) == 0x1234);
+        CHECK(reply32(2) == 0xcafe0000 + i);
+    }
+
+    // The hm2 registers are 32-bit only.  Other sizes are refused, and
+    // reads still take up their room in the reply.
+    uint16_t mem_errors = memory_space_6[MS6_LBP_MEM_ERRORS];
+    for (int i = 0; i < 2; ++i) {
+        packet_size = 0;
+        put16(LBP16_WRITE | LBP16_ADDR | LBP16_16BIT | LBP16_INC | 2);
+        put16(0x5000);
+        put16(0xffff);
+        put16(0xffff);
+        put16(LBP16_ADDR | LBP16_16BIT | LBP16_INC | 3);
+        put16(0x5000);
+        put16(LBP16_ADDR | LBP16_32BIT | LBP16_INC | 1);
+        put16(0x5008);
+        CHECK(send_packet(true) == 10);
+        CHECK((reply16(0) == 0) && (reply16(2) == 0) && (reply16(4) == 0));
+        CHECK(reply32(6) == 0xabcd);
+        CHECK(read_reg(0x5000) == 0x77);
+    }
+    CHECK(memory_space_6[MS6_LBP_MEM_ERRORS] == mem_errors + 4);
+
+    // Bad packets, and replies that don't fit, get no reply at all.
+    uint16_t parse_errors = memory_space_6[MS6_LBP_PARSE_ERRORS];
+    uint16_t tx_bad = memory_space_6[MS6_TX_BAD_COUNT];
+    packet_size = 0;
+    put16(LBP16_ADDR | LBP16_32BIT | LBP16_INC | 0);
+    put16(0x5000);
+    CHECK(send_packet(false) == -1);
+    packet_size = 0;
+    put16(LBP16_WRITE | LBP16_ADDR | LBP16_32BIT | LBP16_INC | 2);
+    put16(0x5000);
+    put32(0);
+    CHECK(send_packet(false) == -1);
+    CHECK(memory_space_6[MS6_LBP_PARSE_ERRORS] == parse_errors + 2);
+    packet_size = 0;
+    for (int i = 0; i < 3; ++i) {
+        put16(LBP16_ADDR | LBP16_32BIT | LBP16_INC | 127);
+        put16(0x5000);
+    }
+    CHECK(send_packet(false) == -1);
+    CHECK(memory_space_6[MS6_TX_BAD_COUNT] == tx_bad + 1);
+}
+
+
+static void test_lbp16_memory_spaces(void) {
+    // Memory space 2 is the EEPROM, 7 the board id, and neither can be
+    // written.
+    CHECK(ms_access(2, false, 0, 0) == 2);
+    CHECK(reply16(0) == 0x0800);
+    CHECK(ms_access(7, false, 0, 0) == 2);
+    CHECK(reply16(0) == ('T' | ('E' << 8)));
+    uint16_t write_errors = memory_space_6[MS6_LBP_WRITE_ERRORS];
+    CHECK(ms_access(7, true, 0, 0x4141) == 0);
+    CHECK(memory_space_7.card_name[0] == 'T');
+    CHECK(memory_space_6[MS6_LBP_WRITE_ERRORS] == write_errors + 1);
+
+    // Reads past the end read zeros, and count.
+    uint16_t mem_errors = memory_space_6[MS6_LBP_MEM_ERRORS];
+    CHECK(ms_access(6, false, 32, 0) == 2);
+    CHECK(reply16(0) == 0);
+    CHECK(memory_space_6[MS6_LBP_MEM_ERRORS] == mem_errors + 1);
+
+    // Memory space 4: the microsecond timer, and waits that move the
+    // fake time on.
+    fake_time_us = 0x701234;
+    CHECK(ms_access(4, false, 0, 0) == 2);
+    CHECK(reply16(0) == 0x1234);
+    CHECK(ms_access(4, true, 2, 100) == 0);
+    CHECK(fake_time_us == 0x701234 + 100);
+    CHECK(ms_access(4, false, 2, 0) == 2);
+    CHECK(reply16(0) == 100);
+
+    // With the DPLL not tracking, WaitForHM2 waits out HM2Timeout, and
+    // says so in the error register.
+    CHECK(ms_access(4, true, 4, 500) == 0);
+    CHECK(ms_access(4, false, 4, 0) == 2);
+    CHECK(reply16(0) == 500);
+    uint64_t before = fake_time_us;
+    CHECK(ms_access(4, false, 8, 0) == 2);
+    CHECK(reply16(0) == 500);
+    CHECK(fake_time_us == before + 500);
+    CHECK(memory_space_6[MS6_ERROR] & MS6_ERROR_HM2_TIMEOUT);
+
+    // The waits in one packet stop short of making watchdog.c think
+    // core 0 has stalled.
+    CHECK(ms_access(6, true, MS6_ERROR * 2, 0) == 0);
+    before = fake_time_us;
+    packet_size = 0;
+    put16(LBP16_WRITE | LBP16_ADDR | LBP16_SPACE(4) | LBP16_16BIT | 2);
+    put16(2);
+    put16(65535);
+    put16(65535);
+    put16(LBP16_ADDR | LBP16_SPACE(4) | LBP16_16BIT | 1);
+    put16(8);
+    CHECK(send_packet(false) == 2);
+    CHECK(reply16(0) == 0);
+    CHECK(fake_time_us == before + (50 * 1000));
+    CHECK(memory_space_6[MS6_ERROR] & MS6_ERROR_HM2_TIMEOUT);
+
+    CHECK(ms_access(4, true, 4, 1000) == 0);
+    CHECK(ms_access(6, true, MS6_ERROR * 2, 0) == 0);
+    CHECK(memory_space_6[MS6_ERROR] == 0);
+    fake_time_us = 0;
+}
+
+
+// A FlashAddress write and a 32-bit access to register `reg` of memory
+// space 3, with `count` values.
+static void build_flash_packet(uint32_t addr, uint16_t reg, bool write, int count, uint32_t first) {
+    packet_size = 0;
+    put16(LBP16_WRITE | LBP16_ADDR | LBP16_SPACE(3) | LBP16_32BIT | 1);
+    put16(FLASH_UPDATE_ADDRESS);
+    put32(addr);
+    put16((write ? LBP16_WRITE : 0) | LBP16_ADDR | LBP16_SPACE(3) | LBP16_32BIT | count);
+    put16(reg);
+    for (int i = 0; write && (i < count); ++i) {
+        put32(first + i);
+    }
+}
+
+
+static void test_flash_update(void) {
+    uint8_t * slot = &fake_flash[FLASH_UPDATE_SLOT];
+    memset(slot - FLASH_SECTOR_SIZE, 0, FLASH_SECTOR_SIZE + FLASH_BLOCK_SIZE);
+
+    CHECK(ms_access(3, false, FLASH_UPDATE_ID, 0) == 2);
+    CHECK(reply16(0) == 0);
+    build_flash_packet(0, FLASH_UPDATE_ID, false, 1, 0);
+    CHECK(send_packet(false) == 4);
+    CHECK(reply32(0) == 0x15);
+
+    // Erasing a block queues one erase per sector, and packets that use
+    // the flash wait for it.
+    build_flash_packet(FLASH_UPDATE_SLOT + 0x100, FLASH_UPDATE_SEC_ERASE, true, 1, 0);
+    CHECK(send_packet(false) == 0);
+    CHECK(flash_update_busy());
+    CHECK(lbp16_uses_flash(packet, packet_size));
+    CHECK(lbp16_is_management(packet, packet_size));
+    build_servo_packet(0x5000, 0, 0);
+    CHECK(!lbp16_uses_flash(packet, packet_size));
+    CHECK(!lbp16_is_management(packet, packet_size));
+    int polls = 1;
+    while (flash_update_poll()) {
+        ++polls;
+    }
+    CHECK(polls == FLASH_BLOCK_SIZE / FLASH_SECTOR_SIZE);
+    CHECK(!flash_update_busy());
+    CHECK((slot[0] == 0xff) && (slot[FLASH_BLOCK_SIZE - 1] == 0xff));
+    CHECK(fake_flash[FLASH_UPDATE_SLOT - 1] == 0);
+
+    // A page of FlashData is programmed once it's all there.
+    build_flash_packet(FLASH_UPDATE_SLOT, FLASH_UPDATE_DATA, true, FLASH_PAGE_SIZE / 8, 0x10000);
+    CHECK(send_packet(false) == 0);
+    CHECK(!flash_update_busy());
+    build_flash_packet(FLASH_UPDATE_SLOT + (FLASH_PAGE_SIZE / 2), FLASH_UPDATE_DATA, true, FLASH_PAGE_SIZE / 8, 0x20000);
+    CHECK(send_packet(false) == 0);
+    CHECK(flash_update_busy());
+    CHECK(!flash_update_poll());
+    uint32_t word;
+    memcpy(&word, &slot[FLASH_PAGE_SIZE - 4], sizeof(word));
+    CHECK(word == 0x20000 + (FLASH_PAGE_SIZE / 8) - 1);
+
+    build_flash_packet(FLASH_UPDATE_SLOT + 4, FLASH_UPDATE_DATA, false, 2, 0);
+    CHECK(send_packet(false) == 8);
+    CHECK((reply32(0) == 0x10001) && (reply32(4) == 0x10002));
+
+    // Nothing outside the update slot can be written.
+    uint16_t write_errors = memory_space_6[MS6_LBP_WRITE_ERRORS];
+    build_flash_packet(0, FLASH_UPDATE_DATA, true, 1, 0);
+    CHECK(send_packet(false) == 0);
+    build_flash_packet(0, FLASH_UPDATE_SEC_ERASE, true, 1, 0);
+    CHECK(send_packet(false) == 0);
+    CHECK(memory_space_6[MS6_LBP_WRITE_ERRORS] == write_errors + 2);
+    CHECK(!flash_update_busy());
+    CHECK(fake_flash[0] == 0xff);
+}
+
+
+static void test_watchdog(void) {
+    // 1 ms, at the fake 125 MHz ClockLow.
+    fake_time_us = 5 * 1000 * 1000;
+    write_reg(HM2_WATCHDOG_ADDR + 0x000, 125 * 1000);
+
+    write_reg(0x1100, 0x0000000f);
+    write_reg(0x1000, 0x00000005);
+    write_reg(0x1200, 0x00000001);
+    write_reg(HM2_LED_ADDR, 0x80000000);
+    hm2_led_region.update();
+
+    // Its alarm interrupt preempts the W5500's (on the GPIO interrupt),
+    // so a packet that's busy waiting can't hold off the bite.
+    bool preempts = false;
+    for (int i = TIMER_IRQ_0; i <= TIMER_IRQ_3; ++i) {
+        preempts = preempts || (fake_irq_priority[i] < fake_irq_priority[IO_IRQ_BANK0]);
+    }
+    CHECK(preempts);
+
+    // Petting it in time keeps it from biting.
+    fake_time_us += 900;
+    fake_pico_run_alarms();
+    write_reg(HM2_WATCHDOG_ADDR + 0x200, 0x5a);
+    fake_time_us += 900;
+    fake_pico_run_alarms();
+    CHECK((read_reg(HM2_WATCHDOG_ADDR + 0x100) & 0x1) == 0);
+    CHECK((fake_gpio.oe & 0x0f) == 0x0f);
+
+    // When it bites, every output goes to its safe state.
+    fake_time_us += 200;
+    fake_pico_run_alarms();
+    CHECK((read_reg(HM2_WATCHDOG_ADDR + 0x100) & 0x1) == 0x1);
+    CHECK((fake_gpio.oe & 0xff) == 0);
+    CHECK(read_reg(0x1100) == 0);
+    CHECK(read_reg(0x1200) == 0);
+    CHECK(fake_gpio.function[0] == GPIO_FUNC_SIO);
+    CHECK(!(fake_gpio.out & (1 << PICO_DEFAULT_LED_PIN)));
+    CHECK(read_reg(HM2_LED_ADDR) == 0);
+
+    // Until the host clears the bite, writes to the Modules with
+    // outputs are dropped, like the rest of a packet it interrupted.
+    write_reg(0x1100, 0x0000000f);
+    write_reg(HM2_STEPGEN_ADDR, 0x1000);
+    CHECK(read_reg(0x1100) == 0);
+    CHECK(read_reg(HM2_STEPGEN_ADDR) == 0);
+    CHECK((fake_gpio.oe & 0xff) == 0);
+
+    // The host clears the bite, and can disable the watchdog.
+    write_reg(HM2_WATCHDOG_ADDR + 0x100, 0);
+    CHECK((read_reg(HM2_WATCHDOG_ADDR + 0x100) & 0x1) == 0);
+    write_reg(0x1100, 0x0000000f);
+    CHECK((fake_gpio.oe & 0x0f) == 0x0f);
+    write_reg(0x1100, 0);
+    write_reg(HM2_WATCHDOG_ADDR + 0x000, 0);
+    fake_time_us += 10 * 1000;
+    fake_pico_run_alarms();
+    CHECK((read_reg(HM2_WATCHDOG_ADDR + 0x100) & 0x1) == 0);
+
+    // Core 1 feeds the RP2040 watchdog while core 0's main loop is
+    // going, and notes which core stalled when one does.
+    hm2_watchdog_core0_poll();
+    hm2_watchdog_core1_poll();
+    CHECK(fake_watchdog.enabled);
+    CHECK(fake_watchdog.updates == 1);
+
+    // Timer interrupts still running on core 0 don't count.
+    fake_time_us += 150 * 1000;
+    fake_pico_run_repeating_timers();
+    hm2_watchdog_core1_poll();
+    CHECK(fake_watchdog.updates == 1);
+    CHECK(watchdog_hw->scratch[0] == 0x68320000);
+
+    hm2_watchdog_core0_poll();
+    hm2_watchdog_core1_poll();
+    CHECK(fake_watchdog.updates == 2);
+
+    fake_time_us += 150 * 1000;
+    fake_pico_run_repeating_timers();
+    CHECK(watchdog_hw->scratch[0] == 0x68320001);
+
+    // The heartbeats are 32-bit, and a heartbeat from just before the
+    // low word of the us timer wraps isn't a stall just after it.
+    watchdog_hw->scratch[0] = 0;
+    fake_time_us = (1ull << 32) - 50;
+    hm2_watchdog_core0_poll();
+    hm2_watchdog_core1_poll();
+    fake_time_us = (1ull << 32) + 50;
+    hm2_watchdog_core1_poll();
+    fake_pico_run_repeating_timers();
+    CHECK(fake_watchdog.updates == 4);
+    CHECK(watchdog_hw->scratch[0] == 0);
+
+    fake_time_us = 0;
+}
+
+
+int main(void) {
+    fake_pico_reset();
+
+    fake_time_us = START_US;
+    CHECK(hm2_fw_init() == 0);
+    fake_time_us = 0;
+
+    test_page_table();
+    test_idrom();
+    test_ioport();
+    test_led();
+    test_spanning_access();
+    test_fifo();
+    test_profile();
+    test_dpll();
+    test_stepgen();
+    test_encoder();
+    test_pwmgen();
+    test_capture();
+    test_pktuart();
+    test_scheduler();
+    test_seqlock();
+    test_capture_seqlock();
+    test_lbp16();
+    test_lbp16_memory_spaces();
+    test_flash_update();
+    test_watchdog();
+
+    if (failures > 0) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}